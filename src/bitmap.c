@@ -0,0 +1,111 @@
+#include "bitmap.h"
+
+#include <assert.h>
+
+uint64_t sfs_bitmap_words(uint64_t bits) {
+  return (bits + SFS_BITMAP_WORD_BITS - 1) / SFS_BITMAP_WORD_BITS;
+}
+
+bool sfs_bitmap_test(const uint64_t* map, uint64_t bit) {
+  return map[bit / SFS_BITMAP_WORD_BITS] >> (bit % SFS_BITMAP_WORD_BITS) & 1;
+}
+
+void sfs_bitmap_set(uint64_t* map, uint64_t bit) {
+  map[bit / SFS_BITMAP_WORD_BITS] |= 1llu << (bit % SFS_BITMAP_WORD_BITS);
+}
+
+void sfs_bitmap_clear(uint64_t* map, uint64_t bit) {
+  map[bit / SFS_BITMAP_WORD_BITS] &= ~(1llu << (bit % SFS_BITMAP_WORD_BITS));
+}
+
+void sfs_bitmap_set_range(uint64_t* map, uint64_t start, uint64_t end) {
+  for (; start < end && start % SFS_BITMAP_WORD_BITS != 0; ++start) {
+    sfs_bitmap_set(map, start);
+  }
+  for (; start + SFS_BITMAP_WORD_BITS <= end; start += SFS_BITMAP_WORD_BITS) {
+    map[start / SFS_BITMAP_WORD_BITS] = ~0llu;
+  }
+  for (; start < end; ++start) {
+    sfs_bitmap_set(map, start);
+  }
+}
+
+void sfs_bitmap_clear_range(uint64_t* map, uint64_t start, uint64_t end) {
+  for (; start < end && start % SFS_BITMAP_WORD_BITS != 0; ++start) {
+    sfs_bitmap_clear(map, start);
+  }
+  for (; start + SFS_BITMAP_WORD_BITS <= end; start += SFS_BITMAP_WORD_BITS) {
+    map[start / SFS_BITMAP_WORD_BITS] = 0;
+  }
+  for (; start < end; ++start) {
+    sfs_bitmap_clear(map, start);
+  }
+}
+
+uint64_t sfs_bitmap_count_ones(const uint64_t* map, uint64_t start,
+                               uint64_t end) {
+  uint64_t count = 0;
+  for (; start < end && start % SFS_BITMAP_WORD_BITS != 0; ++start) {
+    count += sfs_bitmap_test(map, start);
+  }
+  for (; start + SFS_BITMAP_WORD_BITS <= end; start += SFS_BITMAP_WORD_BITS) {
+    count += __builtin_popcountll(map[start / SFS_BITMAP_WORD_BITS]);
+  }
+  for (; start < end; ++start) {
+    count += sfs_bitmap_test(map, start);
+  }
+  return count;
+}
+
+/**
+ * finds the first bit in [start, end) that is set in |map| after xoring each
+ * word with |flip|
+ */
+static uint64_t find(const uint64_t* map, uint64_t start, uint64_t end,
+                     uint64_t flip) {
+  if (start >= end) {
+    return end;
+  }
+
+  uint64_t i = start / SFS_BITMAP_WORD_BITS;
+  // ignore the bits of the first word before |start|
+  uint64_t word = (map[i] ^ flip) & (~0llu << (start % SFS_BITMAP_WORD_BITS));
+  for (;;) {
+    if (word != 0) {
+      uint64_t bit = i * SFS_BITMAP_WORD_BITS + __builtin_ctzll(word);
+      return bit < end ? bit : end;
+    }
+    if (++i * SFS_BITMAP_WORD_BITS >= end) {
+      return end;
+    }
+    word = map[i] ^ flip;
+  }
+}
+
+uint64_t sfs_bitmap_find_zero(const uint64_t* map, uint64_t start,
+                              uint64_t end) {
+  return find(map, start, end, ~0llu);
+}
+
+uint64_t sfs_bitmap_find_one(const uint64_t* map, uint64_t start,
+                             uint64_t end) {
+  return find(map, start, end, 0);
+}
+
+uint64_t sfs_bitmap_find_zero_run(const uint64_t* map, uint64_t start,
+                                  uint64_t end, uint64_t len) {
+  assert(len > 0);
+
+  while (start < end) {
+    uint64_t run_start = sfs_bitmap_find_zero(map, start, end);
+    if (run_start == end || end - run_start < len) {
+      return end;
+    }
+    uint64_t run_end = sfs_bitmap_find_one(map, run_start, run_start + len);
+    if (run_end == run_start + len) {
+      return run_start;
+    }
+    start = run_end;
+  }
+  return end;
+}
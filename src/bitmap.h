@@ -0,0 +1,62 @@
+/**
+ * bitmaps stored as arrays of 64-bit words
+ *
+ * bit i is bit i % 64 of word i / 64. scans go a word at a time, skipping
+ * words that are all ones (or all zeros) without looking at their bits.
+ */
+
+#ifndef _BITMAP_H_
+#define _BITMAP_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SFS_BITMAP_WORD_BITS 64
+
+/**
+ * returns the number of words a bitmap of |bits| bits takes
+ */
+uint64_t sfs_bitmap_words(uint64_t bits);
+
+bool sfs_bitmap_test(const uint64_t* map, uint64_t bit);
+void sfs_bitmap_set(uint64_t* map, uint64_t bit);
+void sfs_bitmap_clear(uint64_t* map, uint64_t bit);
+
+/**
+ * sets bits [start, end) of |map|
+ */
+void sfs_bitmap_set_range(uint64_t* map, uint64_t start, uint64_t end);
+
+/**
+ * clears bits [start, end) of |map|
+ */
+void sfs_bitmap_clear_range(uint64_t* map, uint64_t start, uint64_t end);
+
+/**
+ * returns the number of set bits of |map| in [start, end)
+ */
+uint64_t sfs_bitmap_count_ones(const uint64_t* map, uint64_t start,
+                               uint64_t end);
+
+/**
+ * returns the first clear bit of |map| in [start, end), or |end| if there is
+ * none
+ */
+uint64_t sfs_bitmap_find_zero(const uint64_t* map, uint64_t start,
+                              uint64_t end);
+
+/**
+ * returns the first set bit of |map| in [start, end), or |end| if there is
+ * none
+ */
+uint64_t sfs_bitmap_find_one(const uint64_t* map, uint64_t start,
+                             uint64_t end);
+
+/**
+ * returns the first bit of the first run of at least |len| clear bits of
+ * |map| in [start, end), or |end| if there is none
+ */
+uint64_t sfs_bitmap_find_zero_run(const uint64_t* map, uint64_t start,
+                                  uint64_t end, uint64_t len);
+
+#endif  // _BITMAP_H_
@@ -0,0 +1,144 @@
+#include "bitmap.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// two bitmap blocks' worth of 4KiB blocks, so ranges can cross between them
+#define BLOCK_BITS (4096 * 8)
+#define BITS (2 * BLOCK_BITS)
+
+static uint64_t map[BITS / SFS_BITMAP_WORD_BITS];
+static bool reference[BITS];
+
+static uint64_t reference_find(uint64_t start, uint64_t end, bool value) {
+  for (uint64_t i = start; i < end; ++i) {
+    if (reference[i] == value) {
+      return i;
+    }
+  }
+  return end;
+}
+
+static uint64_t reference_find_zero_run(uint64_t start, uint64_t end,
+                                        uint64_t len) {
+  uint64_t run = 0;
+  for (uint64_t i = start; i < end; ++i) {
+    run = reference[i] ? 0 : run + 1;
+    if (run == len) {
+      return i + 1 - len;
+    }
+  }
+  return end;
+}
+
+static void set_range(uint64_t start, uint64_t end) {
+  sfs_bitmap_set_range(map, start, end);
+  for (uint64_t i = start; i < end; ++i) {
+    reference[i] = true;
+  }
+}
+
+static void clear_range(uint64_t start, uint64_t end) {
+  sfs_bitmap_clear_range(map, start, end);
+  for (uint64_t i = start; i < end; ++i) {
+    reference[i] = false;
+  }
+}
+
+static void check_all(void) {
+  for (uint64_t i = 0; i < BITS; ++i) {
+    assert(sfs_bitmap_test(map, i) == reference[i]);
+  }
+}
+
+int main() {
+  assert(sfs_bitmap_words(0) == 0);
+  assert(sfs_bitmap_words(1) == 1);
+  assert(sfs_bitmap_words(64) == 1);
+  assert(sfs_bitmap_words(65) == 2);
+
+  // ranges that start and end on either side of word boundaries
+  set_range(60, 70);
+  set_range(127, 129);
+  set_range(192, 256);
+  set_range(300, 300);
+  check_all();
+  assert(sfs_bitmap_count_ones(map, 0, BITS) == 10 + 2 + 64);
+  assert(sfs_bitmap_count_ones(map, 63, 65) == 2);
+  assert(sfs_bitmap_find_one(map, 0, BITS) == 60);
+  assert(sfs_bitmap_find_zero(map, 60, BITS) == 70);
+  assert(sfs_bitmap_find_one(map, 70, BITS) == 127);
+  assert(sfs_bitmap_find_zero(map, 192, BITS) == 256);
+  assert(sfs_bitmap_find_one(map, 129, 192) == 192);
+  // |end| is returned, not a bit past it
+  assert(sfs_bitmap_find_one(map, 70, 100) == 100);
+  assert(sfs_bitmap_find_zero(map, 192, 250) == 250);
+  assert(sfs_bitmap_find_zero(map, 5, 5) == 5);
+  clear_range(64, 128);
+  check_all();
+  assert(sfs_bitmap_find_zero(map, 60, BITS) == 64);
+  assert(sfs_bitmap_find_one(map, 64, BITS) == 128);
+
+  // a run across the boundary between two bitmap blocks
+  clear_range(0, BITS);
+  set_range(0, BLOCK_BITS - 3);
+  set_range(BLOCK_BITS + 5, BITS);
+  check_all();
+  assert(sfs_bitmap_find_zero(map, 0, BITS) == BLOCK_BITS - 3);
+  assert(sfs_bitmap_find_zero_run(map, 0, BITS, 8) == BLOCK_BITS - 3);
+  assert(sfs_bitmap_find_zero_run(map, 0, BITS, 9) == BITS);
+  assert(sfs_bitmap_find_zero_run(map, 0, BLOCK_BITS, 3) == BLOCK_BITS - 3);
+  assert(sfs_bitmap_find_zero_run(map, 0, BLOCK_BITS, 4) == BLOCK_BITS);
+  assert(sfs_bitmap_find_one(map, BLOCK_BITS - 3, BITS) == BLOCK_BITS + 5);
+  assert(sfs_bitmap_count_ones(map, 0, BITS) == BITS - 8);
+
+  // a run found past shorter ones, and past a word of ones
+  clear_range(0, BITS);
+  set_range(0, BITS);
+  clear_range(10, 15);
+  clear_range(100, 130);
+  clear_range(200, 300);
+  check_all();
+  assert(sfs_bitmap_find_zero_run(map, 0, BITS, 5) == 10);
+  assert(sfs_bitmap_find_zero_run(map, 0, BITS, 6) == 100);
+  assert(sfs_bitmap_find_zero_run(map, 11, BITS, 5) == 100);
+  assert(sfs_bitmap_find_zero_run(map, 0, BITS, 31) == 200);
+  assert(sfs_bitmap_find_zero_run(map, 0, BITS, 101) == BITS);
+
+  // random ranges, checked against a bit at a time
+  srand(1);
+  clear_range(0, BITS);
+  for (int i = 0; i < 2000; ++i) {
+    uint64_t start = rand() % BITS;
+    uint64_t end = start + rand() % 300;
+    if (end > BITS) {
+      end = BITS;
+    }
+    if (rand() % 2) {
+      set_range(start, end);
+    } else {
+      clear_range(start, end);
+    }
+
+    uint64_t from = rand() % BITS;
+    uint64_t to = from + rand() % (BITS - from + 1);
+    uint64_t len = rand() % 200 + 1;
+    assert(sfs_bitmap_find_zero(map, from, to) ==
+           reference_find(from, to, false));
+    assert(sfs_bitmap_find_one(map, from, to) ==
+           reference_find(from, to, true));
+    assert(sfs_bitmap_find_zero_run(map, from, to, len) ==
+           reference_find_zero_run(from, to, len));
+  }
+  check_all();
+
+  uint64_t ones = 0;
+  for (uint64_t i = 0; i < BITS; ++i) {
+    ones += reference[i];
+  }
+  assert(sfs_bitmap_count_ones(map, 0, BITS) == ones);
+
+  printf("OK\n");
+}
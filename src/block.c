@@ -5,32 +5,411 @@
   See the file COPYING.
 */
 
+// for O_DIRECT
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include "block.h"
 
+#include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
 #include "log.h"
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// O_DIRECT bounce buffers: how many, their minimum size and memory alignment
+#define DIO_BUFFERS 4
+#define DIO_MIN_BUFFER_SIZE (64 * 1024)
+#define DIO_MEMORY_ALIGN 4096
+
+/**
+ * aligned buffers that O_DIRECT transfers go through
+ */
+struct dio_pool {
+  size_t buffer_size;
+  unsigned nfree;
+  void* free[DIO_BUFFERS];
+  // signalled (under the device's |mu|) when a buffer is given back
+  pthread_cond_t freed;
+  // serializes writes, so two that share a sector don't each write it back
+  // with a stale copy of the other's blocks
+  pthread_mutex_t write_mu;
+};
+
+#ifdef HAVE_LINUX_IO_URING_H
+// submission queue size; bigger batches are submitted in waves of this many
+#define URING_ENTRIES 64
+
+/**
+ * an io_uring set up by hand with the raw syscalls (no liburing)
+ */
+struct uring {
+  int fd;
+  unsigned entries;
+
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned* sq_mask;
+  unsigned* sq_array;
+  struct io_uring_sqe* sqes;
+
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned* cq_mask;
+  struct io_uring_cqe* cqes;
+
+  void* sq_ring;
+  size_t sq_ring_size;
+  void* cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+};
+#endif
+
+struct device {
+  int fd;
+  uint32_t block_size;
+  enum block_backend backend;
+
+  // the ring, the bounce buffers and the dirty range are shared by every
+  // thread doing I/O on the device; this serializes their use
+  pthread_mutex_t mu;
+#ifdef HAVE_LINUX_IO_URING_H
+  struct uring ring;
+#endif
+
+  // the whole file when mapped. blocks [dirty_lo, dirty_hi) cover everything
+  // written since the last sync.
+  char* map;
+  uint64_t map_blocks;
+  uint64_t dirty_lo;
+  uint64_t dirty_hi;
+
+  // O_DIRECT transfers start and end on multiples of |dio_align| bytes.
+  // |fd_flags| are the file status flags to restore on close.
+  uint64_t dio_align;
+  int fd_flags;
+  struct dio_pool pool;
+};
+
+/**
+ * maps all of |dev->fd|. the file has to be non-empty, and it can't grow while
+ * it is mapped.
+ */
+static int map_setup(struct device* dev) {
+  struct stat st;
+  if (fstat(dev->fd, &st) < 0) {
+    return -1;
+  }
+  dev->map_blocks = st.st_size / dev->block_size;
+  if (dev->map_blocks == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  void* map = mmap(NULL, dev->map_blocks * dev->block_size,
+                   PROT_READ | PROT_WRITE, MAP_SHARED, dev->fd, 0);
+  if (map == MAP_FAILED) {
+    return -1;
+  }
+  dev->map = map;
+  dev->dirty_lo = dev->map_blocks;
+  dev->dirty_hi = 0;
+  return 0;
+}
+
+/**
+ * copies block |block_num| out of the mapping. blocks past the end of the file
+ * read as zeros, like an unwritten block does with pread.
+ *
+ * returns 0 if the block was in the file, otherwise -1
+ */
+static int map_read(struct device* dev, uint64_t block_num, void* block) {
+  if (block_num >= dev->map_blocks) {
+    memset(block, 0, dev->block_size);
+    return -1;
+  }
+  memcpy(block, dev->map + block_num * dev->block_size, dev->block_size);
+  return 0;
+}
+
+static int map_write(struct device* dev, uint64_t block_num,
+                     const void* block) {
+  if (block_num >= dev->map_blocks) {
+    log_msg("block %" PRIu64 " is past the end of the mapping", block_num);
+    return -1;
+  }
+  memcpy(dev->map + block_num * dev->block_size, block, dev->block_size);
+  pthread_mutex_lock(&dev->mu);
+  if (block_num < dev->dirty_lo) dev->dirty_lo = block_num;
+  if (block_num >= dev->dirty_hi) dev->dirty_hi = block_num + 1;
+  pthread_mutex_unlock(&dev->mu);
+  return 0;
+}
+
+static int map_rw_runs(struct device* dev, const struct block_run* runs,
+                       uint64_t n, bool write) {
+  for (uint64_t r = 0; r < n; ++r) {
+    for (uint64_t i = 0; i < runs[r].count; ++i) {
+      if (write ? map_write(dev, runs[r].block_num + i, runs[r].blocks[i])
+                : map_read(dev, runs[r].block_num + i, runs[r].blocks[i])) {
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+/**
+ * switches |dev->fd| to O_DIRECT and sets up the bounce buffers. transfers are
+ * aligned to the logical block size of a block device, or to the preferred I/O
+ * size of a regular file (which is a multiple of what the filesystem needs).
+ */
+static int dio_setup(struct device* dev) {
+#ifdef O_DIRECT
+  struct stat st;
+  if (fstat(dev->fd, &st) < 0) {
+    return -1;
+  }
+  dev->dio_align = st.st_blksize;
+#ifdef BLKSSZGET
+  int sector_size;
+  if (S_ISBLK(st.st_mode) && ioctl(dev->fd, BLKSSZGET, &sector_size) == 0) {
+    dev->dio_align = sector_size;
+  }
+#endif
+  if (dev->dio_align < dev->block_size) {
+    dev->dio_align = dev->block_size;
+  }
+  if (dev->dio_align % dev->block_size != 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  struct dio_pool* pool = &dev->pool;
+  if (pthread_cond_init(&pool->freed, NULL)) {
+    return -1;
+  }
+  if (pthread_mutex_init(&pool->write_mu, NULL)) {
+    pthread_cond_destroy(&pool->freed);
+    return -1;
+  }
+
+  // room for the largest run plus a partial sector at each end
+  pool->buffer_size = DIO_MIN_BUFFER_SIZE;
+  if (pool->buffer_size < 4 * dev->dio_align) {
+    pool->buffer_size = 4 * dev->dio_align;
+  }
+  size_t memory_align = DIO_MEMORY_ALIGN;
+  if (memory_align < dev->dio_align) {
+    memory_align = dev->dio_align;
+  }
+  for (pool->nfree = 0; pool->nfree < DIO_BUFFERS; ++pool->nfree) {
+    int err = posix_memalign(&pool->free[pool->nfree], memory_align,
+                             pool->buffer_size);
+    if (err) {
+      while (pool->nfree > 0) free(pool->free[--pool->nfree]);
+      pthread_mutex_destroy(&pool->write_mu);
+      pthread_cond_destroy(&pool->freed);
+      errno = err;
+      return -1;
+    }
+  }
+
+  dev->fd_flags = fcntl(dev->fd, F_GETFL);
+  if (dev->fd_flags < 0 ||
+      fcntl(dev->fd, F_SETFL, dev->fd_flags | O_DIRECT) < 0) {
+    while (pool->nfree > 0) free(pool->free[--pool->nfree]);
+    pthread_mutex_destroy(&pool->write_mu);
+    pthread_cond_destroy(&pool->freed);
+    return -1;
+  }
+  return 0;
+#else
+  errno = ENOTSUP;
+  return -1;
+#endif
+}
+
+static void dio_teardown(struct device* dev) {
+  fcntl(dev->fd, F_SETFL, dev->fd_flags);
+  assert(dev->pool.nfree == DIO_BUFFERS);
+  while (dev->pool.nfree > 0) free(dev->pool.free[--dev->pool.nfree]);
+  pthread_mutex_destroy(&dev->pool.write_mu);
+  pthread_cond_destroy(&dev->pool.freed);
+}
+
+/**
+ * reads |len| bytes at |offset| into the aligned |buf|. whatever lies past the
+ * end of the file is zeroed.
+ *
+ * returns the number of bytes that were in the file, or -1 on failure
+ */
+static ssize_t dio_pread(int fd, char* buf, size_t len, off_t offset) {
+  ssize_t ret;
+  do {
+    ret = pread(fd, buf, len, offset);
+  } while (ret < 0 && errno == EINTR);
+  if (ret < 0) {
+    perror("block_read failed");
+    return -1;
+  }
+  // a short O_DIRECT read only happens at the end of the file
+  memset(buf + ret, 0, len - ret);
+  return ret;
+}
+
+static int dio_pwrite(int fd, const char* buf, size_t len, off_t offset) {
+  while (len > 0) {
+    ssize_t ret = pwrite(fd, buf, len, offset);
+    if (ret <= 0) {
+      if (ret < 0 && errno == EINTR) continue;
+      perror("block_write failed");
+      return -1;
+    }
+    buf += ret;
+    len -= ret;
+    offset += ret;
+  }
+  return 0;
+}
+
+/**
+ * the most blocks one bounce buffer can carry, wherever the run starts
+ */
+static uint64_t dio_max_blocks(const struct device* dev) {
+  return (dev->pool.buffer_size - 2 * dev->dio_align) / dev->block_size;
+}
+
+/**
+ * transfers the |count| blocks starting at |block_num| through a bounce
+ * buffer. writes that only cover part of a sector read the rest of it first.
+ * waits for a buffer if every one is in use.
+ *
+ * returns the number of blocks transferred (only reads stop short, at the end
+ * of the file), or -1 on failure
+ */
+static int64_t dio_rw(struct device* dev, uint64_t block_num, uint64_t count,
+                      void* const* blocks, bool write) {
+  assert(count <= dio_max_blocks(dev));
+  uint64_t align = dev->dio_align;
+  uint64_t block_size = dev->block_size;
+  uint64_t start = block_num * block_size;
+  uint64_t end = start + count * block_size;
+  uint64_t lo = start / align * align;
+  uint64_t hi = (end + align - 1) / align * align;
+
+  if (write) {
+    pthread_mutex_lock(&dev->pool.write_mu);
+  }
+  pthread_mutex_lock(&dev->mu);
+  while (dev->pool.nfree == 0) {
+    pthread_cond_wait(&dev->pool.freed, &dev->mu);
+  }
+  char* buf = dev->pool.free[--dev->pool.nfree];
+  pthread_mutex_unlock(&dev->mu);
+  int64_t ret = count;
+  if (!write) {
+    ssize_t got = dio_pread(dev->fd, buf, hi - lo, lo);
+    if (got < 0) {
+      ret = -1;
+    } else if ((uint64_t)got < end - lo) {
+      ret = got > (ssize_t)(start - lo) ? (got - (start - lo)) / block_size : 0;
+    }
+    for (uint64_t i = 0; ret >= 0 && i < count; ++i) {
+      memcpy(blocks[i], buf + (start - lo) + i * block_size, block_size);
+    }
+  } else {
+    // fill in the partial sectors at either end; they may be the same one
+    bool head = lo < start;
+    bool tail = hi > end && !(head && hi - align == lo);
+    if (head && dio_pread(dev->fd, buf, align, lo) < 0) {
+      ret = -1;
+    }
+    if (ret >= 0 && tail &&
+        dio_pread(dev->fd, buf + (hi - align - lo), align, hi - align) < 0) {
+      ret = -1;
+    }
+    for (uint64_t i = 0; ret >= 0 && i < count; ++i) {
+      memcpy(buf + (start - lo) + i * block_size, blocks[i], block_size);
+    }
+    if (ret >= 0 && dio_pwrite(dev->fd, buf, hi - lo, lo)) {
+      ret = -1;
+    }
+  }
+  pthread_mutex_lock(&dev->mu);
+  dev->pool.free[dev->pool.nfree++] = buf;
+  pthread_cond_signal(&dev->pool.freed);
+  pthread_mutex_unlock(&dev->mu);
+  if (write) {
+    pthread_mutex_unlock(&dev->pool.write_mu);
+  }
+  return ret;
+}
+
+static int dio_rw_runs(struct device* dev, const struct block_run* runs,
+                       uint64_t n, bool write) {
+  uint64_t max_blocks = dio_max_blocks(dev);
+  for (uint64_t r = 0; r < n; ++r) {
+    for (uint64_t i = 0; i < runs[r].count; i += max_blocks) {
+      uint64_t count = runs[r].count - i;
+      if (count > max_blocks) count = max_blocks;
+      if (dio_rw(dev, runs[r].block_num + i, count, runs[r].blocks + i,
+                 write) != (int64_t)count) {
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
 /** Read a block from an open file
  *
- * Read should return (1) exactly @BLOCK_SIZE when succeeded, or (2) 0 when the
- * requested block has never been touched before, or (3) a negtive value when
- * failed. In cases of error or return value equals to 0, the content of the
- * @buf is set to 0.
+ * Read should return (1) exactly the block size when succeeded, or (2) 0 when
+ * the requested block has never been touched before, or (3) a negtive value
+ * when failed. In cases of error or return value equals to 0, the content of
+ * the @buf is set to 0.
  */
-int block_read(int fd, uint64_t block_num, void* block) {
+int block_read(void* arg, uint64_t block_num, void* block) {
+  struct device* dev = (struct device*)arg;
   int ret = 0;
   // log_msg("block_read() %" PRIu64, block_num);
-  ret = pread(fd, block, BLOCK_SIZE, block_num * BLOCK_SIZE);
+  if (dev->backend == BLOCK_BACKEND_MMAP) {
+    return map_read(dev, block_num, block) ? 0 : dev->block_size;
+  }
+  if (dev->backend == BLOCK_BACKEND_DIRECT) {
+    ret = dio_rw(dev, block_num, 1, &block, false);
+    if (ret < 0) memset(block, 0, dev->block_size);
+    return ret > 0 ? dev->block_size : ret;
+  }
+  ret = pread(dev->fd, block, dev->block_size, block_num * dev->block_size);
   if (ret <= 0) {
-    memset(block, 0, BLOCK_SIZE);
+    memset(block, 0, dev->block_size);
     if (ret < 0) perror("block_read failed");
   }
 
@@ -39,13 +418,439 @@ int block_read(int fd, uint64_t block_num, void* block) {
 
 /** Write a block to an open file
  *
- * Write should return exactly @BLOCK_SIZE except on error.
+ * Write should return exactly the block size except on error.
  */
-int block_write(int fd, uint64_t block_num, const void* block) {
+int block_write(void* arg, uint64_t block_num, const void* block) {
+  struct device* dev = (struct device*)arg;
   int ret = 0;
   // log_msg("block_write() %" PRIu64, block_num);
-  ret = pwrite(fd, block, BLOCK_SIZE, block_num * BLOCK_SIZE);
+  if (dev->backend == BLOCK_BACKEND_MMAP) {
+    return map_write(dev, block_num, block) ? -1 : dev->block_size;
+  }
+  if (dev->backend == BLOCK_BACKEND_DIRECT) {
+    void* blocks[1] = {(void*)block};
+    return dio_rw(dev, block_num, 1, blocks, true) < 0 ? -1 : dev->block_size;
+  }
+  ret = pwrite(dev->fd, block, dev->block_size, block_num * dev->block_size);
   if (ret < 0) perror("block_write failed");
 
   return ret;
 }
+
+/**
+ * transfers |iovcnt| buffers at |offset| with preadv/pwritev, the first |done|
+ * bytes of which were already transferred. picks up after short transfers.
+ * |iov| is used as scratch space.
+ */
+static int rw_iov(int fd, struct iovec* iov, int iovcnt, off_t offset,
+                  size_t done, bool write) {
+  while (true) {
+    offset += done;
+    while (iovcnt > 0 && done >= iov->iov_len) {
+      done -= iov->iov_len;
+      ++iov;
+      --iovcnt;
+    }
+    if (iovcnt == 0) {
+      return 0;
+    }
+    iov->iov_base = (char*)iov->iov_base + done;
+    iov->iov_len -= done;
+
+    ssize_t ret = write ? pwritev(fd, iov, iovcnt, offset)
+                        : preadv(fd, iov, iovcnt, offset);
+    if (ret <= 0) {
+      if (ret < 0) perror(write ? "block_writev failed" : "block_readv failed");
+      return -1;
+    }
+    done = ret;
+  }
+}
+
+/**
+ * fills |iov| with up to IOV_MAX blocks of |run| starting at block |first|
+ *
+ * returns the number of blocks used
+ */
+static int fill_iov(const struct block_run* run, uint64_t first,
+                    size_t block_size, struct iovec* iov) {
+  int iovcnt = 0;
+  for (uint64_t i = first; i < run->count && iovcnt < IOV_MAX; ++i) {
+    iov[iovcnt].iov_base = run->blocks[i];
+    iov[iovcnt].iov_len = block_size;
+    ++iovcnt;
+  }
+  return iovcnt;
+}
+
+static int pread_rw_runs(struct device* dev, const struct block_run* runs,
+                         uint64_t n, bool write) {
+  struct iovec iov[IOV_MAX];
+  for (uint64_t r = 0; r < n; ++r) {
+    for (uint64_t i = 0; i < runs[r].count; i += IOV_MAX) {
+      int iovcnt = fill_iov(&runs[r], i, dev->block_size, iov);
+      off_t offset = (runs[r].block_num + i) * dev->block_size;
+      if (rw_iov(dev->fd, iov, iovcnt, offset, 0, write)) {
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+static int uring_setup(struct uring* ring, unsigned entries) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (ring->fd < 0) {
+    return -1;
+  }
+  ring->entries = p.sq_entries;
+
+  ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size =
+      p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  bool single_mmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single_mmap && ring->cq_ring_size > ring->sq_ring_size) {
+    ring->sq_ring_size = ring->cq_ring_size;
+  }
+  ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) {
+    close(ring->fd);
+    return -1;
+  }
+  ring->cq_ring = ring->sq_ring;
+  if (!single_mmap) {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) {
+      munmap(ring->sq_ring, ring->sq_ring_size);
+      close(ring->fd);
+      return -1;
+    }
+  }
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    if (!single_mmap) munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    return -1;
+  }
+
+  char* sq = ring->sq_ring;
+  ring->sq_head = (unsigned*)(sq + p.sq_off.head);
+  ring->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+  ring->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned*)(sq + p.sq_off.array);
+  char* cq = ring->cq_ring;
+  ring->cq_head = (unsigned*)(cq + p.cq_off.head);
+  ring->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+  ring->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+  return 0;
+}
+
+static void uring_teardown(struct uring* ring) {
+  munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring != ring->sq_ring) {
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  }
+  munmap(ring->sq_ring, ring->sq_ring_size);
+  close(ring->fd);
+}
+
+/**
+ * one submission: up to IOV_MAX blocks of a run
+ */
+struct uring_chunk {
+  struct iovec* iov;
+  int iovcnt;
+  off_t offset;
+};
+
+/**
+ * submits |n| chunks (at most the ring size) and waits for all of them.
+ * chunks the kernel only partly transferred are finished synchronously.
+ */
+static int uring_wave(struct device* dev, struct uring_chunk* chunks,
+                      unsigned n, bool write) {
+  struct uring* ring = &dev->ring;
+  assert(n <= ring->entries);
+
+  unsigned tail = *ring->sq_tail;
+  for (unsigned i = 0; i < n; ++i) {
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = dev->fd;
+    sqe->addr = (uint64_t)(uintptr_t)chunks[i].iov;
+    sqe->len = chunks[i].iovcnt;
+    sqe->off = chunks[i].offset;
+    sqe->user_data = i;
+    ring->sq_array[index] = index;
+    ++tail;
+  }
+  __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+  unsigned submitted = 0;
+  while (submitted < n) {
+    int ret = syscall(__NR_io_uring_enter, ring->fd, n - submitted, n,
+                      IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      perror("io_uring_enter failed");
+      return -1;
+    }
+    submitted += ret;
+  }
+
+  int result = 0;
+  unsigned reaped = 0;
+  while (reaped < n) {
+    unsigned head = *ring->cq_head;
+    unsigned cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    if (head == cq_tail) {
+      // completions trickled in; wait for the rest
+      if (syscall(__NR_io_uring_enter, ring->fd, 0, n - reaped,
+                  IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+          errno != EINTR) {
+        perror("io_uring_enter failed");
+        return -1;
+      }
+      continue;
+    }
+
+    for (; head != cq_tail; ++head, ++reaped) {
+      struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+      struct uring_chunk* chunk = &chunks[cqe->user_data];
+      if (cqe->res <= 0) {
+        errno = -cqe->res;
+        perror(write ? "block_write_runs failed" : "block_read_runs failed");
+        result = -1;
+      } else if (rw_iov(dev->fd, chunk->iov, chunk->iovcnt, chunk->offset,
+                        cqe->res, write)) {
+        result = -1;
+      }
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  return result;
+}
+
+static int uring_rw_runs(struct device* dev, const struct block_run* runs,
+                         uint64_t n, bool write) {
+  uint64_t total = 0;
+  for (uint64_t r = 0; r < n; ++r) {
+    total += runs[r].count;
+  }
+  struct iovec* iov = malloc(total * sizeof(struct iovec));
+  if (iov == NULL) {
+    log_msg("malloc failure");
+    return -1;
+  }
+
+  struct uring_chunk chunks[URING_ENTRIES];
+  unsigned queued = 0;
+  struct iovec* next_iov = iov;
+  int ret = 0;
+  for (uint64_t r = 0; r < n && ret == 0; ++r) {
+    for (uint64_t i = 0; i < runs[r].count && ret == 0; i += IOV_MAX) {
+      chunks[queued].iov = next_iov;
+      chunks[queued].iovcnt =
+          fill_iov(&runs[r], i, dev->block_size, next_iov);
+      chunks[queued].offset = (runs[r].block_num + i) * dev->block_size;
+      next_iov += chunks[queued].iovcnt;
+      if (++queued == dev->ring.entries) {
+        ret = uring_wave(dev, chunks, queued, write);
+        queued = 0;
+      }
+    }
+  }
+  if (ret == 0 && queued > 0) {
+    ret = uring_wave(dev, chunks, queued, write);
+  }
+
+  free(iov);
+  return ret;
+}
+#endif
+
+/** Open a block device on an open file
+ *
+ * Block i of the device is bytes [i * @block_size, (i + 1) * @block_size) of
+ * the file. Falls back to @BLOCK_BACKEND_PREAD when @backend isn't available.
+ * Returns NULL on failure.
+ */
+void* block_open(int fd, enum block_backend backend, uint32_t block_size) {
+  assert(block_size >= SFS_MIN_BLOCK_SIZE && block_size <= SFS_MAX_BLOCK_SIZE);
+  assert((block_size & (block_size - 1)) == 0);
+
+  struct device* dev = malloc(sizeof(struct device));
+  if (dev == NULL) {
+    return NULL;
+  }
+  if (pthread_mutex_init(&dev->mu, NULL)) {
+    free(dev);
+    return NULL;
+  }
+  dev->fd = fd;
+  dev->block_size = block_size;
+  dev->backend = BLOCK_BACKEND_PREAD;
+  dev->map = NULL;
+
+  if (backend == BLOCK_BACKEND_URING) {
+#ifdef HAVE_LINUX_IO_URING_H
+    if (uring_setup(&dev->ring, URING_ENTRIES) == 0) {
+      dev->backend = BLOCK_BACKEND_URING;
+      log_msg("using io_uring with %u entries", dev->ring.entries);
+    } else {
+      log_msg("io_uring unavailable (%s); using pread", strerror(errno));
+    }
+#else
+    log_msg("built without io_uring; using pread");
+#endif
+  } else if (backend == BLOCK_BACKEND_MMAP) {
+    if (map_setup(dev) == 0) {
+      dev->backend = BLOCK_BACKEND_MMAP;
+      log_msg("mapped %" PRIu64 " blocks", dev->map_blocks);
+    } else {
+      log_msg("can't map the disk file (%s); using pread", strerror(errno));
+    }
+  } else if (backend == BLOCK_BACKEND_DIRECT) {
+    if (dio_setup(dev) == 0) {
+      dev->backend = BLOCK_BACKEND_DIRECT;
+      log_msg("using O_DIRECT aligned to %" PRIu64 " bytes", dev->dio_align);
+    } else {
+      log_msg("O_DIRECT unavailable (%s); using pread", strerror(errno));
+    }
+  }
+
+  return dev;
+}
+
+/** Size in bytes of the blocks of a device
+ */
+uint32_t block_get_size(void* arg) {
+  struct device* dev = (struct device*)arg;
+  return dev->block_size;
+}
+
+/** Release a block device
+ *
+ * Syncs the device first. The file it was opened on stays open.
+ */
+void block_close(void* arg) {
+  struct device* dev = (struct device*)arg;
+  if (dev->backend == BLOCK_BACKEND_MMAP) {
+    block_sync(dev);
+    munmap(dev->map, dev->map_blocks * dev->block_size);
+  }
+  if (dev->backend == BLOCK_BACKEND_DIRECT) {
+    dio_teardown(dev);
+  }
+#ifdef HAVE_LINUX_IO_URING_H
+  if (dev->backend == BLOCK_BACKEND_URING) {
+    uring_teardown(&dev->ring);
+  }
+#endif
+  pthread_mutex_destroy(&dev->mu);
+  free(dev);
+}
+
+/** Read a batch of runs
+ *
+ * Returns 0 when every block of every run was read, or -1 on failure
+ * (including running off the end of the file).
+ */
+int block_read_runs(void* arg, const struct block_run* runs, uint64_t n) {
+  struct device* dev = (struct device*)arg;
+  // log_msg("block_read_runs() %" PRIu64 " runs", n);
+  if (dev->backend == BLOCK_BACKEND_MMAP) {
+    return map_rw_runs(dev, runs, n, false);
+  }
+  if (dev->backend == BLOCK_BACKEND_DIRECT) {
+    return dio_rw_runs(dev, runs, n, false);
+  }
+#ifdef HAVE_LINUX_IO_URING_H
+  if (dev->backend == BLOCK_BACKEND_URING) {
+    pthread_mutex_lock(&dev->mu);
+    int ret = uring_rw_runs(dev, runs, n, false);
+    pthread_mutex_unlock(&dev->mu);
+    return ret;
+  }
+#endif
+  return pread_rw_runs(dev, runs, n, false);
+}
+
+/** Write a batch of runs
+ *
+ * Returns 0 when every block of every run was written, otherwise -1.
+ */
+int block_write_runs(void* arg, const struct block_run* runs, uint64_t n) {
+  struct device* dev = (struct device*)arg;
+  // log_msg("block_write_runs() %" PRIu64 " runs", n);
+  if (dev->backend == BLOCK_BACKEND_MMAP) {
+    return map_rw_runs(dev, runs, n, true);
+  }
+  if (dev->backend == BLOCK_BACKEND_DIRECT) {
+    return dio_rw_runs(dev, runs, n, true);
+  }
+#ifdef HAVE_LINUX_IO_URING_H
+  if (dev->backend == BLOCK_BACKEND_URING) {
+    pthread_mutex_lock(&dev->mu);
+    int ret = uring_rw_runs(dev, runs, n, true);
+    pthread_mutex_unlock(&dev->mu);
+    return ret;
+  }
+#endif
+  return pread_rw_runs(dev, runs, n, true);
+}
+
+/** Push everything written so far to stable storage
+ *
+ * The mapped backend msyncs the one range that covers all blocks written since
+ * the last sync; the others fdatasync the file, which also flushes the
+ * device's write cache under O_DIRECT. Returns 0 on success, -1 on failure.
+ */
+int block_sync(void* arg) {
+  struct device* dev = (struct device*)arg;
+  if (dev->backend != BLOCK_BACKEND_MMAP) {
+    if (fdatasync(dev->fd) < 0) {
+      perror("block_sync failed");
+      return -1;
+    }
+    return 0;
+  }
+
+  pthread_mutex_lock(&dev->mu);
+  uint64_t lo = dev->dirty_lo;
+  uint64_t hi = dev->dirty_hi;
+  dev->dirty_lo = dev->map_blocks;
+  dev->dirty_hi = 0;
+  pthread_mutex_unlock(&dev->mu);
+  if (lo >= hi) {
+    return 0;
+  }
+
+  // msync wants a page aligned start
+  uint64_t page = sysconf(_SC_PAGESIZE);
+  uint64_t start = lo * dev->block_size / page * page;
+  uint64_t end = hi * dev->block_size;
+  if (msync(dev->map + start, end - start, MS_SYNC) < 0) {
+    perror("block_sync failed");
+    pthread_mutex_lock(&dev->mu);
+    if (lo < dev->dirty_lo) dev->dirty_lo = lo;
+    if (hi > dev->dirty_hi) dev->dirty_hi = hi;
+    pthread_mutex_unlock(&dev->mu);
+    return -1;
+  }
+  return 0;
+}
@@ -10,11 +10,42 @@
 
 #include <stdint.h>
 
-#define BLOCK_SIZE 512
+// sizes a device's blocks can have; any power of 2 in between works too
+#define SFS_MIN_BLOCK_SIZE 512
+#define SFS_MAX_BLOCK_SIZE 65536
 
-typedef char sfs_block_t[BLOCK_SIZE];
+/**
+ * how a device moves batches of runs between memory and the disk file
+ */
+enum block_backend {
+  BLOCK_BACKEND_PREAD,   // one synchronous preadv/pwritev per run
+  BLOCK_BACKEND_URING,   // io_uring; every run of a batch is in flight at once
+  BLOCK_BACKEND_MMAP,    // the whole file is mapped; I/O is memcpy
+  BLOCK_BACKEND_DIRECT,  // O_DIRECT through aligned bounce buffers
+};
 
-int block_read(int fd, uint64_t block_num, void* block);
-int block_write(int fd, uint64_t block_num, const void* block);
+/**
+ * a run of |count| consecutive blocks starting at |block_num|. block i of the
+ * run is transferred to or from |blocks[i]|.
+ */
+struct block_run {
+  uint64_t block_num;
+  uint64_t count;
+  void* const* blocks;
+};
+
+void* block_open(int fd, enum block_backend backend, uint32_t block_size);
+void block_close(void* dev);
+
+// everything below can be called from several threads at once
+uint32_t block_get_size(void* dev);
+
+int block_read(void* dev, uint64_t block_num, void* block);
+int block_write(void* dev, uint64_t block_num, const void* block);
+
+int block_read_runs(void* dev, const struct block_run* runs, uint64_t n);
+int block_write_runs(void* dev, const struct block_run* runs, uint64_t n);
+
+int block_sync(void* dev);
 
 #endif
@@ -0,0 +1,621 @@
+#include "cache.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "block.h"
+#include "log.h"
+
+// never cache fewer blocks than this, whatever the budget says
+#define MIN_BUFFERS 16
+// a writeback batch takes at most this fraction of the buffers, so there are
+// always some left to evict while it is in flight
+#define MAX_BATCH_DIVISOR 2
+
+/**
+ * a cached copy of one disk block
+ *
+ * buffers are chained into a hash bucket by |hash_next| and into the LRU list
+ * by |lru_prev| and |lru_next|
+ */
+struct buffer {
+  uint64_t block_number;
+  bool dirty;
+  bool writeback;       // part of a batch in flight; can't be evicted
+  uint64_t dirtied_ms;   // when it last went from clean to dirty
+
+  struct buffer* hash_next;
+  struct buffer* lru_prev;
+  struct buffer* lru_next;
+
+  char data[];  // one block
+};
+
+struct cache {
+  void* dev;
+  uint32_t block_size;
+
+  uint64_t capacity;  // max number of buffers
+  uint64_t size;      // number of buffers allocated so far
+
+  uint64_t generation;  // bumped by every write
+  uint64_t ndirty;      // number of dirty buffers
+  uint64_t in_flight;   // number of batches started and not finished
+
+  uint64_t bucket_mask;  // number of buckets is a power of 2
+  struct buffer** buckets;
+
+  // sentinel of a circular list; |lru.lru_next| is the most recently used
+  // buffer and |lru.lru_prev| is the least recently used one
+  struct buffer lru;
+};
+
+/**
+ * a batch of dirty blocks on its way to disk. the blocks are copied, so the
+ * buffers can be read and written while the batch is in flight.
+ */
+struct batch {
+  void* dev;
+  uint64_t count;
+  struct buffer** buffers;  // sorted by block number
+  char* data;               // copies of the buffers' data
+  void** blocks;            // the copy of each buffer
+  uint64_t nruns;
+  struct block_run* runs;
+};
+
+static uint64_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000llu + ts.tv_nsec / 1000000;
+}
+
+static void mark_dirty(struct cache* cache, struct buffer* buf) {
+  if (!buf->dirty) {
+    buf->dirty = true;
+    buf->dirtied_ms = now_ms();
+    ++cache->ndirty;
+  }
+}
+
+static void mark_clean(struct cache* cache, struct buffer* buf) {
+  if (buf->dirty) {
+    buf->dirty = false;
+    --cache->ndirty;
+  }
+}
+
+static uint64_t bucket_of(const struct cache* cache, uint64_t block_number) {
+  // fibonacci hashing spreads runs of consecutive block numbers around
+  return (block_number * 11400714819323198485llu >> 32) & cache->bucket_mask;
+}
+
+static void lru_unlink(struct buffer* buf) {
+  buf->lru_prev->lru_next = buf->lru_next;
+  buf->lru_next->lru_prev = buf->lru_prev;
+}
+
+static void lru_push_front(struct cache* cache, struct buffer* buf) {
+  buf->lru_prev = &cache->lru;
+  buf->lru_next = cache->lru.lru_next;
+  cache->lru.lru_next->lru_prev = buf;
+  cache->lru.lru_next = buf;
+}
+
+static void hash_remove(struct cache* cache, struct buffer* buf) {
+  struct buffer** it = &cache->buckets[bucket_of(cache, buf->block_number)];
+  while (*it != buf) {
+    assert(*it != NULL);
+    it = &(*it)->hash_next;
+  }
+  *it = buf->hash_next;
+}
+
+static void hash_insert(struct cache* cache, struct buffer* buf) {
+  struct buffer** bucket =
+      &cache->buckets[bucket_of(cache, buf->block_number)];
+  buf->hash_next = *bucket;
+  *bucket = buf;
+}
+
+/**
+ * finds the buffer for |block_number| without touching the LRU order
+ *
+ * returns NULL on a miss
+ */
+static struct buffer* peek(struct cache* cache, uint64_t block_number) {
+  struct buffer* buf = cache->buckets[bucket_of(cache, block_number)];
+  while (buf != NULL && buf->block_number != block_number) {
+    buf = buf->hash_next;
+  }
+  return buf;
+}
+
+/**
+ * finds the buffer for |block_number| and marks it most recently used
+ *
+ * returns NULL on a miss
+ */
+static struct buffer* lookup(struct cache* cache, uint64_t block_number) {
+  struct buffer* buf = peek(cache, block_number);
+  if (buf != NULL) {
+    lru_unlink(buf);
+    lru_push_front(cache, buf);
+  }
+  return buf;
+}
+
+static int write_back(struct cache* cache, struct buffer* buf) {
+  if (block_write(cache->dev, buf->block_number, buf->data) !=
+      (int)cache->block_size) {
+    log_msg("write-back of block %" PRIu64 " failed", buf->block_number);
+    return -1;
+  }
+  mark_clean(cache, buf);
+  return 0;
+}
+
+/**
+ * writes back every dirty block that isn't already on its way to disk, in as
+ * few runs as possible
+ *
+ * returns 0 if OK, otherwise -1
+ */
+static int write_back_all(struct cache* cache) {
+  for (;;) {
+    void* batch;
+    if (sfs_cache_writeback_start(cache, 0, &batch)) {
+      return -1;
+    }
+    if (batch == NULL) {
+      return 0;
+    }
+    int ret = sfs_cache_writeback_io(batch);
+    sfs_cache_writeback_finish(cache, batch, ret);
+    if (ret) {
+      return -1;
+    }
+  }
+}
+
+/**
+ * gets an unused buffer for |block_number|, either freshly allocated or taken
+ * from the least recently used end of the list. evicting a dirty buffer writes
+ * back all dirty buffers, so they go to disk in runs rather than one at a time.
+ * buffers in a writeback batch are never evicted. the buffer is hashed and
+ * most recently used, but its data is garbage.
+ *
+ * returns NULL on failure
+ */
+static struct buffer* get_buffer(struct cache* cache, uint64_t block_number) {
+  struct buffer* buf = NULL;
+  if (cache->size < cache->capacity) {
+    buf = malloc(sizeof(struct buffer) + cache->block_size);
+    if (buf != NULL) {
+      ++cache->size;
+    } else if (cache->size == 0) {
+      log_msg("malloc failure");
+      return NULL;
+    }
+  }
+
+  if (buf == NULL) {
+    buf = cache->lru.lru_prev;
+    while (buf != &cache->lru && buf->writeback) {
+      buf = buf->lru_prev;
+    }
+    if (buf == &cache->lru) {
+      log_msg("every buffer is being written back");
+      return NULL;
+    }
+    // a failed batch falls back to writing just this one
+    if (buf->dirty && write_back_all(cache) && write_back(cache, buf)) {
+      return NULL;
+    }
+    lru_unlink(buf);
+    hash_remove(cache, buf);
+  }
+
+  buf->block_number = block_number;
+  buf->dirty = false;
+  buf->writeback = false;
+  hash_insert(cache, buf);
+  lru_push_front(cache, buf);
+  return buf;
+}
+
+/**
+ * drops |buf| from the cache without writing it back
+ */
+static void discard(struct cache* cache, struct buffer* buf) {
+  assert(!buf->writeback);
+  mark_clean(cache, buf);
+  lru_unlink(buf);
+  hash_remove(cache, buf);
+  free(buf);
+  --cache->size;
+}
+
+void* sfs_cache_init(void* dev, uint64_t bytes) {
+  assert(dev != NULL);
+
+  struct cache* cache = malloc(sizeof(struct cache));
+  if (cache == NULL) {
+    return NULL;
+  }
+
+  cache->dev = dev;
+  cache->block_size = block_get_size(dev);
+  cache->capacity = bytes / cache->block_size;
+  if (cache->capacity < MIN_BUFFERS) {
+    cache->capacity = MIN_BUFFERS;
+  }
+  cache->size = 0;
+  cache->generation = 0;
+  cache->ndirty = 0;
+  cache->in_flight = 0;
+
+  // keep chains short: at least one bucket per buffer
+  uint64_t buckets = 1;
+  while (buckets < cache->capacity) {
+    buckets <<= 1;
+  }
+  cache->bucket_mask = buckets - 1;
+  cache->buckets = calloc(buckets, sizeof(struct buffer*));
+  if (cache->buckets == NULL) {
+    free(cache);
+    return NULL;
+  }
+
+  cache->lru.lru_prev = cache->lru.lru_next = &cache->lru;
+
+  log_msg("caching up to %" PRIu64 " blocks", cache->capacity);
+  return cache;
+}
+
+int sfs_cache_deinit(void* arg) {
+  struct cache* cache = (struct cache*)arg;
+  assert(cache != NULL);
+
+  int ret = sfs_cache_flush(cache);
+
+  while (cache->lru.lru_next != &cache->lru) {
+    discard(cache, cache->lru.lru_next);
+  }
+  free(cache->buckets);
+  free(cache);
+
+  return ret;
+}
+
+int sfs_cache_read(void* arg, uint64_t block_number, void* block) {
+  struct cache* cache = (struct cache*)arg;
+  assert(cache != NULL);
+  assert(block != NULL);
+
+  struct buffer* buf = lookup(cache, block_number);
+  if (buf == NULL) {
+    buf = get_buffer(cache, block_number);
+    if (buf == NULL) {
+      return -1;
+    }
+    if (block_read(cache->dev, block_number, buf->data) !=
+        (int)cache->block_size) {
+      log_msg("unable to read block %" PRIu64, block_number);
+      discard(cache, buf);
+      return -1;
+    }
+  }
+
+  memcpy(block, buf->data, cache->block_size);
+  return 0;
+}
+
+/**
+ * writes |block| to the buffer of |block_number| and marks it dirty
+ *
+ * returns the buffer, or NULL on failure
+ */
+static struct buffer* write_block(struct cache* cache, uint64_t block_number,
+                                  const void* block) {
+  // whole blocks are written, so a miss doesn't need to read the old data
+  struct buffer* buf = lookup(cache, block_number);
+  if (buf == NULL) {
+    buf = get_buffer(cache, block_number);
+    if (buf == NULL) {
+      return NULL;
+    }
+  }
+
+  memcpy(buf->data, block, cache->block_size);
+  mark_dirty(cache, buf);
+  ++cache->generation;
+  return buf;
+}
+
+int sfs_cache_write(void* arg, uint64_t block_number, const void* block) {
+  struct cache* cache = (struct cache*)arg;
+  assert(cache != NULL);
+  assert(block != NULL);
+
+  return write_block(cache, block_number, block) != NULL ? 0 : -1;
+}
+
+int sfs_cache_read_runs(void* arg, const struct block_run* runs, uint64_t n) {
+  struct cache* cache = (struct cache*)arg;
+  assert(cache != NULL);
+  assert(runs != NULL);
+
+  // there can't be more runs of misses than blocks
+  uint64_t total = 0;
+  for (uint64_t r = 0; r < n; ++r) {
+    total += runs[r].count;
+  }
+  struct block_run* misses = malloc(total * sizeof(struct block_run));
+  if (misses == NULL) {
+    log_msg("malloc failure");
+    return -1;
+  }
+
+  uint64_t nmisses = 0;
+  for (uint64_t r = 0; r < n; ++r) {
+    const struct block_run* run = &runs[r];
+    uint64_t miss_start = 0;
+    for (uint64_t i = 0; i <= run->count; ++i) {
+      struct buffer* buf =
+          i < run->count ? lookup(cache, run->block_num + i) : NULL;
+      if (buf == NULL && i < run->count) {
+        continue;
+      }
+
+      // blocks [miss_start, i) of the run are a run of misses
+      if (miss_start < i) {
+        misses[nmisses].block_num = run->block_num + miss_start;
+        misses[nmisses].count = i - miss_start;
+        misses[nmisses].blocks = run->blocks + miss_start;
+        ++nmisses;
+      }
+      if (buf != NULL) {
+        memcpy(run->blocks[i], buf->data, cache->block_size);
+      }
+      miss_start = i + 1;
+    }
+  }
+
+  int ret = 0;
+  if (nmisses > 0 && block_read_runs(cache->dev, misses, nmisses)) {
+    log_msg("unable to read %" PRIu64 " runs", nmisses);
+    ret = -1;
+  }
+
+  free(misses);
+  return ret;
+}
+
+int sfs_cache_write_runs(void* arg, const struct block_run* runs,
+                         uint64_t n) {
+  struct cache* cache = (struct cache*)arg;
+  assert(cache != NULL);
+  assert(runs != NULL);
+
+  for (uint64_t r = 0; r < n; ++r) {
+    for (uint64_t i = 0; i < runs[r].count; ++i) {
+      if (sfs_cache_write(cache, runs[r].block_num + i, runs[r].blocks[i])) {
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+int sfs_cache_write_runs_aged(void* arg, const struct block_run* runs,
+                              uint64_t n, uint64_t age_ms) {
+  struct cache* cache = (struct cache*)arg;
+  assert(cache != NULL);
+  assert(runs != NULL);
+
+  uint64_t now = now_ms();
+  uint64_t dirtied_ms = age_ms < now ? now - age_ms : 0;
+  for (uint64_t r = 0; r < n; ++r) {
+    for (uint64_t i = 0; i < runs[r].count; ++i) {
+      struct buffer* buf =
+          write_block(cache, runs[r].block_num + i, runs[r].blocks[i]);
+      if (buf == NULL) {
+        return -1;
+      }
+      if (buf->dirtied_ms > dirtied_ms) {
+        buf->dirtied_ms = dirtied_ms;
+      }
+    }
+  }
+
+  return 0;
+}
+
+bool sfs_cache_contains(void* arg, uint64_t block_number) {
+  struct cache* cache = (struct cache*)arg;
+  assert(cache != NULL);
+
+  return peek(cache, block_number) != NULL;
+}
+
+uint64_t sfs_cache_generation(void* arg) {
+  struct cache* cache = (struct cache*)arg;
+  assert(cache != NULL);
+
+  return cache->generation;
+}
+
+int sfs_cache_fill(void* arg, const struct block_run* runs, uint64_t n) {
+  struct cache* cache = (struct cache*)arg;
+  assert(cache != NULL);
+  assert(runs != NULL);
+
+  for (uint64_t r = 0; r < n; ++r) {
+    for (uint64_t i = 0; i < runs[r].count; ++i) {
+      // a cached copy is at least as new as the one passed in
+      if (peek(cache, runs[r].block_num + i) != NULL) {
+        continue;
+      }
+      struct buffer* buf = get_buffer(cache, runs[r].block_num + i);
+      if (buf == NULL) {
+        return -1;
+      }
+      memcpy(buf->data, runs[r].blocks[i], cache->block_size);
+    }
+  }
+
+  return 0;
+}
+
+static int compare_block_numbers(const void* a, const void* b) {
+  uint64_t x = (*(struct buffer* const*)a)->block_number;
+  uint64_t y = (*(struct buffer* const*)b)->block_number;
+  return x < y ? -1 : x > y;
+}
+
+uint64_t sfs_cache_capacity(void* arg) {
+  struct cache* cache = (struct cache*)arg;
+  assert(cache != NULL);
+
+  return cache->capacity;
+}
+
+uint64_t sfs_cache_dirty_percent(void* arg) {
+  struct cache* cache = (struct cache*)arg;
+  assert(cache != NULL);
+
+  return cache->ndirty * 100 / cache->capacity;
+}
+
+static void free_batch(struct batch* batch) {
+  free(batch->buffers);
+  free(batch->data);
+  free(batch->blocks);
+  free(batch->runs);
+  free(batch);
+}
+
+int sfs_cache_writeback_start(void* arg, uint64_t min_age_ms, void** out) {
+  struct cache* cache = (struct cache*)arg;
+  assert(cache != NULL);
+  assert(out != NULL);
+
+  *out = NULL;
+  uint64_t now = now_ms();
+  uint64_t max_count = cache->capacity / MAX_BATCH_DIVISOR;
+  uint64_t count = 0;
+  for (struct buffer* buf = cache->lru.lru_next; buf != &cache->lru;
+       buf = buf->lru_next) {
+    count += buf->dirty && !buf->writeback &&
+             now - buf->dirtied_ms >= min_age_ms;
+  }
+  if (count == 0) {
+    return 0;
+  }
+  if (count > max_count) {
+    count = max_count;
+  }
+
+  struct batch* batch = malloc(sizeof(struct batch));
+  if (batch == NULL) {
+    log_msg("malloc failure");
+    return -1;
+  }
+  batch->dev = cache->dev;
+  batch->buffers = malloc(count * sizeof(struct buffer*));
+  batch->data = malloc(count * cache->block_size);
+  batch->blocks = malloc(count * sizeof(void*));
+  batch->runs = malloc(count * sizeof(struct block_run));
+  if (batch->buffers == NULL || batch->data == NULL || batch->blocks == NULL ||
+      batch->runs == NULL) {
+    log_msg("malloc failure");
+    free_batch(batch);
+    return -1;
+  }
+
+  // the least recently used end goes first; it is the next to be evicted
+  batch->count = 0;
+  for (struct buffer* buf = cache->lru.lru_prev;
+       buf != &cache->lru && batch->count < count; buf = buf->lru_prev) {
+    if (buf->dirty && !buf->writeback && now - buf->dirtied_ms >= min_age_ms) {
+      batch->buffers[batch->count++] = buf;
+    }
+  }
+  // sorted by block number, neighbors merge into one run
+  qsort(batch->buffers, batch->count, sizeof(struct buffer*),
+        compare_block_numbers);
+
+  batch->nruns = 0;
+  for (uint64_t i = 0; i < batch->count; ++i) {
+    struct buffer* buf = batch->buffers[i];
+    batch->blocks[i] = batch->data + i * cache->block_size;
+    memcpy(batch->blocks[i], buf->data, cache->block_size);
+    mark_clean(cache, buf);
+    buf->writeback = true;
+
+    if (i > 0 &&
+        batch->buffers[i - 1]->block_number + 1 == buf->block_number) {
+      ++batch->runs[batch->nruns - 1].count;
+    } else {
+      batch->runs[batch->nruns].block_num = buf->block_number;
+      batch->runs[batch->nruns].count = 1;
+      batch->runs[batch->nruns].blocks = &batch->blocks[i];
+      ++batch->nruns;
+    }
+  }
+
+  ++cache->in_flight;
+  *out = batch;
+  return 0;
+}
+
+int sfs_cache_writeback_io(void* arg) {
+  struct batch* batch = (struct batch*)arg;
+  assert(batch != NULL);
+
+  if (block_write_runs(batch->dev, batch->runs, batch->nruns)) {
+    log_msg("write-back of %" PRIu64 " dirty blocks failed", batch->count);
+    return -1;
+  }
+  return 0;
+}
+
+void sfs_cache_writeback_finish(void* arg, void* batch_arg, int result) {
+  struct cache* cache = (struct cache*)arg;
+  struct batch* batch = (struct batch*)batch_arg;
+  assert(cache != NULL);
+  assert(batch != NULL);
+
+  for (uint64_t i = 0; i < batch->count; ++i) {
+    struct buffer* buf = batch->buffers[i];
+    buf->writeback = false;
+    // blocks written again in the meantime are dirty already
+    if (result) {
+      mark_dirty(cache, buf);
+    }
+  }
+  --cache->in_flight;
+  free_batch(batch);
+}
+
+uint64_t sfs_cache_writebacks_in_flight(void* arg) {
+  struct cache* cache = (struct cache*)arg;
+  assert(cache != NULL);
+  return cache->in_flight;
+}
+
+int sfs_cache_flush(void* arg) {
+  struct cache* cache = (struct cache*)arg;
+  assert(cache != NULL);
+
+  if (write_back_all(cache)) {
+    return -1;
+  }
+  return block_sync(cache->dev);
+}
@@ -0,0 +1,151 @@
+/**
+ * write-back buffer cache that sits between the filesystem and the disk
+ *
+ * blocks are looked up by block number in a hash table and evicted in least
+ * recently used order once the cache is full. writes only touch the cache;
+ * dirty blocks go to disk in writeback batches, sorted and merged into runs of
+ * adjacent blocks. a batch is written when a dirty block has to be evicted,
+ * when the cache is flushed, or whenever the caller starts one.
+ *
+ * nothing here is threadsafe; callers hold the filesystem lock. the one
+ * exception is sfs_cache_writeback_io(), which is meant to run without it.
+ */
+
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "block.h"
+
+/**
+ * initializes a cache of blocks on the block device |dev| that uses at most
+ * |bytes| bytes of block buffers
+ *
+ * returns opaque pointer to the cache on success, NULL on failure
+ */
+void* sfs_cache_init(void* dev, uint64_t bytes);
+
+/**
+ * writes back dirty blocks and frees memory used by |cache|
+ *
+ * returns 0 if OK, otherwise -1 (memory is freed either way)
+ */
+int sfs_cache_deinit(void* cache);
+
+/**
+ * reads block |block_number| into |block|, going to disk only on a miss
+ *
+ * returns 0 if OK, otherwise -1
+ */
+int sfs_cache_read(void* cache, uint64_t block_number, void* block);
+
+/**
+ * writes |block| to block |block_number|. the write is not on disk until the
+ * block is evicted or the cache is flushed.
+ *
+ * returns 0 if OK, otherwise -1
+ */
+int sfs_cache_write(void* cache, uint64_t block_number, const void* block);
+
+/**
+ * reads the |n| |runs| of blocks. cached blocks are copied out and the runs of
+ * misses are read from disk as one batch, straight into the caller's buffers.
+ * misses are not added to the cache.
+ *
+ * returns 0 if OK, otherwise -1
+ */
+int sfs_cache_read_runs(void* cache, const struct block_run* runs, uint64_t n);
+
+/**
+ * writes the |n| |runs| of blocks, like sfs_cache_write() on each block
+ *
+ * returns 0 if OK, otherwise -1
+ */
+int sfs_cache_write_runs(void* cache, const struct block_run* runs,
+                         uint64_t n);
+
+/**
+ * like sfs_cache_write_runs(), but the blocks count as dirty since |age_ms|
+ * milliseconds ago if that is earlier, so they are written back along with
+ * data that was written that long ago
+ *
+ * returns 0 if OK, otherwise -1
+ */
+int sfs_cache_write_runs_aged(void* cache, const struct block_run* runs,
+                              uint64_t n, uint64_t age_ms);
+
+/**
+ * returns true if block |block_number| is cached. the LRU order is left alone.
+ */
+bool sfs_cache_contains(void* cache, uint64_t block_number);
+
+/**
+ * returns a number that changes whenever a block is written through |cache|.
+ * data read from disk behind the cache's back can only be trusted if the
+ * number is the same before and after the read.
+ */
+uint64_t sfs_cache_generation(void* cache);
+
+/**
+ * adds the blocks of the |n| |runs|, as read from disk, to |cache| as clean
+ * blocks. blocks that are already cached are left alone.
+ *
+ * returns 0 if OK, otherwise -1
+ */
+int sfs_cache_fill(void* cache, const struct block_run* runs, uint64_t n);
+
+/**
+ * returns how many blocks |cache| holds
+ */
+uint64_t sfs_cache_capacity(void* cache);
+
+/**
+ * returns how much of |cache| is dirty, in percent
+ */
+uint64_t sfs_cache_dirty_percent(void* cache);
+
+/**
+ * starts a writeback batch of the blocks in |cache| that have been dirty for at
+ * least |min_age_ms| milliseconds, least recently used first. the blocks are
+ * copied into the batch and marked clean. they stay cached until the batch is
+ * finished, and can be read and written as usual in the meantime.
+ *
+ * the batch is stored in |batch|, or NULL if there is nothing to write back.
+ * it is written with sfs_cache_writeback_io() and has to be handed back to
+ * sfs_cache_writeback_finish().
+ *
+ * returns 0 if OK, otherwise -1
+ */
+int sfs_cache_writeback_start(void* cache, uint64_t min_age_ms, void** batch);
+
+/**
+ * writes |batch| to disk. unlike everything else here, this doesn't touch the
+ * cache and may be called without holding the filesystem lock.
+ *
+ * returns 0 if OK, otherwise -1
+ */
+int sfs_cache_writeback_io(void* batch);
+
+/**
+ * ends |batch| and frees it. |result| is what sfs_cache_writeback_io()
+ * returned; if it failed, the blocks are marked dirty again.
+ */
+void sfs_cache_writeback_finish(void* cache, void* batch, int result);
+
+/**
+ * returns the number of writeback batches of |cache| that have been started
+ * and not finished
+ */
+uint64_t sfs_cache_writebacks_in_flight(void* cache);
+
+/**
+ * writes every dirty block in |cache| back to disk, then syncs the device.
+ * there must be no batch in flight.
+ *
+ * returns 0 if OK, otherwise -1
+ */
+int sfs_cache_flush(void* cache);
+
+#endif  // _CACHE_H_
@@ -0,0 +1,300 @@
+#include "delalloc.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+
+// inodes with pending blocks are hashed into this many buckets
+#define NBUCKETS 256
+
+struct pending_block {
+  uint64_t iblock;
+  char* data;
+};
+
+/**
+ * the pending blocks of one inode, chained into a hash bucket by |next|
+ */
+struct pending_inode {
+  uint64_t inumber;
+  uint64_t since_ms;  // when its first pending block was written
+
+  // sorted by logical block; files are mostly written in order, so new
+  // blocks mostly go on the end
+  uint64_t count;
+  uint64_t capacity;
+  struct pending_block* blocks;
+
+  struct pending_inode* next;
+};
+
+struct delalloc {
+  uint32_t block_size;
+  uint64_t blocks;  // pending, over all inodes
+  struct pending_inode* buckets[NBUCKETS];
+};
+
+static uint64_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000llu + ts.tv_nsec / 1000000;
+}
+
+static struct pending_inode** bucket_of(struct delalloc* da,
+                                        uint64_t inumber) {
+  return &da->buckets[(inumber * 11400714819323198485llu >> 32) % NBUCKETS];
+}
+
+static struct pending_inode* find_inode(struct delalloc* da,
+                                        uint64_t inumber) {
+  struct pending_inode* in = *bucket_of(da, inumber);
+  while (in != NULL && in->inumber != inumber) {
+    in = in->next;
+  }
+  return in;
+}
+
+/**
+ * returns the index of the first of |in|'s blocks at or after |iblock|
+ */
+static uint64_t lower_bound(const struct pending_inode* in, uint64_t iblock) {
+  uint64_t lo = 0, hi = in->count;
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (in->blocks[mid].iblock < iblock) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+static void free_inode(struct delalloc* da, struct pending_inode* in) {
+  struct pending_inode** it = bucket_of(da, in->inumber);
+  while (*it != in) {
+    it = &(*it)->next;
+  }
+  *it = in->next;
+  for (uint64_t i = 0; i < in->count; ++i) {
+    free(in->blocks[i].data);
+  }
+  da->blocks -= in->count;
+  free(in->blocks);
+  free(in);
+}
+
+void* sfs_delalloc_init(uint32_t block_size) {
+  struct delalloc* da = malloc(sizeof(struct delalloc));
+  if (da == NULL) {
+    return NULL;
+  }
+  da->block_size = block_size;
+  da->blocks = 0;
+  for (int i = 0; i < NBUCKETS; ++i) {
+    da->buckets[i] = NULL;
+  }
+  return da;
+}
+
+void sfs_delalloc_deinit(void* arg) {
+  struct delalloc* da = (struct delalloc*)arg;
+  assert(da != NULL);
+
+  for (int i = 0; i < NBUCKETS; ++i) {
+    while (da->buckets[i] != NULL) {
+      free_inode(da, da->buckets[i]);
+    }
+  }
+  free(da);
+}
+
+int sfs_delalloc_put(void* arg, uint64_t inumber, uint64_t iblock,
+                     const void* block) {
+  struct delalloc* da = (struct delalloc*)arg;
+  assert(da != NULL);
+  assert(block != NULL);
+
+  struct pending_inode* in = find_inode(da, inumber);
+  if (in == NULL) {
+    in = malloc(sizeof(struct pending_inode));
+    if (in == NULL) {
+      log_msg("malloc failure");
+      return -1;
+    }
+    in->inumber = inumber;
+    in->since_ms = now_ms();
+    in->count = 0;
+    in->capacity = 0;
+    in->blocks = NULL;
+    struct pending_inode** bucket = bucket_of(da, inumber);
+    in->next = *bucket;
+    *bucket = in;
+  }
+
+  uint64_t i = lower_bound(in, iblock);
+  if (i < in->count && in->blocks[i].iblock == iblock) {
+    memcpy(in->blocks[i].data, block, da->block_size);
+    return 0;
+  }
+
+  if (in->count == in->capacity) {
+    uint64_t capacity = in->capacity ? in->capacity * 2 : 8;
+    struct pending_block* blocks =
+        realloc(in->blocks, capacity * sizeof(struct pending_block));
+    if (blocks == NULL) {
+      log_msg("malloc failure");
+      if (in->count == 0) {
+        free_inode(da, in);
+      }
+      return -1;
+    }
+    in->blocks = blocks;
+    in->capacity = capacity;
+  }
+  char* data = malloc(da->block_size);
+  if (data == NULL) {
+    log_msg("malloc failure");
+    if (in->count == 0) {
+      free_inode(da, in);
+    }
+    return -1;
+  }
+  memcpy(data, block, da->block_size);
+  memmove(&in->blocks[i + 1], &in->blocks[i],
+          (in->count - i) * sizeof(struct pending_block));
+  in->blocks[i].iblock = iblock;
+  in->blocks[i].data = data;
+  ++in->count;
+  ++da->blocks;
+  return 0;
+}
+
+bool sfs_delalloc_read(void* arg, uint64_t inumber, uint64_t iblock,
+                       void* block) {
+  struct delalloc* da = (struct delalloc*)arg;
+  assert(da != NULL);
+  assert(block != NULL);
+
+  struct pending_inode* in = find_inode(da, inumber);
+  if (in == NULL) {
+    return false;
+  }
+  uint64_t i = lower_bound(in, iblock);
+  if (i == in->count || in->blocks[i].iblock != iblock) {
+    return false;
+  }
+  memcpy(block, in->blocks[i].data, da->block_size);
+  return true;
+}
+
+bool sfs_delalloc_contains(void* arg, uint64_t inumber, uint64_t iblock) {
+  struct delalloc* da = (struct delalloc*)arg;
+  assert(da != NULL);
+
+  struct pending_inode* in = find_inode(da, inumber);
+  if (in == NULL) {
+    return false;
+  }
+  uint64_t i = lower_bound(in, iblock);
+  return i < in->count && in->blocks[i].iblock == iblock;
+}
+
+void sfs_delalloc_remove(void* arg, uint64_t inumber, uint64_t iblock,
+                         uint64_t count) {
+  struct delalloc* da = (struct delalloc*)arg;
+  assert(da != NULL);
+
+  struct pending_inode* in = find_inode(da, inumber);
+  if (in == NULL) {
+    return;
+  }
+  uint64_t start = lower_bound(in, iblock);
+  uint64_t end = count > UINT64_MAX - iblock ? in->count
+                                             : lower_bound(in, iblock + count);
+  if (start == 0 && end == in->count) {
+    free_inode(da, in);
+    return;
+  }
+  for (uint64_t i = start; i < end; ++i) {
+    free(in->blocks[i].data);
+  }
+  memmove(&in->blocks[start], &in->blocks[end],
+          (in->count - end) * sizeof(struct pending_block));
+  in->count -= end - start;
+  da->blocks -= end - start;
+}
+
+uint64_t sfs_delalloc_blocks(void* arg) {
+  struct delalloc* da = (struct delalloc*)arg;
+  assert(da != NULL);
+  return da->blocks;
+}
+
+uint64_t sfs_delalloc_inode_blocks(void* arg, uint64_t inumber) {
+  struct delalloc* da = (struct delalloc*)arg;
+  assert(da != NULL);
+
+  struct pending_inode* in = find_inode(da, inumber);
+  return in != NULL ? in->count : 0;
+}
+
+uint64_t sfs_delalloc_inode_start(void* arg, uint64_t inumber) {
+  struct delalloc* da = (struct delalloc*)arg;
+  assert(da != NULL);
+
+  struct pending_inode* in = find_inode(da, inumber);
+  return in != NULL ? in->blocks[0].iblock : 0;
+}
+
+uint64_t sfs_delalloc_inode_end(void* arg, uint64_t inumber) {
+  struct delalloc* da = (struct delalloc*)arg;
+  assert(da != NULL);
+
+  struct pending_inode* in = find_inode(da, inumber);
+  return in != NULL ? in->blocks[in->count - 1].iblock + 1 : 0;
+}
+
+uint64_t sfs_delalloc_first_run(void* arg, uint64_t inumber, uint64_t* iblock,
+                                const void** blocks, uint64_t max) {
+  struct delalloc* da = (struct delalloc*)arg;
+  assert(da != NULL);
+  assert(iblock != NULL);
+  assert(blocks != NULL);
+
+  struct pending_inode* in = find_inode(da, inumber);
+  if (in == NULL) {
+    return 0;
+  }
+  *iblock = in->blocks[0].iblock;
+  uint64_t n = 0;
+  while (n < max && n < in->count && in->blocks[n].iblock == *iblock + n) {
+    blocks[n] = in->blocks[n].data;
+    ++n;
+  }
+  return n;
+}
+
+bool sfs_delalloc_expired(void* arg, uint64_t min_age_ms, uint64_t* inumber,
+                          uint64_t* age_ms) {
+  struct delalloc* da = (struct delalloc*)arg;
+  assert(da != NULL);
+  assert(inumber != NULL);
+  assert(age_ms != NULL);
+
+  uint64_t now = now_ms();
+  for (int i = 0; i < NBUCKETS; ++i) {
+    for (struct pending_inode* in = da->buckets[i]; in != NULL;
+         in = in->next) {
+      if (now - in->since_ms >= min_age_ms) {
+        *inumber = in->inumber;
+        *age_ms = now - in->since_ms;
+        return true;
+      }
+    }
+  }
+  return false;
+}
@@ -0,0 +1,102 @@
+/**
+ * blocks written to files that don't have disk blocks yet
+ *
+ * a write to a hole in a file leaves its data here, keyed by inode number and
+ * logical block, instead of allocating a disk block for it. the filesystem
+ * gives an inode's pending blocks disk blocks all at once when they are
+ * written back, so the allocator sees everything the file has written and can
+ * lay it out contiguously. files deleted before that never get disk blocks.
+ *
+ * nothing here is threadsafe; callers hold the filesystem lock
+ */
+
+#ifndef _DELALLOC_H_
+#define _DELALLOC_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * initializes an empty set of pending blocks of |block_size| bytes each
+ *
+ * returns opaque pointer to the set on success, NULL on failure
+ */
+void* sfs_delalloc_init(uint32_t block_size);
+
+/**
+ * frees |da| and every block still pending in it
+ */
+void sfs_delalloc_deinit(void* da);
+
+/**
+ * makes a copy of |block| the pending data of logical block |iblock| of inode
+ * |inumber|, replacing what was pending there
+ *
+ * returns 0 if OK, otherwise -1
+ */
+int sfs_delalloc_put(void* da, uint64_t inumber, uint64_t iblock,
+                     const void* block);
+
+/**
+ * copies the pending data of logical block |iblock| of inode |inumber| to
+ * |block|
+ *
+ * returns true if the block is pending, otherwise false and |block| is left
+ * alone
+ */
+bool sfs_delalloc_read(void* da, uint64_t inumber, uint64_t iblock,
+                       void* block);
+
+bool sfs_delalloc_contains(void* da, uint64_t inumber, uint64_t iblock);
+
+/**
+ * discards the pending blocks of inode |inumber| from logical block |iblock|
+ * up to |iblock| + |count|
+ */
+void sfs_delalloc_remove(void* da, uint64_t inumber, uint64_t iblock,
+                         uint64_t count);
+
+/**
+ * returns the number of blocks pending in |da|
+ */
+uint64_t sfs_delalloc_blocks(void* da);
+
+/**
+ * returns the number of blocks pending for inode |inumber|
+ */
+uint64_t sfs_delalloc_inode_blocks(void* da, uint64_t inumber);
+
+/**
+ * returns the first logical block pending for inode |inumber|, or 0 if there
+ * is none
+ */
+uint64_t sfs_delalloc_inode_start(void* da, uint64_t inumber);
+
+/**
+ * returns one past the last logical block pending for inode |inumber|, or 0
+ * if there is none
+ */
+uint64_t sfs_delalloc_inode_end(void* da, uint64_t inumber);
+
+/**
+ * finds the first run of consecutive logical blocks pending for inode
+ * |inumber|, at most |max| long. its first block is written to |iblock| and
+ * the data of each of its blocks to |blocks|; the data stays valid until it
+ * is removed.
+ *
+ * returns the length of the run, 0 if nothing is pending
+ */
+uint64_t sfs_delalloc_first_run(void* da, uint64_t inumber, uint64_t* iblock,
+                                const void** blocks, uint64_t max);
+
+/**
+ * finds an inode whose first pending block has been pending for at least
+ * |min_age_ms| milliseconds, and writes its number to |inumber| and how long
+ * that has been to |age_ms|
+ *
+ * returns true if there is one, otherwise false
+ */
+bool sfs_delalloc_expired(void* da, uint64_t min_age_ms, uint64_t* inumber,
+                          uint64_t* age_ms);
+
+#endif  // _DELALLOC_H_
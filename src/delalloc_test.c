@@ -0,0 +1,132 @@
+#include "delalloc.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BLOCK_SIZE 512
+
+static void fill(char* block, uint64_t inumber, uint64_t iblock) {
+  memset(block, (int)(inumber * 31 + iblock), BLOCK_SIZE);
+}
+
+static void put(void* da, uint64_t inumber, uint64_t iblock) {
+  char block[BLOCK_SIZE];
+  fill(block, inumber, iblock);
+  assert(sfs_delalloc_put(da, inumber, iblock, block) == 0);
+}
+
+static void assert_pending(void* da, uint64_t inumber, uint64_t iblock) {
+  char expected[BLOCK_SIZE], block[BLOCK_SIZE];
+  fill(expected, inumber, iblock);
+  assert(sfs_delalloc_contains(da, inumber, iblock));
+  assert(sfs_delalloc_read(da, inumber, iblock, block));
+  assert(memcmp(block, expected, BLOCK_SIZE) == 0);
+}
+
+int main() {
+  void* da = sfs_delalloc_init(BLOCK_SIZE);
+  if (da == NULL) {
+    perror("sfs_delalloc_init()");
+    abort();
+  }
+
+  uint64_t inumber, age_ms;
+  assert(!sfs_delalloc_expired(da, 0, &inumber, &age_ms));
+  assert(sfs_delalloc_inode_start(da, 7) == 0);
+  assert(sfs_delalloc_inode_end(da, 7) == 0);
+
+  // out of order puts end up sorted by logical block
+  put(da, 7, 10);
+  put(da, 7, 2);
+  put(da, 7, 11);
+  put(da, 7, 3);
+  put(da, 7, 1);
+  put(da, 7, 20);
+  put(da, 9, 5);
+  assert(sfs_delalloc_blocks(da) == 7);
+  assert(sfs_delalloc_inode_blocks(da, 7) == 6);
+  assert(sfs_delalloc_inode_blocks(da, 9) == 1);
+  assert(sfs_delalloc_inode_start(da, 7) == 1);
+  assert(sfs_delalloc_inode_end(da, 7) == 21);
+  assert_pending(da, 7, 1);
+  assert_pending(da, 7, 10);
+  assert_pending(da, 7, 20);
+  assert_pending(da, 9, 5);
+  assert(!sfs_delalloc_contains(da, 7, 4));
+  assert(!sfs_delalloc_contains(da, 9, 10));
+  assert(!sfs_delalloc_contains(da, 8, 1));
+  char block[BLOCK_SIZE];
+  memset(block, 0x55, BLOCK_SIZE);
+  assert(!sfs_delalloc_read(da, 7, 4, block));
+  assert(block[0] == 0x55);
+
+  // a second put of a block replaces its data without adding a block
+  char other[BLOCK_SIZE];
+  memset(other, 0xaa, BLOCK_SIZE);
+  assert(sfs_delalloc_put(da, 7, 3, other) == 0);
+  assert(sfs_delalloc_blocks(da) == 7);
+  assert(sfs_delalloc_read(da, 7, 3, block));
+  assert(memcmp(block, other, BLOCK_SIZE) == 0);
+  put(da, 7, 3);
+
+  // the first run stops at a hole, or at |max|
+  uint64_t iblock;
+  const void* blocks[8];
+  assert(sfs_delalloc_first_run(da, 7, &iblock, blocks, 8) == 3);
+  assert(iblock == 1);
+  fill(block, 7, 2);
+  assert(memcmp(blocks[1], block, BLOCK_SIZE) == 0);
+  assert(sfs_delalloc_first_run(da, 7, &iblock, blocks, 2) == 2);
+  assert(sfs_delalloc_first_run(da, 8, &iblock, blocks, 8) == 0);
+
+  // removing a range takes only the blocks in it
+  sfs_delalloc_remove(da, 7, 2, 9);
+  assert(sfs_delalloc_inode_blocks(da, 7) == 3);
+  assert(!sfs_delalloc_contains(da, 7, 2));
+  assert(!sfs_delalloc_contains(da, 7, 10));
+  assert_pending(da, 7, 1);
+  assert_pending(da, 7, 11);
+  assert(sfs_delalloc_first_run(da, 7, &iblock, blocks, 8) == 1);
+  sfs_delalloc_remove(da, 7, 1, 1);
+  assert(sfs_delalloc_inode_start(da, 7) == 11);
+  assert(sfs_delalloc_first_run(da, 7, &iblock, blocks, 8) == 1);
+  assert(iblock == 11);
+  sfs_delalloc_remove(da, 7, 30, 5);
+  assert(sfs_delalloc_inode_blocks(da, 7) == 2);
+
+  // to the end of the file, as truncate does
+  put(da, 7, 15);
+  sfs_delalloc_remove(da, 7, 12, UINT64_MAX);
+  assert(sfs_delalloc_inode_blocks(da, 7) == 1);
+  assert(sfs_delalloc_inode_end(da, 7) == 12);
+  sfs_delalloc_remove(da, 7, 0, UINT64_MAX);
+  assert(sfs_delalloc_inode_blocks(da, 7) == 0);
+  assert(sfs_delalloc_inode_start(da, 7) == 0);
+  assert(sfs_delalloc_blocks(da) == 1);
+
+  // an inode expires once its first pending block is old enough
+  assert(!sfs_delalloc_expired(da, 60 * 1000, &inumber, &age_ms));
+  struct timespec ts = {0, 20 * 1000 * 1000};
+  nanosleep(&ts, NULL);
+  assert(sfs_delalloc_expired(da, 10, &inumber, &age_ms));
+  assert(inumber == 9);
+  assert(age_ms >= 10);
+  sfs_delalloc_remove(da, 9, 0, UINT64_MAX);
+  assert(!sfs_delalloc_expired(da, 0, &inumber, &age_ms));
+  assert(sfs_delalloc_blocks(da) == 0);
+
+  // many inodes, sharing hash buckets
+  for (uint64_t i = 1; i <= 1000; ++i) {
+    put(da, i, i % 7);
+  }
+  assert(sfs_delalloc_blocks(da) == 1000);
+  for (uint64_t i = 1; i <= 1000; ++i) {
+    assert_pending(da, i, i % 7);
+  }
+
+  sfs_delalloc_deinit(da);
+  printf("OK\n");
+}
@@ -26,7 +26,8 @@ struct dir_iterator {
   uint64_t iblock;
   uint64_t entry;
 
-  sfs_block_t cached_block;
+  const struct sfs_geometry* geometry;
+  char cached_block[];
 };
 
 void* sfs_dir_iterate(void* fs, struct sfs_fs_inode* inode) {
@@ -34,14 +35,16 @@ void* sfs_dir_iterate(void* fs, struct sfs_fs_inode* inode) {
   assert(inode != NULL);
   assert((inode->mode & S_IFDIR) != 0);
 
-  struct dir_iterator* it =
-      (struct dir_iterator*)malloc(sizeof(struct dir_iterator));
+  const struct sfs_geometry* geometry = sfs_fs_geometry(fs);
+  struct dir_iterator* it = (struct dir_iterator*)malloc(
+      sizeof(struct dir_iterator) + geometry->block_size);
   if (it == NULL) {
     log_msg("sfs_dir_iterate() malloc error");
     return NULL;
   }
 
   it->fs = fs;
+  it->geometry = geometry;
   it->inode = inode;
   it->iblock = 0;
   it->entry = 0;
@@ -58,7 +61,7 @@ void* sfs_dir_iternext(void* arg, struct sfs_dir_entry** direntry,
 
   struct sfs_dir_entry* arr = (struct sfs_dir_entry*)it->cached_block;
   while (true) {
-    if (it->iblock * BLOCK_SIZE >= it->inode->size) {
+    if (it->iblock * it->geometry->block_size >= it->inode->size) {
       goto end;
     }
 
@@ -68,27 +71,25 @@ void* sfs_dir_iternext(void* arg, struct sfs_dir_entry** direntry,
         log_msg("unable to read block %" PRIu64, it->iblock);
         goto end;
       }
-      it->inode->access_time = time(NULL);
-      if (sfs_fs_write_inode(it->fs, it->inode)) {
+      if (sfs_fs_inode_touch(it->fs, it->inode) &&
+          sfs_fs_write_inode(it->fs, it->inode)) {
         log_msg("unable write inode %" PRIu64, it->inode->inumber);
         goto end;
       }
     }
 
-    while (it->entry < BLOCK_SIZE / sizeof(struct sfs_dir_entry)) {
-      if (arr[it->entry].inumber != 0) {
-        *direntry = arr + it->entry;
-        // write to the output inode if provided
-        if (inode != NULL) {
-          if (sfs_fs_read_inode(it->fs, arr[it->entry].inumber, inode)) {
-            log_msg("error reading directory entry inode");
-            goto end;
-          }
+    it->entry = it->geometry->find_entry(it->geometry, arr, it->entry, true);
+    if (it->entry < it->geometry->entries_per_block) {
+      *direntry = arr + it->entry;
+      // write to the output inode if provided
+      if (inode != NULL) {
+        if (sfs_fs_read_inode(it->fs, arr[it->entry].inumber, inode)) {
+          log_msg("error reading directory entry inode");
+          goto end;
         }
-        ++it->entry;
-        return it;
       }
       ++it->entry;
+      return it;
     }
 
     ++it->iblock;
@@ -149,58 +150,52 @@ int sfs_dir_iterclose(void* iterator) {
   return 0;
 }
 
-int sfs_dir_link(void* fs, struct sfs_fs_inode* directory, const char* name,
-                 struct sfs_fs_inode* inode) {
-  assert(fs != NULL);
-  assert(directory != NULL);
-  assert(name != NULL);
-  assert(inode != NULL);
-
-  if (strlen(name) > 255) {
-    log_msg("name too long");
-    return -1;
-  }
-
-  sfs_block_t tmp_block;
+/**
+ * the body of sfs_dir_link(), with |tmp_block| to read directory blocks into
+ */
+static int link_entry(void* fs, struct sfs_fs_inode* directory,
+                      const char* name, struct sfs_fs_inode* inode,
+                      char* tmp_block) {
+  const struct sfs_geometry* geometry = sfs_fs_geometry(fs);
+  uint32_t block_size = geometry->block_size;
   struct sfs_dir_entry* arr = (struct sfs_dir_entry*)tmp_block;
-  for (uint64_t i = 0; i < directory->size / BLOCK_SIZE; ++i) {
+  for (uint64_t i = 0; i < directory->size / block_size; ++i) {
     if (sfs_fs_inode_block_read(fs, directory, i, tmp_block)) {
       log_msg("error reading directory block %" PRIu64, i);
       return -1;
     }
-    for (uint64_t j = 0; j < BLOCK_SIZE / sizeof(struct sfs_dir_entry); ++j) {
-      if (arr[j].inumber == 0) {
-        arr[j].inumber = inode->inumber;
-        strncpy(arr[j].name, name, 256);
-        if (sfs_fs_inode_block_write(fs, directory, i, tmp_block)) {
-          log_msg("error writing directory block %" PRIu64, i);
-          return -1;
-        }
-        ++inode->links;
-        directory->modified_time = inode->change_time = time(NULL);
-        if (sfs_fs_write_inode(fs, directory)) {
-          log_msg("error updating mtime on directory");
-          return -1;
-        }
-        if (sfs_fs_write_inode(fs, inode)) {
-          log_msg("error updating links on inode");
-          return -1;
-        }
-        return 0;
+    uint64_t j = geometry->find_entry(geometry, arr, 0, false);
+    if (j < geometry->entries_per_block) {
+      arr[j].inumber = inode->inumber;
+      strncpy(arr[j].name, name, 256);
+      if (sfs_fs_inode_block_write(fs, directory, i, tmp_block)) {
+        log_msg("error writing directory block %" PRIu64, i);
+        return -1;
+      }
+      ++inode->links;
+      directory->modified_time = inode->change_time = time(NULL);
+      if (sfs_fs_write_inode(fs, directory)) {
+        log_msg("error updating mtime on directory");
+        return -1;
+      }
+      if (sfs_fs_write_inode(fs, inode)) {
+        log_msg("error updating links on inode");
+        return -1;
       }
+      return 0;
     }
   }
 
-  memset(tmp_block, 0, BLOCK_SIZE);
+  memset(tmp_block, 0, block_size);
   arr[0].inumber = inode->inumber;
   strncpy(arr[0].name, name, 256);
-  if (sfs_fs_inode_block_write(fs, directory, directory->size / BLOCK_SIZE,
+  if (sfs_fs_inode_block_write(fs, directory, directory->size / block_size,
                                tmp_block)) {
     log_msg("error adding directory block %" PRIu64,
-            directory->size / BLOCK_SIZE + 1);
+            directory->size / block_size + 1);
     return -1;
   }
-  directory->size += BLOCK_SIZE;
+  directory->size += block_size;
   directory->modified_time = time(NULL);
   if (sfs_fs_write_inode(fs, directory)) {
     log_msg("error updating directory");
@@ -216,3 +211,26 @@ int sfs_dir_link(void* fs, struct sfs_fs_inode* directory, const char* name,
 
   return 0;
 }
+
+int sfs_dir_link(void* fs, struct sfs_fs_inode* directory, const char* name,
+                 struct sfs_fs_inode* inode) {
+  assert(fs != NULL);
+  assert(directory != NULL);
+  assert(name != NULL);
+  assert(inode != NULL);
+
+  if (strlen(name) > 255) {
+    log_msg("name too long");
+    return -1;
+  }
+
+  // a block is too big for the stack of FUSE threads
+  char* tmp_block = malloc(sfs_fs_geometry(fs)->block_size);
+  if (tmp_block == NULL) {
+    log_msg("malloc failure");
+    return -1;
+  }
+  int ret = link_entry(fs, directory, name, inode, tmp_block);
+  free(tmp_block);
+  return ret;
+}
@@ -0,0 +1,180 @@
+#include "extent.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+/**
+ * makes room for |n| more extents at index |i| of |list|
+ */
+static int make_room(struct sfs_extent_list* list, uint64_t i, uint64_t n) {
+  if (list->count + n > list->capacity) {
+    uint64_t capacity = list->capacity ? list->capacity * 2 : 16;
+    while (capacity < list->count + n) {
+      capacity *= 2;
+    }
+    struct sfs_fs_extent* extents =
+        realloc(list->extents, capacity * sizeof(struct sfs_fs_extent));
+    if (extents == NULL) {
+      log_msg("malloc failure");
+      return -1;
+    }
+    list->extents = extents;
+    list->capacity = capacity;
+  }
+  memmove(&list->extents[i + n], &list->extents[i],
+          (list->count - i) * sizeof(struct sfs_fs_extent));
+  list->count += n;
+  return 0;
+}
+
+/**
+ * returns true if |b| continues |a| both logically and on disk, and the two
+ * fit in one extent
+ */
+static bool adjacent(const struct sfs_fs_extent* a,
+                     const struct sfs_fs_extent* b) {
+  return (uint64_t)a->iblock + a->count == b->iblock &&
+         a->start + a->count == b->start &&
+         (uint64_t)a->count + b->count <= UINT32_MAX;
+}
+
+void sfs_extent_list_init(struct sfs_extent_list* list) {
+  assert(list != NULL);
+  list->extents = NULL;
+  list->count = 0;
+  list->capacity = 0;
+}
+
+void sfs_extent_list_free(struct sfs_extent_list* list) {
+  assert(list != NULL);
+  free(list->extents);
+  sfs_extent_list_init(list);
+}
+
+int sfs_extent_append(struct sfs_extent_list* list,
+                      const struct sfs_fs_extent* extent) {
+  assert(list != NULL);
+  assert(extent != NULL);
+
+  if (make_room(list, list->count, 1)) {
+    return -1;
+  }
+  list->extents[list->count - 1] = *extent;
+  return 0;
+}
+
+uint64_t sfs_extent_search(const struct sfs_fs_extent* entries, uint64_t count,
+                           uint64_t iblock) {
+  uint64_t lo = 0, hi = count;
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (entries[mid].iblock <= iblock) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+uint64_t sfs_extent_lookup(const struct sfs_extent_list* list,
+                           uint64_t iblock) {
+  assert(list != NULL);
+
+  uint64_t i = sfs_extent_search(list->extents, list->count, iblock);
+  if (i == 0) {
+    return 0;
+  }
+  const struct sfs_fs_extent* e = &list->extents[i - 1];
+  return iblock < (uint64_t)e->iblock + e->count
+             ? e->start + (iblock - e->iblock)
+             : 0;
+}
+
+int sfs_extent_insert(struct sfs_extent_list* list, uint64_t iblock,
+                      uint64_t start, uint64_t count) {
+  assert(list != NULL);
+  assert(iblock + count - 1 <= UINT32_MAX);
+
+  while (count > 0) {
+    struct sfs_fs_extent extent = {
+        .iblock = iblock,
+        .count = count < UINT32_MAX ? count : UINT32_MAX,
+        .start = start,
+    };
+    uint64_t i = sfs_extent_search(list->extents, list->count, iblock);
+    assert(i == 0 || (uint64_t)list->extents[i - 1].iblock +
+                             list->extents[i - 1].count <=
+                         iblock);
+    if (i > 0 && adjacent(&list->extents[i - 1], &extent)) {
+      list->extents[i - 1].count += extent.count;
+      --i;
+    } else {
+      if (make_room(list, i, 1)) {
+        return -1;
+      }
+      list->extents[i] = extent;
+    }
+    // the extent may now reach the one after it
+    if (i + 1 < list->count &&
+        adjacent(&list->extents[i], &list->extents[i + 1])) {
+      list->extents[i].count += list->extents[i + 1].count;
+      memmove(&list->extents[i + 1], &list->extents[i + 2],
+              (list->count - i - 2) * sizeof(struct sfs_fs_extent));
+      --list->count;
+    }
+    iblock += extent.count;
+    start += extent.count;
+    count -= extent.count;
+  }
+  return 0;
+}
+
+int sfs_extent_remove(struct sfs_extent_list* list, uint64_t iblock,
+                      uint64_t* start) {
+  assert(list != NULL);
+  assert(start != NULL);
+
+  *start = sfs_extent_lookup(list, iblock);
+  if (*start == 0) {
+    return 0;
+  }
+  uint64_t i = sfs_extent_search(list->extents, list->count, iblock) - 1;
+  struct sfs_fs_extent* e = &list->extents[i];
+  uint64_t offset = iblock - e->iblock;
+  if (e->count == 1) {
+    memmove(e, e + 1, (list->count - i - 1) * sizeof(struct sfs_fs_extent));
+    --list->count;
+  } else if (offset == 0) {
+    ++e->iblock;
+    ++e->start;
+    --e->count;
+  } else if (offset == e->count - 1) {
+    --e->count;
+  } else {
+    if (make_room(list, i + 1, 1)) {
+      return -1;
+    }
+    e = &list->extents[i];
+    struct sfs_fs_extent* after = e + 1;
+    after->iblock = iblock + 1;
+    after->start = *start + 1;
+    after->count = e->count - offset - 1;
+    e->count = offset;
+  }
+  return 0;
+}
+
+uint64_t sfs_extent_tree_blocks(uint64_t extents, uint64_t per_node,
+                                uint64_t root_entries) {
+  uint64_t blocks = 0;
+  while (extents > root_entries) {
+    extents = (extents + per_node - 1) / per_node;
+    blocks += extents;
+  }
+  return blocks;
+}
@@ -0,0 +1,83 @@
+/**
+ * the extents of a file, in memory
+ *
+ * an extent-mapped inode's tree is read into one of these lists whenever its
+ * mapping changes: blocks are mapped and unmapped in the list, and the
+ * filesystem writes the whole tree back from it. a file whose blocks were
+ * allocated contiguously is a single extent however long it is.
+ *
+ * also the arithmetic on the extent tree's shape, which is entirely decided
+ * by how many extents it holds. nothing here does I/O.
+ */
+
+#ifndef _EXTENT_H_
+#define _EXTENT_H_
+
+#include <stdint.h>
+
+#include "fs.h"
+
+/**
+ * extents sorted by logical block, none of them overlapping
+ */
+struct sfs_extent_list {
+  struct sfs_fs_extent* extents;
+  uint64_t count;
+  uint64_t capacity;
+};
+
+void sfs_extent_list_init(struct sfs_extent_list* list);
+
+void sfs_extent_list_free(struct sfs_extent_list* list);
+
+/**
+ * puts |extent| at the end of |list|, as is
+ *
+ * returns 0 if OK, otherwise -1
+ */
+int sfs_extent_append(struct sfs_extent_list* list,
+                      const struct sfs_fs_extent* extent);
+
+/**
+ * returns how many of the |count| |entries| (sorted by logical block) start
+ * at or before logical block |iblock|
+ */
+uint64_t sfs_extent_search(const struct sfs_fs_extent* entries, uint64_t count,
+                           uint64_t iblock);
+
+/**
+ * returns the disk block logical block |iblock| is mapped to in |list|, or 0
+ * if it is a hole
+ */
+uint64_t sfs_extent_lookup(const struct sfs_extent_list* list,
+                           uint64_t iblock);
+
+/**
+ * maps the |count| logical blocks from |iblock|, which are holes in |list|, to
+ * the disk blocks from |start|. the new extent is merged with its neighbors
+ * where they are adjacent on disk as well.
+ *
+ * returns 0 if OK, otherwise -1
+ */
+int sfs_extent_insert(struct sfs_extent_list* list, uint64_t iblock,
+                      uint64_t start, uint64_t count);
+
+/**
+ * unmaps logical block |iblock| from |list|, splitting its extent if it is in
+ * the middle of one, and writes the disk block it was mapped to (0 if none)
+ * to |start|
+ *
+ * returns 0 if OK, otherwise -1
+ */
+int sfs_extent_remove(struct sfs_extent_list* list, uint64_t iblock,
+                      uint64_t* start);
+
+/**
+ * returns how many blocks a tree of |extents| extents takes outside the
+ * inode, when each of them holds |per_node| entries and the inode itself
+ * |root_entries|
+ */
+uint64_t sfs_extent_tree_blocks(uint64_t extents, uint64_t per_node,
+                                uint64_t root_entries);
+
+#endif  // _EXTENT_H_
@@ -0,0 +1,108 @@
+#include "extent.h"
+
+#include <assert.h>
+#include <stdio.h>
+
+static void assert_extent(const struct sfs_extent_list* list, uint64_t i,
+                          uint32_t iblock, uint32_t count, uint64_t start) {
+  assert(i < list->count);
+  assert(list->extents[i].iblock == iblock);
+  assert(list->extents[i].count == count);
+  assert(list->extents[i].start == start);
+}
+
+int main() {
+  struct sfs_extent_list list;
+  sfs_extent_list_init(&list);
+
+  // blocks that follow on disk as well grow the extent before them
+  assert(sfs_extent_insert(&list, 0, 100, 4) == 0);
+  assert(sfs_extent_insert(&list, 4, 104, 2) == 0);
+  assert(list.count == 1);
+  assert_extent(&list, 0, 0, 6, 100);
+
+  // logically adjacent but elsewhere on disk, or a hole in between: no merge
+  assert(sfs_extent_insert(&list, 6, 200, 2) == 0);
+  assert(sfs_extent_insert(&list, 20, 214, 5) == 0);
+  assert(list.count == 3);
+  assert_extent(&list, 1, 6, 2, 200);
+  assert_extent(&list, 2, 20, 5, 214);
+
+  // filling the hole merges with both neighbors at once
+  assert(sfs_extent_insert(&list, 8, 202, 12) == 0);
+  assert(list.count == 2);
+  assert_extent(&list, 1, 6, 19, 200);
+  assert(sfs_extent_insert(&list, 30, 224, 2) == 0);
+  assert(sfs_extent_insert(&list, 25, 219, 5) == 0);
+  assert(list.count == 2);
+  assert_extent(&list, 1, 6, 26, 200);
+  // next on disk but not logically, or the other way around
+  assert(sfs_extent_insert(&list, 32, 400, 1) == 0);
+  assert(sfs_extent_insert(&list, 40, 226, 1) == 0);
+  assert(list.count == 4);
+
+  // lookups at the edges of extents and in holes
+  sfs_extent_list_free(&list);
+  assert(sfs_extent_insert(&list, 10, 500, 10) == 0);
+  assert(sfs_extent_insert(&list, 30, 700, 5) == 0);
+  assert(sfs_extent_lookup(&list, 0) == 0);
+  assert(sfs_extent_lookup(&list, 9) == 0);
+  assert(sfs_extent_lookup(&list, 10) == 500);
+  assert(sfs_extent_lookup(&list, 19) == 509);
+  assert(sfs_extent_lookup(&list, 20) == 0);
+  assert(sfs_extent_lookup(&list, 29) == 0);
+  assert(sfs_extent_lookup(&list, 30) == 700);
+  assert(sfs_extent_lookup(&list, 34) == 704);
+  assert(sfs_extent_lookup(&list, 35) == 0);
+  assert(sfs_extent_search(list.extents, list.count, 9) == 0);
+  assert(sfs_extent_search(list.extents, list.count, 10) == 1);
+  assert(sfs_extent_search(list.extents, list.count, 30) == 2);
+
+  // removing from the middle splits the extent, from the ends shrinks it
+  uint64_t start;
+  assert(sfs_extent_remove(&list, 14, &start) == 0);
+  assert(start == 504);
+  assert(list.count == 3);
+  assert_extent(&list, 0, 10, 4, 500);
+  assert_extent(&list, 1, 15, 5, 505);
+  assert(sfs_extent_lookup(&list, 14) == 0);
+  assert(sfs_extent_lookup(&list, 15) == 505);
+  assert(sfs_extent_remove(&list, 10, &start) == 0);
+  assert(start == 500);
+  assert_extent(&list, 0, 11, 3, 501);
+  assert(sfs_extent_remove(&list, 19, &start) == 0);
+  assert(start == 509);
+  assert_extent(&list, 1, 15, 4, 505);
+  assert(sfs_extent_remove(&list, 25, &start) == 0);
+  assert(start == 0);
+  assert(list.count == 3);
+  // putting a block back where it was joins the halves again
+  assert(sfs_extent_insert(&list, 14, 504, 1) == 0);
+  assert(list.count == 2);
+  assert_extent(&list, 0, 11, 8, 501);
+
+  // and removing a single-block extent drops it
+  sfs_extent_list_free(&list);
+  assert(sfs_extent_insert(&list, 3, 30, 1) == 0);
+  assert(sfs_extent_insert(&list, 5, 50, 1) == 0);
+  assert(sfs_extent_remove(&list, 3, &start) == 0);
+  assert(start == 30);
+  assert(list.count == 1);
+  assert_extent(&list, 0, 5, 1, 50);
+  sfs_extent_list_free(&list);
+
+  // nodes outside the inode, with 5 (compact inodes) or 6 root entries
+  assert(sfs_extent_tree_blocks(0, 255, 6) == 0);
+  assert(sfs_extent_tree_blocks(6, 255, 6) == 0);
+  assert(sfs_extent_tree_blocks(7, 255, 6) == 1);
+  assert(sfs_extent_tree_blocks(255 * 6, 255, 6) == 6);
+  assert(sfs_extent_tree_blocks(255 * 6 + 1, 255, 6) == 7 + 1);
+  assert(sfs_extent_tree_blocks(5, 255, 5) == 0);
+  assert(sfs_extent_tree_blocks(6, 255, 5) == 1);
+  assert(sfs_extent_tree_blocks(255 * 5, 255, 5) == 5);
+  assert(sfs_extent_tree_blocks(255 * 5 + 1, 255, 5) == 6 + 1);
+  assert(sfs_extent_tree_blocks(255 * 255 * 5 + 1, 255, 5) ==
+         255 * 5 + 1 + 6 + 1);
+
+  printf("OK\n");
+}
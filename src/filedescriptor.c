@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
 
 #ifdef HAVE_STRUCT_H
 #include <struct.h>
@@ -83,6 +84,7 @@ void sfs_filedescriptor_pool_deinit(void* arg) {
 static struct sfs_fd* init_slot_as_sfs_fd(union slot* s) {
   int fd = s->n.fd;
   s->s.fd = fd;
+  memset(&s->s.readahead, 0, sizeof(struct sfs_readahead_state));
 
   // TODO: do other fd init here
 
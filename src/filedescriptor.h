@@ -10,10 +10,13 @@
 
 #include <stdint.h>
 
+#include "readahead.h"
+
 struct sfs_fd {
   int fd;
   uint64_t inumber;
   uint64_t flags;
+  struct sfs_readahead_state readahead;
 };
 
 /**
@@ -0,0 +1,143 @@
+#include "flusher.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "fs.h"
+#include "log.h"
+
+// the thread looks for expired blocks this often, or more often if blocks
+// expire sooner
+#define WAKE_INTERVAL_MS 1000
+
+struct flusher {
+  void* fs;
+  pthread_mutex_t* fs_mu;
+  uint64_t expire_ms;
+  unsigned dirty_ratio;
+  uint64_t interval_ms;
+
+  pthread_t thread;
+
+  // |mu| guards the rest; |cond| is signaled when the cache is getting full
+  // or the thread should stop
+  pthread_mutex_t mu;
+  pthread_cond_t cond;
+  bool stopping;
+  bool kicked;
+};
+
+static void* run(void* arg) {
+  struct flusher* fl = (struct flusher*)arg;
+
+  pthread_mutex_lock(&fl->mu);
+  while (!fl->stopping) {
+    if (!fl->kicked) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      uint64_t ns = deadline.tv_nsec + fl->interval_ms % 1000 * 1000000;
+      deadline.tv_sec += fl->interval_ms / 1000 + ns / 1000000000;
+      deadline.tv_nsec = ns % 1000000000;
+      pthread_cond_timedwait(&fl->cond, &fl->mu, &deadline);
+      if (fl->stopping) {
+        break;
+      }
+    }
+
+    // once the cache is filling up, everything dirty goes
+    uint64_t min_age_ms = fl->kicked ? 0 : fl->expire_ms;
+    fl->kicked = false;
+    pthread_mutex_unlock(&fl->mu);
+
+    pthread_mutex_lock(fl->fs_mu);
+    if (sfs_fs_writeback(fl->fs, min_age_ms, fl->fs_mu)) {
+      log_msg("background writeback failed");
+    }
+    pthread_mutex_unlock(fl->fs_mu);
+
+    pthread_mutex_lock(&fl->mu);
+  }
+  pthread_mutex_unlock(&fl->mu);
+
+  return NULL;
+}
+
+void* sfs_flusher_init(void* fs, pthread_mutex_t* mu, uint64_t expire_ms,
+                       unsigned dirty_ratio) {
+  assert(fs != NULL);
+  assert(mu != NULL);
+
+  struct flusher* fl = malloc(sizeof(struct flusher));
+  if (fl == NULL) {
+    return NULL;
+  }
+
+  fl->fs = fs;
+  fl->fs_mu = mu;
+  fl->expire_ms = expire_ms;
+  fl->dirty_ratio = dirty_ratio;
+  fl->interval_ms = expire_ms < WAKE_INTERVAL_MS ? expire_ms : WAKE_INTERVAL_MS;
+  if (fl->interval_ms == 0) {
+    fl->interval_ms = 1;
+  }
+  fl->stopping = false;
+  fl->kicked = false;
+
+  if (pthread_mutex_init(&fl->mu, NULL)) {
+    free(fl);
+    return NULL;
+  }
+  if (pthread_cond_init(&fl->cond, NULL)) {
+    pthread_mutex_destroy(&fl->mu);
+    free(fl);
+    return NULL;
+  }
+  if (pthread_create(&fl->thread, NULL, run, fl)) {
+    pthread_cond_destroy(&fl->cond);
+    pthread_mutex_destroy(&fl->mu);
+    free(fl);
+    return NULL;
+  }
+
+  log_msg("writing back after %" PRIu64 "ms or at %u%% dirty", expire_ms,
+          dirty_ratio);
+  return fl;
+}
+
+void sfs_flusher_deinit(void* arg) {
+  struct flusher* fl = (struct flusher*)arg;
+  assert(fl != NULL);
+
+  pthread_mutex_lock(&fl->mu);
+  fl->stopping = true;
+  pthread_cond_signal(&fl->cond);
+  pthread_mutex_unlock(&fl->mu);
+  pthread_join(fl->thread, NULL);
+
+  pthread_cond_destroy(&fl->cond);
+  pthread_mutex_destroy(&fl->mu);
+  free(fl);
+}
+
+void sfs_flusher_update(void* arg) {
+  struct flusher* fl = (struct flusher*)arg;
+  if (fl == NULL) {
+    return;
+  }
+
+  uint64_t dirty = sfs_fs_dirty_percent(fl->fs);
+  if (dirty >= fl->dirty_ratio) {
+    // the disk can't keep up; make the writer wait for it
+    if (sfs_fs_writeback(fl->fs, 0, fl->fs_mu)) {
+      log_msg("writeback at %" PRIu64 "%% dirty failed", dirty);
+    }
+  } else if (dirty >= fl->dirty_ratio / 2) {
+    pthread_mutex_lock(&fl->mu);
+    fl->kicked = true;
+    pthread_cond_signal(&fl->cond);
+    pthread_mutex_unlock(&fl->mu);
+  }
+}
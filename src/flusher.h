@@ -0,0 +1,43 @@
+/**
+ * background writeback of the buffer cache
+ *
+ * writes leave dirty blocks in the cache and return. a background thread
+ * writes them back once they have been dirty for a while, or as soon as too
+ * much of the cache is dirty. if writers get so far ahead that the cache hits
+ * the dirty ratio, they write back themselves before returning.
+ */
+
+#ifndef _FLUSHER_H_
+#define _FLUSHER_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+/**
+ * starts a writeback thread for the filesystem |fs|, whose callers serialize
+ * on |mu|. blocks are written back after |expire_ms| milliseconds, or early
+ * once |dirty_ratio| / 2 percent of the cache is dirty. at |dirty_ratio|
+ * percent, writers are throttled.
+ *
+ * returns opaque pointer to the flusher on success, NULL on failure
+ */
+void* sfs_flusher_init(void* fs, pthread_mutex_t* mu, uint64_t expire_ms,
+                       unsigned dirty_ratio);
+
+/**
+ * stops the writeback thread and frees memory used by |flusher|. dirty blocks
+ * are left for the filesystem to flush when it is closed. must be called
+ * without holding the filesystem lock, before the filesystem is closed.
+ */
+void sfs_flusher_deinit(void* flusher);
+
+/**
+ * checks the dirty ratio after a write, waking the writeback thread or
+ * writing back right here if it is too high. |flusher| may be NULL, in which
+ * case this does nothing.
+ *
+ * called with the filesystem lock held; the lock is dropped while writing
+ */
+void sfs_flusher_update(void* flusher);
+
+#endif  // _FLUSHER_H_
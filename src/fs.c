@@ -9,548 +9,3044 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "bitmap.h"
 #include "block.h"
+#include "cache.h"
+#include "delalloc.h"
 #include "dir.h"
+#include "extent.h"
+#include "geometry.h"
+#include "icache.h"
 #include "log.h"
+#include "prealloc.h"
+#include "reclaim.h"
+
+// buffer cache budget when the mount options don't give one
+#define DEFAULT_CACHE_MB 16
+// block size of newly formatted disks when the mount options don't give one
+#define DEFAULT_BLOCK_SIZE 4096
+// an open file's first preallocation window, in blocks; later ones double up
+// to PREALLOC_MAX_KB
+#define PREALLOC_MIN_BLOCKS 8
+#define PREALLOC_MAX_KB 1024
+// dead inodes whose blocks are sorted and freed together
+#define RECLAIM_BATCH 64
+// inode table blocks kept in the inode cache, unless more are pinned by open
+// files
+#define INODE_CACHE_KB 1024
+// with relatime, reads still update an access time this old
+#define RELATIME_INTERVAL_S (24 * 60 * 60)
+
+struct filesystem {
+  int disk;
+  void* dev;
+  void* cache;
+  struct sfs_fs_superblock superblock;
+  bool superblock_dirty;  // |superblock| is newer than block 0
+  void* icache;           // the inode table blocks in use
+
+  // derived from the block size and inode format in the superblock
+  struct sfs_geometry geometry;
+  uint64_t inodes_per_block;
+  uint64_t inode_size;     // on disk
+  uint64_t direct_blocks;  // block pointers before the indirect ones
+  int index_depth;         // levels of indirect blocks an inode can have
+  uint64_t root_entries;   // extents that fit in an inode
+  uint64_t inline_size;    // bytes of data that fit in an inode
+
+  // the block bitmap, kept in memory while mounted. bitmap block i is written
+  // back to the cache if |bitmap_dirty[i]|
+  uint64_t* bitmap;
+  bool* bitmap_dirty;
+  uint64_t alloc_next;  // the search for a free block starts here
+
+  // the allocation group descriptors and the inode bitmap, kept like the
+  // block bitmap
+  struct sfs_fs_group* groups;
+  bool* groups_dirty;
+  uint64_t* inode_bitmap;
+  bool* inode_bitmap_dirty;
+
+  // signaled under the filesystem lock whenever a writeback batch finishes
+  pthread_cond_t writeback_done;
+
+  // blocks written to holes, waiting for disk blocks until writeback, and
+  // how many free blocks they (and the index blocks they need) have claimed
+  void* delalloc;
+  uint64_t reserved;
+
+  // the preallocation windows of open files, and how many blocks they hold.
+  // their blocks are set in |bitmap| but clear in the bitmap on disk
+  void* prealloc;
+  uint64_t preallocated;
+
+  // inodes with no links left, still in use until their blocks are freed
+  void* reclaim;
+
+  bool extents;      // new inodes are extent-mapped
+  bool inline_data;  // small new files keep their data in the inode
+  int atime;         // SFS_ATIME_*
+};
+
+static int allocate_pending(struct filesystem* fs, uint64_t min_age_ms);
+static int reclaim(struct filesystem* fs);
+
+static int write_superblock(struct filesystem* fs) {
+  log_msg("writing superblock");
+  char* tmp_block = calloc(1, fs->geometry.block_size);
+  if (tmp_block == NULL) {
+    log_msg("malloc failure");
+    return -1;
+  }
+  memcpy(tmp_block, &fs->superblock, sizeof(struct sfs_fs_superblock));
+  int ret = sfs_cache_write(fs->cache, 0, tmp_block);
+  free(tmp_block);
+  if (ret) {
+    log_msg("error writing block");
+    return -1;
+  }
+  fs->superblock_dirty = false;
+  return 0;
+}
+
+static uint64_t bits_per_bitmap_block(const struct filesystem* fs) {
+  return fs->geometry.block_size * 8llu;
+}
+
+/**
+ * allocates the in-memory bitmap for the |fs->superblock.bitmap_blocks|
+ * blocks of the bitmap, all clear
+ */
+static int bitmap_alloc(struct filesystem* fs) {
+  uint64_t nblocks = fs->superblock.bitmap_blocks;
+  fs->bitmap = calloc(nblocks, fs->geometry.block_size);
+  fs->bitmap_dirty = calloc(nblocks, sizeof(bool));
+  if (fs->bitmap == NULL || fs->bitmap_dirty == NULL) {
+    log_msg("malloc failure");
+    free(fs->bitmap);
+    free(fs->bitmap_dirty);
+    fs->bitmap = NULL;
+    fs->bitmap_dirty = NULL;
+    return -1;
+  }
+  fs->alloc_next = 0;
+  return 0;
+}
+
+static void bitmap_mark_dirty(struct filesystem* fs, uint64_t block_number) {
+  fs->bitmap_dirty[block_number / bits_per_bitmap_block(fs)] = true;
+}
+
+/**
+ * marks the bitmap blocks holding the bits of blocks [start, end) dirty
+ */
+static void bitmap_mark_range_dirty(struct filesystem* fs, uint64_t start,
+                                    uint64_t end) {
+  uint64_t bits = bits_per_bitmap_block(fs);
+  for (uint64_t b = start / bits; b < (end + bits - 1) / bits; ++b) {
+    fs->bitmap_dirty[b] = true;
+  }
+}
+
+/**
+ * writes block i of the |nblocks| blocks of |data| to block |start| + i
+ * through the cache if |dirty[i]|, and clears |dirty[i]|
+ */
+static int write_table(struct filesystem* fs, uint64_t start, uint64_t nblocks,
+                       const void* data, bool* dirty) {
+  uint64_t block_size = fs->geometry.block_size;
+  for (uint64_t i = 0; i < nblocks; ++i) {
+    if (!dirty[i]) {
+      continue;
+    }
+    if (sfs_cache_write(fs->cache, start + i,
+                        (const char*)data + i * block_size)) {
+      log_msg("error writing block %" PRIu64, start + i);
+      return -1;
+    }
+    dirty[i] = false;
+  }
+  return 0;
+}
+
+/**
+ * reads the |nblocks| blocks from block |start| into |data|
+ */
+static int read_table(struct filesystem* fs, uint64_t start, uint64_t nblocks,
+                      void* data) {
+  void** blocks = malloc(nblocks * sizeof(void*));
+  if (blocks == NULL) {
+    log_msg("malloc failure");
+    return -1;
+  }
+  for (uint64_t i = 0; i < nblocks; ++i) {
+    blocks[i] = (char*)data + i * fs->geometry.block_size;
+  }
+  struct block_run run = {start, nblocks, blocks};
+  int ret = sfs_cache_read_runs(fs->cache, &run, 1);
+  free(blocks);
+  return ret;
+}
+
+static void clear_window(struct sfs_prealloc_window* window, void* arg) {
+  struct filesystem* fs = (struct filesystem*)arg;
+  sfs_bitmap_clear_range(fs->bitmap, window->start,
+                         window->start + window->count);
+}
+
+static void set_window(struct sfs_prealloc_window* window, void* arg) {
+  struct filesystem* fs = (struct filesystem*)arg;
+  sfs_bitmap_set_range(fs->bitmap, window->start,
+                       window->start + window->count);
+}
+
+/**
+ * writes the dirty blocks of the bitmap to the cache. blocks in preallocation
+ * windows are written as free, so a crash doesn't lose them.
+ */
+static int write_bitmap(struct filesystem* fs) {
+  sfs_prealloc_foreach(fs->prealloc, clear_window, fs);
+  int ret = write_table(fs, fs->superblock.bitmap_start,
+                        fs->superblock.bitmap_blocks, fs->bitmap,
+                        fs->bitmap_dirty);
+  sfs_prealloc_foreach(fs->prealloc, set_window, fs);
+  if (ret) {
+    log_msg("error writing bitmap");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * reads the bitmap of |fs| into memory
+ */
+static int load_bitmap(struct filesystem* fs) {
+  if (bitmap_alloc(fs)) {
+    return -1;
+  }
+  if (read_table(fs, fs->superblock.bitmap_start, fs->superblock.bitmap_blocks,
+                 fs->bitmap)) {
+    log_msg("error reading bitmap");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * allocates the in-memory inode bitmap for the
+ * |fs->superblock.inode_bitmap_blocks| blocks of it, all set
+ */
+static int inode_bitmap_alloc(struct filesystem* fs) {
+  uint64_t nblocks = fs->superblock.inode_bitmap_blocks;
+  fs->inode_bitmap = malloc(nblocks * fs->geometry.block_size);
+  fs->inode_bitmap_dirty = calloc(nblocks, sizeof(bool));
+  if (fs->inode_bitmap == NULL || fs->inode_bitmap_dirty == NULL) {
+    log_msg("malloc failure");
+    free(fs->inode_bitmap);
+    free(fs->inode_bitmap_dirty);
+    fs->inode_bitmap = NULL;
+    fs->inode_bitmap_dirty = NULL;
+    return -1;
+  }
+  memset(fs->inode_bitmap, 0xff, nblocks * fs->geometry.block_size);
+  return 0;
+}
+
+/**
+ * writes the dirty blocks of the inode bitmap to the cache
+ */
+static int write_inode_bitmap(struct filesystem* fs) {
+  if (write_table(fs, fs->superblock.inode_bitmap_start,
+                  fs->superblock.inode_bitmap_blocks, fs->inode_bitmap,
+                  fs->inode_bitmap_dirty)) {
+    log_msg("error writing inode bitmap");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * reads the inode bitmap of |fs| into memory
+ */
+static int load_inode_bitmap(struct filesystem* fs) {
+  if (inode_bitmap_alloc(fs)) {
+    return -1;
+  }
+  if (read_table(fs, fs->superblock.inode_bitmap_start,
+                 fs->superblock.inode_bitmap_blocks, fs->inode_bitmap)) {
+    log_msg("error reading inode bitmap");
+    return -1;
+  }
+  return 0;
+}
+
+static void inode_bitmap_mark_dirty(struct filesystem* fs, uint64_t inumber) {
+  fs->inode_bitmap_dirty[(inumber - 1) / bits_per_bitmap_block(fs)] = true;
+}
+
+static uint64_t groups_per_table_block(const struct filesystem* fs) {
+  return fs->geometry.block_size / sizeof(struct sfs_fs_group);
+}
+
+static uint64_t group_table_blocks(const struct filesystem* fs) {
+  uint64_t per_block = groups_per_table_block(fs);
+  return (fs->superblock.groups + per_block - 1) / per_block;
+}
+
+/**
+ * returns the first block of group |group|
+ */
+static uint64_t group_start(const struct filesystem* fs, uint64_t group) {
+  return fs->superblock.groups_first_block +
+         group * fs->superblock.group_blocks;
+}
+
+/**
+ * returns the block after the last block of group |group|
+ */
+static uint64_t group_end(const struct filesystem* fs, uint64_t group) {
+  uint64_t end = group_start(fs, group) + fs->superblock.group_blocks;
+  return end < fs->superblock.blocks ? end : fs->superblock.blocks;
+}
+
+/**
+ * returns the group |block_number| belongs to. the metadata before the first
+ * group counts as part of it.
+ */
+static uint64_t block_group(const struct filesystem* fs,
+                            uint64_t block_number) {
+  if (block_number < fs->superblock.groups_first_block) {
+    return 0;
+  }
+  return (block_number - fs->superblock.groups_first_block) /
+         fs->superblock.group_blocks;
+}
+
+static uint64_t inode_group(const struct filesystem* fs, uint64_t inumber) {
+  return (inumber - 1) / fs->superblock.group_inodes;
+}
+
+/**
+ * returns the first inode bitmap bit of |group|
+ */
+static uint64_t group_inode_start(const struct filesystem* fs,
+                                  uint64_t group) {
+  return group * fs->superblock.group_inodes;
+}
+
+/**
+ * returns one past the last inode bitmap bit of |group|
+ */
+static uint64_t group_inode_end(const struct filesystem* fs, uint64_t group) {
+  uint64_t end = (group + 1) * fs->superblock.group_inodes;
+  return end < fs->superblock.inodes ? end : fs->superblock.inodes;
+}
+
+/**
+ * allocates the in-memory descriptors for the |fs->superblock.groups| groups,
+ * all zero
+ */
+static int groups_alloc(struct filesystem* fs) {
+  uint64_t nblocks = group_table_blocks(fs);
+  fs->groups = calloc(nblocks, fs->geometry.block_size);
+  fs->groups_dirty = calloc(nblocks, sizeof(bool));
+  if (fs->groups == NULL || fs->groups_dirty == NULL) {
+    log_msg("malloc failure");
+    free(fs->groups);
+    free(fs->groups_dirty);
+    fs->groups = NULL;
+    fs->groups_dirty = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+static void group_mark_dirty(struct filesystem* fs, uint64_t group) {
+  fs->groups_dirty[group / groups_per_table_block(fs)] = true;
+}
+
+/**
+ * returns the first inode table block of |group|. a table block belongs to the
+ * group of its first inode, so every table block belongs to exactly one group.
+ */
+static uint64_t group_itable_start(const struct filesystem* fs,
+                                   uint64_t group) {
+  uint64_t ipb = fs->inodes_per_block;
+  return (group_inode_start(fs, group) + ipb - 1) / ipb + 1;
+}
+
+/**
+ * returns the inode table block after the last one of |group|
+ */
+static uint64_t group_itable_end(const struct filesystem* fs, uint64_t group) {
+  uint64_t ipb = fs->inodes_per_block;
+  return (group_inode_end(fs, group) + ipb - 1) / ipb + 1;
+}
+
+/**
+ * returns the group inode table block |block_number| belongs to
+ */
+static uint64_t itable_group(const struct filesystem* fs,
+                             uint64_t block_number) {
+  return (block_number - 1) * fs->inodes_per_block /
+         fs->superblock.group_inodes;
+}
+
+/**
+ * sets up |fs| for inodes in |format| (SFS_INODE_FORMAT_*)
+ */
+static void set_inode_format(struct filesystem* fs, uint64_t format) {
+  if (format == SFS_INODE_FORMAT_V2) {
+    fs->inode_size = sizeof(struct sfs_fs_inode_v2);
+    fs->direct_blocks = SFS_V2_NDIR_BLOCKS;
+    fs->index_depth = SFS_V2_N_BLOCKS - SFS_V2_NDIR_BLOCKS;
+    fs->inline_size = SFS_V2_N_BLOCKS * sizeof(uint64_t);
+  } else {
+    fs->inode_size = SFS_V1_INODE_SIZE;
+    fs->direct_blocks = SFS_NDIR_BLOCKS;
+    fs->index_depth = SFS_V1_N_BLOCKS - SFS_IND_BLOCK;
+    fs->inline_size = SFS_INLINE_DATA_SIZE;
+  }
+  fs->root_entries = (fs->inline_size - sizeof(struct sfs_fs_extent_header)) /
+                     sizeof(struct sfs_fs_extent);
+  fs->inodes_per_block = fs->geometry.block_size / fs->inode_size;
+}
+
+/**
+ * reads inode |inumber| from |raw|, its place in an inode table block, into
+ * |inode|
+ */
+static void decode_inode(const struct filesystem* fs, uint64_t inumber,
+                         const void* raw, struct sfs_fs_inode* inode) {
+  if (fs->inode_size == SFS_V1_INODE_SIZE) {
+    memset(inode, 0, sizeof(struct sfs_fs_inode));
+    memcpy(inode, raw, SFS_V1_INODE_SIZE);
+    return;
+  }
+  struct sfs_fs_inode_v2 v2;
+  memcpy(&v2, raw, sizeof(v2));
+  memset(inode, 0, sizeof(struct sfs_fs_inode));
+  inode->inumber = inumber;
+  inode->mode = v2.mode;
+  inode->flags = v2.flags;
+  inode->uid = v2.uid;
+  inode->gid = v2.gid;
+  inode->links = v2.links;
+  inode->access_time = v2.access_time;
+  inode->modified_time = v2.modified_time;
+  inode->change_time = v2.change_time;
+  inode->size = (uint64_t)v2.size_high << 32 | v2.size_low;
+  if (inode->flags & (SFS_INODE_EXTENTS | SFS_INODE_INLINE)) {
+    memcpy(inode->block_pointers, v2.block_pointers, fs->inline_size);
+  } else {
+    memcpy(inode->block_pointers, v2.block_pointers,
+           SFS_V2_NDIR_BLOCKS * sizeof(uint64_t));
+    memcpy(&inode->block_pointers[SFS_IND_BLOCK],
+           &v2.block_pointers[SFS_V2_NDIR_BLOCKS], 3 * sizeof(uint64_t));
+  }
+}
+
+/**
+ * writes |inode| to |raw|, its place in an inode table block
+ *
+ * returns 0 if OK, otherwise -1 (if the format has no room for its size or
+ * link count)
+ */
+static int encode_inode(const struct filesystem* fs,
+                        const struct sfs_fs_inode* inode, void* raw) {
+  if (fs->inode_size == SFS_V1_INODE_SIZE) {
+    assert(inode->block_pointers[SFS_TIND_BLOCK] == 0);
+    memcpy(raw, inode, SFS_V1_INODE_SIZE);
+    return 0;
+  }
+  if (inode->size >> 48 != 0 || inode->links > UINT16_MAX) {
+    log_msg("inode %" PRIu64 " doesn't fit the inode format", inode->inumber);
+    return -1;
+  }
+  struct sfs_fs_inode_v2 v2;
+  memset(&v2, 0, sizeof(v2));
+  v2.mode = inode->mode;
+  v2.flags = inode->flags;
+  v2.uid = inode->uid;
+  v2.gid = inode->gid;
+  v2.links = inode->links;
+  // times past 2106 stick there
+  v2.access_time = inode->access_time < UINT32_MAX ? inode->access_time
+                                                   : UINT32_MAX;
+  v2.modified_time = inode->modified_time < UINT32_MAX ? inode->modified_time
+                                                       : UINT32_MAX;
+  v2.change_time = inode->change_time < UINT32_MAX ? inode->change_time
+                                                   : UINT32_MAX;
+  v2.size_high = inode->size >> 32;
+  v2.size_low = (uint32_t)inode->size;
+  if (inode->flags & (SFS_INODE_EXTENTS | SFS_INODE_INLINE)) {
+    memcpy(v2.block_pointers, inode->block_pointers, fs->inline_size);
+  } else {
+    memcpy(v2.block_pointers, inode->block_pointers,
+           SFS_V2_NDIR_BLOCKS * sizeof(uint64_t));
+    memcpy(&v2.block_pointers[SFS_V2_NDIR_BLOCKS],
+           &inode->block_pointers[SFS_IND_BLOCK], 3 * sizeof(uint64_t));
+  }
+  memcpy(raw, &v2, sizeof(v2));
+  return 0;
+}
+
+/**
+ * fills |data| with inode table block |block_number| as formatting leaves it:
+ * free inodes (that only know their numbers, in formats that keep them)
+ */
+static void init_inode_block(const struct filesystem* fs,
+                             uint64_t block_number, void* data) {
+  memset(data, 0, fs->geometry.block_size);
+  if (fs->inode_size != SFS_V1_INODE_SIZE) {
+    return;
+  }
+  for (uint64_t j = 0; j < fs->inodes_per_block; ++j) {
+    uint64_t inumber = (block_number - 1) * fs->inodes_per_block + j + 1;
+    memcpy((char*)data + j * fs->inode_size, &inumber, sizeof(inumber));
+  }
+}
+
+/**
+ * returns true if inode table block |block_number| hasn't been written since
+ * a lazy format
+ */
+static bool inode_block_unused(const struct filesystem* fs,
+                               uint64_t block_number) {
+  uint64_t g = itable_group(fs, block_number);
+  return block_number + fs->groups[g].itable_unused >= group_itable_end(fs, g);
+}
+
+/**
+ * reads inode table block |block_number| into |data|. blocks that were never
+ * written read as they would have been formatted, without any I/O.
+ */
+static int read_inode_block(struct filesystem* fs, uint64_t block_number,
+                            void* data) {
+  if (inode_block_unused(fs, block_number)) {
+    init_inode_block(fs, block_number, data);
+    return 0;
+  }
+  return sfs_cache_read(fs->cache, block_number, data);
+}
+
+/**
+ * gets inode table block |block_number| ready to be written. if it was never
+ * written, it and the unused blocks of its group before it are initialized in
+ * the cache, so the group's unused blocks stay at the end of its table.
+ */
+static int use_inode_block(struct filesystem* fs, uint64_t block_number) {
+  if (!inode_block_unused(fs, block_number)) {
+    return 0;
+  }
+  uint64_t g = itable_group(fs, block_number);
+  uint64_t end = group_itable_end(fs, g);
+  char* block = malloc(fs->geometry.block_size);
+  if (block == NULL) {
+    log_msg("malloc failure");
+    return -1;
+  }
+  for (uint64_t b = end - fs->groups[g].itable_unused; b <= block_number;
+       ++b) {
+    init_inode_block(fs, b, block);
+    if (sfs_cache_write(fs->cache, b, block)) {
+      log_msg("error initializing inode block %" PRIu64, b);
+      free(block);
+      return -1;
+    }
+  }
+  free(block);
+  fs->groups[g].itable_unused = end - block_number - 1;
+  group_mark_dirty(fs, g);
+  return 0;
+}
+
+/**
+ * passes inode table block |block_number| from the inode cache to the buffer
+ * cache of filesystem |arg|
+ */
+static int write_inode_block(uint64_t block_number, const void* data,
+                             void* arg) {
+  struct filesystem* fs = (struct filesystem*)arg;
+  return sfs_cache_write(fs->cache, block_number, data);
+}
+
+/**
+ * returns the inode table block that holds inode |inumber|
+ */
+static uint64_t inode_block_number(const struct filesystem* fs,
+                                   uint64_t inumber) {
+  // superblock is the first block, inodes start at block index 1
+  return (inumber - 1) / fs->inodes_per_block + 1;
+}
+
+/**
+ * returns inode table block |block_number|, read into the inode cache if it
+ * isn't there yet, or NULL on failure. it stays valid until another block is
+ * read.
+ */
+static char* inode_block(struct filesystem* fs, uint64_t block_number) {
+  char* data = sfs_icache_get(fs->icache, block_number);
+  if (data != NULL) {
+    return data;
+  }
+  data = sfs_icache_add(fs->icache, block_number, write_inode_block, fs);
+  if (data == NULL) {
+    return NULL;
+  }
+  if (read_inode_block(fs, block_number, data)) {
+    log_msg("error reading inode block %" PRIu64, block_number);
+    sfs_icache_drop(fs->icache, block_number);
+    return NULL;
+  }
+  return data;
+}
+
+/**
+ * takes the blocks [start, end) out of the free block counts of their groups
+ */
+static void groups_take_blocks(struct filesystem* fs, uint64_t start,
+                               uint64_t end) {
+  while (start < end) {
+    uint64_t group = block_group(fs, start);
+    uint64_t stop = group_end(fs, group) < end ? group_end(fs, group) : end;
+    fs->groups[group].free_blocks -= stop - start;
+    group_mark_dirty(fs, group);
+    fs->superblock.free_blocks -= stop - start;
+    start = stop;
+  }
+  fs->superblock_dirty = true;
+}
+
+/**
+ * puts the blocks [start, end) back into the free block counts of their
+ * groups
+ */
+static void groups_give_blocks(struct filesystem* fs, uint64_t start,
+                               uint64_t end) {
+  while (start < end) {
+    uint64_t group = block_group(fs, start);
+    uint64_t stop = group_end(fs, group) < end ? group_end(fs, group) : end;
+    fs->groups[group].free_blocks += stop - start;
+    group_mark_dirty(fs, group);
+    fs->superblock.free_blocks += stop - start;
+    start = stop;
+  }
+  fs->superblock_dirty = true;
+}
+
+/**
+ * frees the blocks left in |window|, which belongs to the filesystem |arg|
+ */
+static void give_back_window(struct sfs_prealloc_window* window, void* arg) {
+  struct filesystem* fs = (struct filesystem*)arg;
+  uint64_t end = window->start + window->count;
+  sfs_bitmap_clear_range(fs->bitmap, window->start, end);
+  bitmap_mark_range_dirty(fs, window->start, end);
+  groups_give_blocks(fs, window->start, end);
+  fs->preallocated -= window->count;
+  window->count = 0;
+}
+
+/**
+ * sets the free block count of every group from the bitmap
+ */
+static void count_group_blocks(struct filesystem* fs) {
+  for (uint64_t g = 0; g < fs->superblock.groups; ++g) {
+    uint64_t start = group_start(fs, g);
+    uint64_t end = group_end(fs, g);
+    fs->groups[g].free_blocks =
+        end - start - sfs_bitmap_count_ones(fs->bitmap, start, end);
+  }
+}
+
+/**
+ * sets the free inode count of every group from the inode bitmap
+ */
+static void count_group_inodes(struct filesystem* fs) {
+  for (uint64_t g = 0; g < fs->superblock.groups; ++g) {
+    uint64_t start = group_inode_start(fs, g);
+    uint64_t end = group_inode_end(fs, g);
+    fs->groups[g].free_inodes =
+        end - start - sfs_bitmap_count_ones(fs->inode_bitmap, start, end);
+  }
+}
+
+/**
+ * writes the dirty blocks of the group descriptors to the cache
+ */
+static int write_groups(struct filesystem* fs) {
+  if (write_table(fs, fs->superblock.group_table_start, group_table_blocks(fs),
+                  fs->groups, fs->groups_dirty)) {
+    log_msg("error writing group descriptors");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * reads the group descriptors of |fs| into memory
+ */
+static int load_groups(struct filesystem* fs) {
+  if (groups_alloc(fs)) {
+    return -1;
+  }
+  if (read_table(fs, fs->superblock.group_table_start, group_table_blocks(fs),
+                 fs->groups)) {
+    log_msg("error reading group descriptors");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * sets the free block and inode counts of the superblock from the groups
+ */
+static void sum_groups(struct filesystem* fs) {
+  fs->superblock.free_blocks = 0;
+  fs->superblock.free_inodes = 0;
+  for (uint64_t g = 0; g < fs->superblock.groups; ++g) {
+    fs->superblock.free_blocks += fs->groups[g].free_blocks;
+    fs->superblock.free_inodes += fs->groups[g].free_inodes;
+  }
+}
+
+static bool has_extents(const struct sfs_fs_inode* inode) {
+  return (inode->flags & SFS_INODE_EXTENTS) != 0;
+}
+
+static bool is_inline(const struct sfs_fs_inode* inode) {
+  return (inode->flags & SFS_INODE_INLINE) != 0;
+}
+
+/**
+ * returns how many entries fit in an extent tree node outside the inode
+ */
+static uint64_t extents_per_node(const struct filesystem* fs) {
+  return (fs->geometry.block_size - sizeof(struct sfs_fs_extent_header)) /
+         sizeof(struct sfs_fs_extent);
+}
+
+/**
+ * copies the root of |inode|'s extent tree to |header| and |entries|, which
+ * has room for SFS_EXTENT_ROOT_ENTRIES
+ */
+static void read_extent_root(const struct sfs_fs_inode* inode,
+                             struct sfs_fs_extent_header* header,
+                             struct sfs_fs_extent* entries) {
+  const char* root = (const char*)inode->block_pointers;
+  memcpy(header, root, sizeof(struct sfs_fs_extent_header));
+  memcpy(entries, root + sizeof(struct sfs_fs_extent_header),
+         SFS_EXTENT_ROOT_ENTRIES * sizeof(struct sfs_fs_extent));
+}
+
+/**
+ * returns how many logical blocks an index block |depth| levels above the
+ * data maps
+ */
+static uint64_t index_span(const struct filesystem* fs, int depth) {
+  uint64_t span = 1;
+  for (int d = 0; d < depth; ++d) {
+    span *= fs->geometry.pointers_per_block;
+  }
+  return span;
+}
+
+/**
+ * returns how many free blocks |inode| needs to map |pending| more blocks,
+ * all of them from logical block |start| and before |end|: the blocks
+ * themselves and the index blocks it takes to find them
+ */
+static uint64_t blocks_needed(const struct filesystem* fs,
+                              const struct sfs_fs_inode* inode,
+                              uint64_t pending, uint64_t start, uint64_t end) {
+  if (pending == 0) {
+    return 0;
+  }
+  if (has_extents(inode)) {
+    // at worst every block is an extent of its own
+    struct sfs_fs_extent_header header;
+    struct sfs_fs_extent entries[SFS_EXTENT_ROOT_ENTRIES];
+    read_extent_root(inode, &header, entries);
+    uint64_t per_node = extents_per_node(fs);
+    return pending +
+           sfs_extent_tree_blocks(header.extents + pending, per_node,
+                                  fs->root_entries) -
+           sfs_extent_tree_blocks(header.extents, per_node, fs->root_entries);
+  }
+  uint64_t needed = pending;
+  uint64_t base = fs->direct_blocks;
+  for (int depth = 1; depth <= fs->index_depth && end > base; ++depth) {
+    uint64_t span = index_span(fs, depth);
+    if (start < base + span) {
+      // the index block in the inode, and at worst, at each level under it, an
+      // index block for each block, up to one for each index block's worth of
+      // the range
+      if (inode->block_pointers[SFS_IND_BLOCK + depth - 1] == 0) {
+        ++needed;
+      }
+      uint64_t from = start > base ? start - base : 0;
+      uint64_t to = (end < base + span ? end : base + span) - base;
+      for (int level = 1; level < depth; ++level) {
+        uint64_t level_span = index_span(fs, level);
+        uint64_t blocks = (to - 1) / level_span - from / level_span + 1;
+        needed += blocks < pending ? blocks : pending;
+      }
+    }
+    base += span;
+  }
+  return needed;
+}
+
+/**
+ * returns how many free blocks the pending blocks of |inode| have reserved
+ */
+static uint64_t pending_reservation(const struct filesystem* fs,
+                                    const struct sfs_fs_inode* inode) {
+  uint64_t pending = sfs_delalloc_inode_blocks(fs->delalloc, inode->inumber);
+  uint64_t start = sfs_delalloc_inode_start(fs->delalloc, inode->inumber);
+  uint64_t end = sfs_delalloc_inode_end(fs->delalloc, inode->inumber);
+  return blocks_needed(fs, inode, pending, start, end);
+}
+
+/**
+ * rebuilds the free counts of the groups of |fs|, which may be stale if it
+ * wasn't unmounted cleanly
+ */
+static int recount_groups(struct filesystem* fs) {
+  log_msg("filesystem was not unmounted cleanly; recounting free space");
+  count_group_blocks(fs);
+  count_group_inodes(fs);
+  for (uint64_t i = 0; i < group_table_blocks(fs); ++i) {
+    fs->groups_dirty[i] = true;
+  }
+
+  // inodes deleted before the crash whose blocks weren't freed yet are in use
+  // without links, and go back on the reclaim queue
+  uint64_t inodes = fs->superblock.inodes;
+  uint64_t orphans = 0;
+  for (uint64_t bit = sfs_bitmap_find_one(fs->inode_bitmap, 0, inodes);
+       bit < inodes;
+       bit = sfs_bitmap_find_one(fs->inode_bitmap, bit + 1, inodes)) {
+    struct sfs_fs_inode inode;
+    if (sfs_fs_read_inode(fs, bit + 1, &inode)) {
+      return -1;
+    }
+    if (inode.links == 0) {
+      if (sfs_reclaim_put(fs->reclaim, bit + 1)) {
+        return -1;
+      }
+      ++orphans;
+    }
+  }
+  if (orphans > 0) {
+    log_msg("%" PRIu64 " deleted inodes to reclaim", orphans);
+  }
+  return 0;
+}
+
+/**
+ * gives a disk formatted with a free blocks index a bitmap instead. every
+ * block not in the index (including the index blocks themselves) is in use.
+ * the bitmap goes in the first run of free blocks long enough to hold it.
+ */
+static int migrate_free_list(struct filesystem* fs) {
+  struct sfs_fs_superblock* superblock = &fs->superblock;
+  uint64_t bits = bits_per_bitmap_block(fs);
+  superblock->bitmap_blocks = (superblock->blocks + bits - 1) / bits;
+  if (bitmap_alloc(fs)) {
+    superblock->bitmap_blocks = 0;
+    return -1;
+  }
+  uint64_t map_bits = superblock->bitmap_blocks * bits;
+  sfs_bitmap_set_range(fs->bitmap, 0, map_bits);
+
+  uint64_t* index = malloc(fs->geometry.block_size);
+  if (index == NULL) {
+    log_msg("malloc failure");
+    return -1;
+  }
+  uint64_t freed = 0;
+  for (uint64_t node = superblock->free_blocks_head; node != 0;
+       node = index[0]) {
+    if (node >= superblock->blocks || !sfs_bitmap_test(fs->bitmap, node) ||
+        sfs_cache_read(fs->cache, node, index)) {
+      log_msg("bad free blocks index node %" PRIu64, node);
+      free(index);
+      return -1;
+    }
+    sfs_bitmap_clear(fs->bitmap, node);
+    ++freed;
+    for (uint64_t i = 1; i < fs->geometry.pointers_per_block; ++i) {
+      if (index[i] != 0 && index[i] < superblock->blocks) {
+        sfs_bitmap_clear(fs->bitmap, index[i]);
+        ++freed;
+      }
+    }
+  }
+  free(index);
+
+  uint64_t start = sfs_bitmap_find_zero_run(
+      fs->bitmap, 0, superblock->blocks, superblock->bitmap_blocks);
+  if (start == superblock->blocks) {
+    fprintf(stderr, "no room on the disk for a block bitmap\n");
+    log_msg("no run of %" PRIu64 " free blocks for the bitmap",
+            superblock->bitmap_blocks);
+    return -1;
+  }
+  superblock->bitmap_start = start;
+  sfs_bitmap_set_range(fs->bitmap, start, start + superblock->bitmap_blocks);
+  for (uint64_t i = 0; i < superblock->bitmap_blocks; ++i) {
+    fs->bitmap_dirty[i] = true;
+  }
+  superblock->free_blocks_head = 0;
+  fs->superblock_dirty = true;
+  log_msg("converted free blocks index (%" PRIu64
+          " free blocks) to a bitmap at block %" PRIu64,
+          freed, start);
+
+  return write_bitmap(fs);
+}
+
+/**
+ * splits a disk formatted before allocation groups into groups. the free
+ * inode list is broken up into one list per group, and the group descriptors
+ * go in the first run of free blocks long enough for them.
+ */
+static int migrate_to_groups(struct filesystem* fs) {
+  struct sfs_fs_superblock* superblock = &fs->superblock;
+  superblock->group_blocks = bits_per_bitmap_block(fs);
+  superblock->groups_first_block = 1 + superblock->inode_table_blocks;
+  superblock->groups =
+      (superblock->blocks - superblock->groups_first_block +
+       superblock->group_blocks - 1) /
+      superblock->group_blocks;
+  superblock->group_inodes =
+      (superblock->inodes + superblock->groups - 1) / superblock->groups;
+  if (groups_alloc(fs)) {
+    superblock->groups = 0;
+    return -1;
+  }
+
+  uint64_t table_blocks = group_table_blocks(fs);
+  uint64_t start = sfs_bitmap_find_zero_run(fs->bitmap, 0, superblock->blocks,
+                                            table_blocks);
+  if (start == superblock->blocks) {
+    fprintf(stderr, "no room on the disk for group descriptors\n");
+    log_msg("no run of %" PRIu64 " free blocks for the group descriptors",
+            table_blocks);
+    superblock->groups = 0;
+    return -1;
+  }
+  superblock->group_table_start = start;
+  sfs_bitmap_set_range(fs->bitmap, start, start + table_blocks);
+  for (uint64_t i = start; i < start + table_blocks; ++i) {
+    bitmap_mark_dirty(fs, i);
+  }
+  count_group_blocks(fs);
+
+  // moving each free inode onto the list of its group reads the whole list
+  // once, here, rather than on every allocation
+  uint64_t moved = 0;
+  uint64_t inumber = superblock->free_inode_head;
+  while (inumber != 0 && inumber <= superblock->inodes) {
+    if (moved++ == superblock->inodes) {
+      log_msg("free inode list has a loop");
+      return -1;
+    }
+    struct sfs_fs_inode inode;
+    if (sfs_fs_read_inode(fs, inumber, &inode)) {
+      return -1;
+    }
+    // hide next pointer in `size` member
+    uint64_t next = inode.size;
+    struct sfs_fs_group* group = &fs->groups[inode_group(fs, inumber)];
+    inode.inumber = inumber;
+    inode.size = group->free_inode_head;
+    if (sfs_fs_write_inode(fs, &inode)) {
+      return -1;
+    }
+    group->free_inode_head = inumber;
+    ++group->free_inodes;
+    inumber = next;
+  }
+  superblock->free_inode_head = 0;
+  fs->superblock_dirty = true;
+  for (uint64_t i = 0; i < table_blocks; ++i) {
+    fs->groups_dirty[i] = true;
+  }
+  log_msg("split disk into %" PRIu64 " allocation groups (%" PRIu64
+          " free inodes) with descriptors at block %" PRIu64,
+          superblock->groups, moved, start);
+
+  if (write_groups(fs) || write_bitmap(fs)) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * gives a disk with a free inode list in each group an inode bitmap instead.
+ * every inode not on a list is in use. the bitmap goes in the first run of
+ * free blocks long enough to hold it.
+ */
+static int migrate_inode_lists(struct filesystem* fs) {
+  struct sfs_fs_superblock* superblock = &fs->superblock;
+  uint64_t bits = bits_per_bitmap_block(fs);
+  uint64_t nblocks = (superblock->inodes + bits - 1) / bits;
+  superblock->inode_bitmap_blocks = nblocks;
+  if (inode_bitmap_alloc(fs)) {
+    superblock->inode_bitmap_blocks = 0;
+    return -1;
+  }
+
+  uint64_t freed = 0;
+  for (uint64_t g = 0; g < superblock->groups; ++g) {
+    uint64_t inumber = fs->groups[g].free_inode_head;
+    while (inumber != 0) {
+      // an inode that is already clear means the list loops
+      if (inode_group(fs, inumber) != g || inumber > superblock->inodes ||
+          !sfs_bitmap_test(fs->inode_bitmap, inumber - 1)) {
+        log_msg("bad free inode list in group %" PRIu64, g);
+        return -1;
+      }
+      struct sfs_fs_inode inode;
+      if (sfs_fs_read_inode(fs, inumber, &inode)) {
+        return -1;
+      }
+      sfs_bitmap_clear(fs->inode_bitmap, inumber - 1);
+      ++freed;
+      // hide next pointer in `size` member
+      inumber = inode.size;
+    }
+    fs->groups[g].free_inode_head = 0;
+  }
+  count_group_inodes(fs);
+
+  uint64_t start =
+      sfs_bitmap_find_zero_run(fs->bitmap, 0, superblock->blocks, nblocks);
+  if (start == superblock->blocks) {
+    fprintf(stderr, "no room on the disk for an inode bitmap\n");
+    log_msg("no run of %" PRIu64 " free blocks for the inode bitmap",
+            nblocks);
+    return -1;
+  }
+  superblock->inode_bitmap_start = start;
+  sfs_bitmap_set_range(fs->bitmap, start, start + nblocks);
+  bitmap_mark_range_dirty(fs, start, start + nblocks);
+  groups_take_blocks(fs, start, start + nblocks);
+  for (uint64_t i = 0; i < nblocks; ++i) {
+    fs->inode_bitmap_dirty[i] = true;
+  }
+  for (uint64_t i = 0; i < group_table_blocks(fs); ++i) {
+    fs->groups_dirty[i] = true;
+  }
+  fs->superblock_dirty = true;
+  log_msg("converted free inode lists (%" PRIu64
+          " free inodes) to a bitmap at block %" PRIu64,
+          freed, start);
+
+  if (write_inode_bitmap(fs) || write_groups(fs) || write_bitmap(fs)) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * formats the disk of |fs| as an sfs filesystem with the block size in
+ * |fs->geometry|. writes initial data through the cache and fills in
+ * |fs->superblock|
+ */
+static int format_fs(struct filesystem* fs, bool lazy_init) {
+  assert(fs != NULL);
+  assert(fs->disk >= 0);
+
+  int disk = fs->disk;
+  struct sfs_fs_superblock* superblock = &fs->superblock;
+
+  log_msg("formatting filesystem");
+  // fields not set below are 0
+  memset(superblock, 0, sizeof(struct sfs_fs_superblock));
+
+  // get the size of the disk
+  struct stat st;
+  if (fstat(disk, &st) < 0) {
+    perror("fstat() error");
+    log_msg("format_fs() fstat failure");
+    return -1;
+  }
+  off_t disk_size = st.st_size;
+  uint64_t blocks = disk_size / fs->geometry.block_size;
+  if (blocks < 3) {
+    fprintf(stderr, "disk file too small to use as filesystem\n");
+    log_msg("disk had only %" PRIu64 " blocks", blocks);
+    return -1;
+  }
+
+  log_msg("partitioning %zd bytes into %" PRIu64 " blocks", disk_size, blocks);
+
+  memcpy(&superblock->signature, SFS_FILE_TYPE_SIGNATURE,
+         sizeof(SFS_FILE_TYPE_SIGNATURE));
+  superblock->create_time = time(NULL);
+  superblock->block_size = fs->geometry.block_size;
+  superblock->inode_format = fs->inode_size == SFS_V1_INODE_SIZE
+                                 ? SFS_INODE_FORMAT_V1
+                                 : SFS_INODE_FORMAT_V2;
+  // use 6.25% of space for inodes or 1 block, whatever
+  superblock->inode_table_blocks = (blocks - 1) / 16;
+  if (superblock->inode_table_blocks == 0) {
+    superblock->inode_table_blocks = 1;
+  }
+  uint64_t inodes_per_block = fs->inodes_per_block;
+  superblock->inodes = superblock->inode_table_blocks * inodes_per_block;
+  superblock->blocks = blocks;
+  uint64_t bits = bits_per_bitmap_block(fs);
+  uint64_t bitmap_blocks = (blocks + bits - 1) / bits;
+  superblock->free_blocks_head = 0;
+  superblock->free_inode_head = 0;
+  superblock->bitmap_start = 1 + superblock->inode_table_blocks;
+  superblock->bitmap_blocks = bitmap_blocks;
+
+  // each group's part of the bitmap is one block. the descriptor table is
+  // sized for the groups there would be without it, which is never fewer.
+  uint64_t group_blocks = bits;
+  superblock->group_blocks = group_blocks;
+  superblock->group_table_start = superblock->bitmap_start + bitmap_blocks;
+  uint64_t first_data_block = superblock->group_table_start;
+  if (first_data_block < blocks) {
+    superblock->groups =
+        (blocks - first_data_block + group_blocks - 1) / group_blocks;
+    first_data_block += group_table_blocks(fs);
+  }
+  superblock->inode_bitmap_start = first_data_block;
+  superblock->inode_bitmap_blocks = (superblock->inodes + bits - 1) / bits;
+  first_data_block += superblock->inode_bitmap_blocks;
+  if (first_data_block >= blocks) {
+    fprintf(stderr, "disk file too small to use as filesystem\n");
+    log_msg("no room for data after %" PRIu64 " metadata blocks",
+            first_data_block);
+    return -1;
+  }
+  superblock->groups_first_block = first_data_block;
+  uint64_t groups =
+      (blocks - first_data_block + group_blocks - 1) / group_blocks;
+  superblock->group_inodes = (superblock->inodes + groups - 1) / groups;
+
+  log_msg("%" PRIu64 " blocks for inodes (%" PRIu64 " inodes)",
+          superblock->inode_table_blocks, superblock->inodes);
+
+  // a lazy format only writes the root directory's block; the rest of the
+  // table is left to the groups to initialize as their inodes are used
+  uint64_t itable_end = superblock->inode_table_blocks + 1;
+  if (lazy_init) {
+    log_msg("leaving inode table blocks to be initialized on first use");
+    itable_end = 2;
+  } else {
+    log_msg("zeroing inode table blocks");
+  }
+  char* tmp_block = malloc(fs->geometry.block_size);
+  if (tmp_block == NULL) {
+    log_msg("malloc failure");
+    return -1;
+  }
+  for (uint64_t i = 1; i < itable_end; ++i) {
+    init_inode_block(fs, i, tmp_block);
+    if (i == 1) {
+      // initialize root inode
+      // is a directory, with rwx on ugo
+      struct sfs_fs_inode root;
+      memset(&root, 0, sizeof(root));
+      root.inumber = 1;
+      root.mode = S_IFDIR | S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+      // set uid and gid to the current user (for convenience)
+      root.uid = getuid();
+      root.gid = getgid();
+      // always have 1 link on root (convention it seems)
+      root.links = 1;
+      root.access_time = root.change_time = root.modified_time = time(NULL);
+      root.size = 0;
+      encode_inode(fs, &root, tmp_block);
+    }
+
+    if (sfs_cache_write(fs->cache, i, tmp_block)) {
+      fprintf(stderr, "error initializing inodes\n");
+      log_msg("error initializing inode block %" PRIu64, i);
+      free(tmp_block);
+      return -1;
+    }
+  }
+  free(tmp_block);
+
+  // everything up to the first data block is in use, and so are the bits
+  // past the end of the disk in the last bitmap block
+  log_msg("writing block bitmap");
+  if (bitmap_alloc(fs)) {
+    return -1;
+  }
+  sfs_bitmap_set_range(fs->bitmap, 0, first_data_block);
+  sfs_bitmap_set_range(fs->bitmap, blocks, bitmap_blocks * bits);
+  for (uint64_t i = 0; i < bitmap_blocks; ++i) {
+    fs->bitmap_dirty[i] = true;
+  }
+  fs->alloc_next = first_data_block;
+  if (write_bitmap(fs)) {
+    fprintf(stderr, "error initializing block bitmap\n");
+    return -1;
+  }
+
+  // only the root directory is in use
+  log_msg("writing inode bitmap");
+  if (inode_bitmap_alloc(fs)) {
+    return -1;
+  }
+  sfs_bitmap_clear_range(fs->inode_bitmap, 1, superblock->inodes);
+  for (uint64_t i = 0; i < superblock->inode_bitmap_blocks; ++i) {
+    fs->inode_bitmap_dirty[i] = true;
+  }
+  if (write_inode_bitmap(fs)) {
+    fprintf(stderr, "error initializing inode bitmap\n");
+    return -1;
+  }
+
+  log_msg("writing %" PRIu64 " group descriptors", groups);
+  // the table was sized for at least as many groups
+  superblock->groups = groups;
+  if (groups_alloc(fs)) {
+    return -1;
+  }
+  for (uint64_t g = 0; g < groups; ++g) {
+    fs->groups[g].free_blocks = group_end(fs, g) - group_start(fs, g);
+    if (lazy_init) {
+      fs->groups[g].itable_unused =
+          group_itable_end(fs, g) - group_itable_start(fs, g);
+    }
+  }
+  if (lazy_init) {
+    --fs->groups[0].itable_unused;  // the root directory's block
+  }
+  count_group_inodes(fs);
+  for (uint64_t i = 0; i < group_table_blocks(fs); ++i) {
+    fs->groups_dirty[i] = true;
+  }
+  if (write_groups(fs)) {
+    fprintf(stderr, "error initializing group descriptors\n");
+    return -1;
+  }
+
+  // written when the filesystem is marked mounted
+  fs->superblock_dirty = true;
+  return 0;
+}
+
+/**
+ * writes the metadata |fs| keeps outside the cache (the inode blocks, bitmaps,
+ * group descriptors and superblock) to the cache if it has changed
+ */
+static int checkpoint(struct filesystem* fs) {
+  if (sfs_icache_flush(fs->icache, write_inode_block, fs)) {
+    log_msg("inode block write-back failed");
+    return -1;
+  }
+  if (write_bitmap(fs) || write_inode_bitmap(fs) || write_groups(fs)) {
+    return -1;
+  }
+  if (fs->superblock_dirty && write_superblock(fs)) {
+    return -1;
+  }
+  return 0;
+}
+
+static bool valid_block_size(uint64_t block_size) {
+  return block_size >= SFS_MIN_BLOCK_SIZE && block_size <= SFS_MAX_BLOCK_SIZE &&
+         (block_size & (block_size - 1)) == 0;
+}
+
+void* sfs_fs_open_disk(int disk, bool maybe_format,
+                       const struct sfs_fs_options* options) {
+  assert(disk >= 0);
+  assert(options != NULL);
+
+  // the superblock fits in the smallest block, so it can be read before the
+  // block size is known
+  struct sfs_fs_superblock superblock;
+  if (pread(disk, &superblock, sizeof(superblock), 0) != sizeof(superblock)) {
+    memset(&superblock, 0, sizeof(superblock));
+  }
+
+  // check the singature on the superblock
+  // if it matches, we can probably assume the filesystem is valid
+  // if it doesn't match and |maybe_format| is set, create a new filesystem
+  int signature_cmp = memcmp(superblock.signature, SFS_FILE_TYPE_SIGNATURE,
+                             sizeof(SFS_FILE_TYPE_SIGNATURE));
+  uint64_t block_size = superblock.block_size;
+  uint64_t inode_format = superblock.inode_format;
+  if (signature_cmp != 0) {
+    if (!maybe_format) {
+      log_msg(
+          "sfs_fs_open_disk() disk was unformatted and maybe_format is "
+          "false");
+    }
+    block_size =
+        options->block_size ? options->block_size : DEFAULT_BLOCK_SIZE;
+    inode_format = options->inode_format;
+  }
+  if (!valid_block_size(block_size)) {
+    fprintf(stderr, "block size must be a power of 2 from %d to %d\n",
+            SFS_MIN_BLOCK_SIZE, SFS_MAX_BLOCK_SIZE);
+    log_msg("bad block size %" PRIu64, block_size);
+    return NULL;
+  }
+  if (inode_format == 0) {
+    inode_format = SFS_INODE_FORMAT_V1;
+  }
+  if (inode_format != SFS_INODE_FORMAT_V1 &&
+      inode_format != SFS_INODE_FORMAT_V2) {
+    fprintf(stderr, "inode format must be %d or %d\n", SFS_INODE_FORMAT_V1,
+            SFS_INODE_FORMAT_V2);
+    log_msg("bad inode format %" PRIu64, inode_format);
+    return NULL;
+  }
+
+  // allocate in memory filesystem representation
+  struct filesystem* fs = malloc(sizeof(struct filesystem));
+  if (fs == NULL) {
+    perror("malloc() failure");
+    log_msg("malloc failure");
+    return NULL;
+  }
+  // mark unsetup field values
+  fs->disk = disk;
+  sfs_geometry_init(&fs->geometry, block_size);
+  set_inode_format(fs, inode_format);
+  fs->bitmap = NULL;
+  fs->bitmap_dirty = NULL;
+  fs->groups = NULL;
+  fs->groups_dirty = NULL;
+  fs->inode_bitmap = NULL;
+  fs->inode_bitmap_dirty = NULL;
+  fs->superblock_dirty = false;
+  // without a triple indirect block, block pointers can't map files of more
+  // than a few GiB, so new files get extents whatever the options say
+  fs->extents = options->extents || fs->index_depth < 3;
+  fs->inline_data = options->inline_data;
+  fs->atime = options->atime;
+  fs->icache =
+      sfs_icache_init(block_size, (INODE_CACHE_KB << 10) / block_size);
+  if (fs->icache == NULL) {
+    log_msg("couldn't create inode cache");
+    free(fs);
+    return NULL;
+  }
+
+  uint64_t cache_mb = options->cache_mb ? options->cache_mb : DEFAULT_CACHE_MB;
+  fs->dev = block_open(disk, options->block_backend, block_size);
+  if (fs->dev == NULL) {
+    log_msg("couldn't open block device");
+    sfs_icache_deinit(fs->icache);
+    free(fs);
+    return NULL;
+  }
+  fs->cache = sfs_cache_init(fs->dev, cache_mb << 20);
+  if (fs->cache == NULL) {
+    log_msg("couldn't create buffer cache");
+    block_close(fs->dev);
+    sfs_icache_deinit(fs->icache);
+    free(fs);
+    return NULL;
+  }
+  fs->delalloc = sfs_delalloc_init(block_size);
+  fs->reserved = 0;
+  if (fs->delalloc == NULL) {
+    log_msg("couldn't create delayed allocation set");
+    sfs_cache_deinit(fs->cache);
+    block_close(fs->dev);
+    sfs_icache_deinit(fs->icache);
+    free(fs);
+    return NULL;
+  }
+  fs->prealloc = sfs_prealloc_init();
+  fs->preallocated = 0;
+  if (fs->prealloc == NULL) {
+    log_msg("couldn't create preallocation windows");
+    sfs_delalloc_deinit(fs->delalloc);
+    sfs_cache_deinit(fs->cache);
+    block_close(fs->dev);
+    sfs_icache_deinit(fs->icache);
+    free(fs);
+    return NULL;
+  }
+  fs->reclaim = sfs_reclaim_init();
+  if (fs->reclaim == NULL) {
+    log_msg("couldn't create reclaim queue");
+    sfs_prealloc_deinit(fs->prealloc);
+    sfs_delalloc_deinit(fs->delalloc);
+    sfs_cache_deinit(fs->cache);
+    block_close(fs->dev);
+    sfs_icache_deinit(fs->icache);
+    free(fs);
+    return NULL;
+  }
+  if (pthread_cond_init(&fs->writeback_done, NULL)) {
+    log_msg("pthread_cond_init failure");
+    sfs_reclaim_deinit(fs->reclaim);
+    sfs_prealloc_deinit(fs->prealloc);
+    sfs_delalloc_deinit(fs->delalloc);
+    sfs_cache_deinit(fs->cache);
+    block_close(fs->dev);
+    sfs_icache_deinit(fs->icache);
+    free(fs);
+    return NULL;
+  }
+
+  int ret;
+  if (signature_cmp != 0) {
+    ret = format_fs(fs, options->lazy_init);
+  } else {
+    fs->superblock = superblock;
+    ret = superblock.bitmap_blocks == 0 ? migrate_free_list(fs)
+                                        : load_bitmap(fs);
+    if (ret == 0) {
+      ret = superblock.groups == 0 ? migrate_to_groups(fs) : load_groups(fs);
+    }
+    if (ret == 0) {
+      ret = superblock.inode_bitmap_blocks == 0 ? migrate_inode_lists(fs)
+                                                : load_inode_bitmap(fs);
+    }
+    if (ret == 0 && superblock.groups != 0 &&
+        superblock.state != SFS_STATE_CLEAN) {
+      ret = recount_groups(fs);
+    }
+  }
+  if (ret == 0) {
+    sum_groups(fs);
+    // until it is unmounted cleanly, the disk has to say otherwise
+    fs->superblock.state = 0;
+    ret = write_superblock(fs);
+    if (ret == 0) {
+      ret = sfs_cache_flush(fs->cache);
+    }
+  }
+  if (ret != 0) {
+    pthread_cond_destroy(&fs->writeback_done);
+    sfs_reclaim_deinit(fs->reclaim);
+    sfs_prealloc_deinit(fs->prealloc);
+    sfs_delalloc_deinit(fs->delalloc);
+    sfs_cache_deinit(fs->cache);
+    block_close(fs->dev);
+    free(fs->bitmap);
+    free(fs->bitmap_dirty);
+    free(fs->groups);
+    free(fs->groups_dirty);
+    free(fs->inode_bitmap);
+    free(fs->inode_bitmap_dirty);
+    sfs_icache_deinit(fs->icache);
+    free(fs);
+    return NULL;
+  }
+
+  time_t create_time = (time_t)fs->superblock.create_time;
+  // asctime() has '\n' at the end
+  char* t = asctime(localtime(&create_time));
+  t[strlen(t) - 1] = '\0';
+  log_msg("sfs_fs_open_disk() opened fs created at %s with %" PRIu32
+          "B blocks",
+          t, fs->geometry.block_size);
+
+  return fs;
+}
+
+int sfs_fs_close(void* arg) {
+  struct filesystem* fs = (struct filesystem*)arg;
+  assert(fs != NULL);
+  assert(fs->disk >= 0);
+
+  // the disk is only marked clean once everything else is on it, synced so
+  // the clean flag can't reach the disk first. files still open lose their
+  // windows, so the groups count those blocks as free
+  int ret = reclaim(fs);
+  if (allocate_pending(fs, 0)) {
+    ret = -1;
+  }
+  sfs_prealloc_foreach(fs->prealloc, give_back_window, fs);
+  if (ret || checkpoint(fs) || sfs_cache_flush(fs->cache)) {
+    log_msg("failed to flush filesystem");
+    ret = -1;
+  } else {
+    fs->superblock.state = SFS_STATE_CLEAN;
+    if (write_superblock(fs) || sfs_cache_flush(fs->cache)) {
+      log_msg("failed to write superblock");
+      ret = -1;
+    }
+  }
+
+  if (sfs_cache_deinit(fs->cache)) {
+    log_msg("failed to flush buffer cache");
+    ret = -1;
+  }
+
+  pthread_cond_destroy(&fs->writeback_done);
+  sfs_reclaim_deinit(fs->reclaim);
+  sfs_prealloc_deinit(fs->prealloc);
+  sfs_delalloc_deinit(fs->delalloc);
+  block_close(fs->dev);
+  free(fs->bitmap);
+  free(fs->bitmap_dirty);
+  free(fs->groups);
+  free(fs->groups_dirty);
+  free(fs->inode_bitmap);
+  free(fs->inode_bitmap_dirty);
+  sfs_icache_deinit(fs->icache);
+  free(fs);
+  return ret;
+}
+
+const struct sfs_geometry* sfs_fs_geometry(void* arg) {
+  struct filesystem* fs = (struct filesystem*)arg;
+  assert(fs != NULL);
+  return &fs->geometry;
+}
+
+int sfs_fs_inode_allocate(void* arg, uint64_t parent,
+                          struct sfs_fs_inode* inode) {
+  struct filesystem* fs = (struct filesystem*)arg;
+  assert(fs != NULL);
+  assert(fs->disk >= 0);
+  assert(parent > 0);
+  assert(inode != NULL);
+
+  if (fs->superblock.free_inodes == 0 && reclaim(fs)) {
+    return -1;
+  }
+
+  // the first free inode after the parent in its group (wrapping around), or
+  // the first one in the first group after it with inodes left. files made in
+  // a directory one after another share inode blocks with it and each other
+  uint64_t groups = fs->superblock.groups;
+  uint64_t inodes = fs->superblock.inodes;
+  uint64_t g = inode_group(fs, parent);
+  uint64_t bit = inodes;
+  for (uint64_t i = 0; i < groups && bit == inodes; ++i) {
+    if (fs->groups[g].free_inodes > 0) {
+      uint64_t start = group_inode_start(fs, g);
+      uint64_t end = group_inode_end(fs, g);
+      uint64_t from = i == 0 ? parent - 1 : start;
+      uint64_t found = sfs_bitmap_find_zero(fs->inode_bitmap, from, end);
+      if (found == end) {
+        found = sfs_bitmap_find_zero(fs->inode_bitmap, start, from);
+      }
+      if (found < end && !sfs_bitmap_test(fs->inode_bitmap, found)) {
+        bit = found;
+        break;
+      }
+    }
+    g = (g + 1) % groups;
+  }
+  if (bit == inodes) {
+    log_msg("out of free inodes");
+    return -1;
+  }
+
+  sfs_bitmap_set(fs->inode_bitmap, bit);
+  inode_bitmap_mark_dirty(fs, bit + 1);
+  --fs->groups[g].free_inodes;
+  group_mark_dirty(fs, g);
+  --fs->superblock.free_inodes;
+  fs->superblock_dirty = true;
+
+  // what is on disk is left over from a deleted file; the caller fills it in
+  memset(inode, 0, sizeof(struct sfs_fs_inode));
+  inode->inumber = bit + 1;
+  if (fs->extents) {
+    inode->flags = SFS_INODE_EXTENTS;  // an empty tree is all zeros
+  }
+  return 0;
+}
+
+int sfs_fs_inode_deallocate(void* arg, struct sfs_fs_inode* inode) {
+  struct filesystem* fs = (struct filesystem*)arg;
+  assert(fs != NULL);
+  assert(fs->disk >= 0);
+  assert(inode != NULL);
+
+  if (sfs_fs_write_inode(fs, inode)) {
+    log_msg("could not write deallocated inode");
+    return -1;
+  }
+  // data that never got disk blocks never needs them
+  fs->reserved -= pending_reservation(fs, inode);
+  sfs_delalloc_remove(fs->delalloc, inode->inumber, 0, UINT64_MAX);
+
+  // the inode stays in use until writeback frees its blocks. if the disk
+  // crashes first, having no links gets it queued again at mount
+  if (sfs_reclaim_put(fs->reclaim, inode->inumber)) {
+    log_msg("could not queue inode %" PRIu64 " for reclaim", inode->inumber);
+    return -1;
+  }
+
+  return 0;
+}
+
+int sfs_fs_inode_open(void* arg, uint64_t inumber) {
+  struct filesystem* fs = (struct filesystem*)arg;
+  assert(fs != NULL);
+  assert(fs->disk >= 0);
+
+  // the inode stays cached while the file is open
+  uint64_t block_number = inode_block_number(fs, inumber);
+  if (inode_block(fs, block_number) == NULL ||
+      sfs_prealloc_open(fs->prealloc, inumber)) {
+    return -1;
+  }
+  sfs_icache_hold(fs->icache, block_number);
+  return 0;
+}
+
+void sfs_fs_inode_release(void* arg, uint64_t inumber) {
+  struct filesystem* fs = (struct filesystem*)arg;
+  assert(fs != NULL);
+  assert(fs->disk >= 0);
+
+  sfs_icache_put(fs->icache, inode_block_number(fs, inumber));
+  struct sfs_prealloc_window window;
+  if (sfs_prealloc_release(fs->prealloc, inumber, &window)) {
+    give_back_window(&window, fs);
+  }
+}
+
+int sfs_fs_read_inode(void* arg, uint64_t inumber, struct sfs_fs_inode* inode) {
+  struct filesystem* fs = (struct filesystem*)arg;
+  assert(fs != NULL);
+  assert(fs->disk >= 0);
+  assert(inumber > 0);  // 0 represents a NULL inode
+  assert(inode != NULL);
+
+  char* data = inode_block(fs, inode_block_number(fs, inumber));
+  if (data == NULL) {
+    return -1;
+  }
+  uint64_t position_in_block = (inumber - 1) % fs->inodes_per_block;
+  decode_inode(fs, inumber, data + position_in_block * fs->inode_size, inode);
+  return 0;
+}
+
+int sfs_fs_write_inode(void* arg, const struct sfs_fs_inode* inode) {
+  struct filesystem* fs = (struct filesystem*)arg;
+  assert(fs != NULL);
+  assert(fs->disk >= 0);
+  assert(inode != NULL);
+  assert(inode->inumber > 0);  // 0 represents a NULL inode
+
+  uint64_t block_number = inode_block_number(fs, inode->inumber);
+  char* data = inode_block(fs, block_number);
+  if (data == NULL || use_inode_block(fs, block_number)) {
+    return -1;
+  }
+  uint64_t position_in_block = (inode->inumber - 1) % fs->inodes_per_block;
+  if (encode_inode(fs, inode, data + position_in_block * fs->inode_size)) {
+    return -1;
+  }
+  sfs_icache_mark_dirty(fs->icache, block_number);
+  return 0;
+}
+
+void sfs_fs_inode_to_stat(void* arg, const struct sfs_fs_inode* inode,
+                          struct stat* st) {
+  struct filesystem* fs = (struct filesystem*)arg;
+  assert(fs != NULL);
+  assert(inode != NULL);
+  assert(st != NULL);
+
+  st->st_ino = inode->inumber;
+  st->st_mode = inode->mode;
+  st->st_nlink = inode->links;
+  st->st_uid = inode->uid;
+  st->st_gid = inode->gid;
+  st->st_atime = inode->access_time;
+  st->st_mtime = inode->modified_time;
+  st->st_ctime = inode->change_time;
+  st->st_size = inode->size;
+}
+
+bool sfs_fs_inode_touch(void* arg, struct sfs_fs_inode* inode) {
+  struct filesystem* fs = (struct filesystem*)arg;
+  assert(fs != NULL);
+  assert(inode != NULL);
+
+  uint64_t now = time(NULL);
+  if (fs->atime == SFS_ATIME_NOATIME || inode->access_time == now) {
+    return false;
+  }
+  if (fs->atime == SFS_ATIME_RELATIME &&
+      inode->access_time > inode->modified_time &&
+      inode->access_time > inode->change_time &&
+      now - inode->access_time < RELATIME_INTERVAL_S) {
+    return false;
+  }
+  inode->access_time = now;
+  return true;
+}
+
+void sfs_fs_statvfs(void* arg, struct statvfs* statbuf) {
+  struct filesystem* fs = (struct filesystem*)arg;
+  assert(fs != NULL);
+  assert(statbuf != NULL);
+
+  // windows are free space lent out; reservations are space spoken for
+  uint64_t free = fs->superblock.free_blocks + fs->preallocated;
+  free = free > fs->reserved ? free - fs->reserved : 0;
+
+  memset(statbuf, 0, sizeof(struct statvfs));
+  statbuf->f_bsize = fs->geometry.block_size;
+  statbuf->f_frsize = fs->geometry.block_size;
+  statbuf->f_blocks = fs->superblock.blocks;
+  statbuf->f_bfree = free;
+  statbuf->f_bavail = free;
+  statbuf->f_files = fs->superblock.inodes;
+  statbuf->f_ffree = fs->superblock.free_inodes;
+  statbuf->f_favail = fs->superblock.free_inodes;
+  statbuf->f_namemax = 255;
+}
+
+/**
+ * returns where to put the first block of |inode|'s data that doesn't follow
+ * another of its blocks: the start of the inode's group
+ */
+static uint64_t inode_goal(const struct filesystem* fs,
+                           const struct sfs_fs_inode* inode) {
+  return group_start(fs, inode_group(fs, inode->inumber));
+}
+
+/**
+ * allocates up to |count| contiguous blocks for inode |inumber|, like
+ * sfs_fs_allocate_blocks(). if the inode is open and |goal| is the start of
+ * its window, they come from the window; if the window is empty or elsewhere,
+ * a new one is set aside after them as free space allows.
+ *
+ * returns 0 if OK, otherwise -1
+ */
+static int allocate_for(struct filesystem* fs, uint64_t inumber, uint64_t goal,
+                        uint64_t count, uint64_t* first, uint64_t* allocated) {
+  struct sfs_prealloc_window* window = sfs_prealloc_get(fs->prealloc, inumber);
+  if (window == NULL) {
+    return sfs_fs_allocate_blocks(fs, goal, count, first, allocated);
+  }
+
+  if (window->count == 0 || window->start != goal) {
+    // a write somewhere else in the file gets a new window where it lands,
+    // taking no more than the free blocks not already spoken for
+    give_back_window(window, fs);
+    uint64_t size = window->size ? window->size : PREALLOC_MIN_BLOCKS;
+    uint64_t max = (PREALLOC_MAX_KB << 10) / fs->geometry.block_size;
+    window->size = size * 2 < max ? size * 2 : max;
+    uint64_t free = fs->superblock.free_blocks;
+    uint64_t spare =
+        free > fs->reserved + count ? free - fs->reserved - count : 0;
+    size = size < spare ? size : spare;
+
+    uint64_t got;
+    if (sfs_fs_allocate_blocks(fs, goal, count + size, &window->start, &got)) {
+      return -1;
+    }
+    window->count = got;
+    fs->preallocated += got;
+  }
+
+  // the bitmap on disk has had the window's blocks as free until now
+  *first = window->start;
+  *allocated = count < window->count ? count : window->count;
+  bitmap_mark_range_dirty(fs, *first, *first + *allocated);
+  window->start += *allocated;
+  window->count -= *allocated;
+  fs->preallocated -= *allocated;
+  return 0;
+}
+
+/**
+ * fills the holes (zeros) among the |count| block numbers in |pointers| of
+ * inode |inumber| with newly allocated blocks. each run of holes is allocated
+ * as one extent if free space allows, right after the block before it (at
+ * |goal| for the first slot) if possible. |*filled| is set if any hole was
+ * filled.
+ *
+ * returns 0 if OK, otherwise -1
+ */
+static int fill_holes(struct filesystem* fs, uint64_t inumber,
+                      uint64_t* pointers, uint64_t count, uint64_t goal,
+                      bool* filled) {
+  for (uint64_t i = 0; i < count;) {
+    if (pointers[i] != 0) {
+      goal = pointers[i++] + 1;
+      continue;
+    }
+    uint64_t holes = 1;
+    while (i + holes < count && pointers[i + holes] == 0) {
+      ++holes;
+    }
+
+    uint64_t first, allocated;
+    if (allocate_for(fs, inumber, goal, holes, &first, &allocated)) {
+      return -1;
+    }
+    for (uint64_t j = 0; j < allocated; ++j) {
+      pointers[i + j] = first + j;
+    }
+    i += allocated;
+    goal = first + allocated;
+    *filled = true;
+  }
+  return 0;
+}
+
+/**
+ * reads the block numbers of the |count| logical blocks from |index| under the
+ * index block |*index_block_number| of inode |inumber|, which is |depth|
+ * levels above the data, and writes them to |block_numbers|. the entries of
+ * an index at depth 1 are data blocks; deeper, they are the index blocks one
+ * level down.
+ *
+ * if |create_if_empty| is specified, holes in the index (and the indexes
+ * themselves where they are missing, this one if |*index_block_number| is 0)
+ * are filled with newly allocated blocks, placed from |goal| (just after the
+ * block before |index| in the file) when possible. each index block under the
+ * range is read and written at most once.
+ */
+static int read_from_index(struct filesystem* fs, uint64_t inumber,
+                           uint64_t* index_block_number, int depth,
+                           uint64_t index, uint64_t count,
+                           bool create_if_empty, uint64_t goal,
+                           uint64_t* block_numbers) {
+  assert(fs != NULL);
+  assert(index_block_number != NULL);
+  assert(depth > 0);
+  assert(block_numbers != NULL);
+  assert(index + count <= index_span(fs, depth));
+
+  if (*index_block_number == 0 && !create_if_empty) {
+    memset(block_numbers, 0, count * sizeof(uint64_t));
+    return 0;
+  }
+  // one per level of the recursion, so off the stack
+  uint64_t* arr = calloc(1, fs->geometry.block_size);
+  if (arr == NULL) {
+    log_msg("malloc failure");
+    return -1;
+  }
+  bool index_dirty = false;
+  int ret = 0;
+  if (*index_block_number == 0) {
+    // a recycled block holds garbage, so the new index is written zeroed. it
+    // goes where the data would have, and the data after it
+    uint64_t allocated;
+    if (allocate_for(fs, inumber, goal, 1, index_block_number, &allocated)) {
+      log_msg("error allocating indirect block index");
+      ret = -1;
+    }
+    goal = *index_block_number + 1;
+    index_dirty = true;
+  } else {
+    ret = sfs_cache_read(fs->cache, *index_block_number, arr);
+  }
+
+  if (ret == 0 && depth == 1) {
+    if (create_if_empty) {
+      if (index > 0 && arr[index - 1] != 0) {
+        goal = arr[index - 1] + 1;
+      }
+      ret = fill_holes(fs, inumber, arr + index, count, goal, &index_dirty);
+    }
+    memcpy(block_numbers, arr + index, count * sizeof(uint64_t));
+  } else if (ret == 0) {
+    uint64_t span = index_span(fs, depth - 1);
+    for (uint64_t i = 0; i < count && ret == 0;) {
+      uint64_t slot = (index + i) / span;
+      uint64_t offset = (index + i) % span;
+      uint64_t n = count - i < span - offset ? count - i : span - offset;
+      if (i > 0 && block_numbers[i - 1] != 0) {
+        goal = block_numbers[i - 1] + 1;
+      }
+      uint64_t child = arr[slot];
+      ret = read_from_index(fs, inumber, &arr[slot], depth - 1, offset, n,
+                            create_if_empty, goal, block_numbers + i);
+      index_dirty = index_dirty || arr[slot] != child;
+      i += n;
+    }
+  }
+
+  if (ret == 0 && index_dirty) {
+    ret = sfs_cache_write(fs->cache, *index_block_number, arr);
+  }
+
+  free(arr);
+  return ret;
+}
 
 /**
- * write-back cache of one block of inodes
+ * reads the extent tree node in block |block_number| into |header| and
+ * |entries|, which has room for a whole block from new_extent_node()
  */
-struct inode_cache {
-  bool dirty;
-  int block_number;
-  sfs_block_t data;
-};
+static int read_extent_node(struct filesystem* fs, uint64_t block_number,
+                            struct sfs_fs_extent_header* header,
+                            struct sfs_fs_extent* entries) {
+  if (block_number >= fs->superblock.blocks ||
+      sfs_cache_read(fs->cache, block_number, entries)) {
+    log_msg("error reading extent node %" PRIu64, block_number);
+    return -1;
+  }
+  memcpy(header, entries, sizeof(struct sfs_fs_extent_header));
+  if (header->entries > extents_per_node(fs)) {
+    log_msg("extent node %" PRIu64 " is corrupt", block_number);
+    return -1;
+  }
+  memmove(entries, (char*)entries + sizeof(struct sfs_fs_extent_header),
+          header->entries * sizeof(struct sfs_fs_extent));
+  return 0;
+}
 
-struct filesystem {
-  int disk;
-  struct sfs_fs_superblock superblock;
-  struct inode_cache inode_cache;
-};
+/**
+ * returns a new block-sized buffer for read_extent_node(), or NULL. the
+ * caller frees it.
+ */
+static struct sfs_fs_extent* new_extent_node(struct filesystem* fs) {
+  struct sfs_fs_extent* entries = malloc(fs->geometry.block_size);
+  if (entries == NULL) {
+    log_msg("malloc failure");
+  }
+  return entries;
+}
 
-static int write_superblock(int disk,
-                            const struct sfs_fs_superblock* superblock) {
-  log_msg("writing superblock");
-  sfs_block_t tmp_block = {0};
-  memcpy(tmp_block, superblock, sizeof(struct sfs_fs_superblock));
-  if (block_write(disk, 0, tmp_block) != BLOCK_SIZE) {
-    log_msg("error writing block");
+/**
+ * finds the disk block logical block |iblock| of extent-mapped |inode| is at,
+ * reading one path down its tree, and writes it to |block_number| (0 for a
+ * hole). how many logical blocks from |iblock| on continue the same way
+ * (contiguous on disk, or a hole) is written to |run|.
+ *
+ * returns 0 if OK, otherwise -1
+ */
+static int extent_map(struct filesystem* fs, const struct sfs_fs_inode* inode,
+                      uint64_t iblock, uint64_t* block_number, uint64_t* run) {
+  struct sfs_fs_extent_header header;
+  struct sfs_fs_extent* entries = new_extent_node(fs);
+  if (entries == NULL) {
     return -1;
   }
+  read_extent_root(inode, &header, entries);
+
+  // where the subtree after the one being descended into starts
+  uint64_t next = UINT64_MAX;
+  while (header.depth > 0) {
+    uint64_t i = sfs_extent_search(entries, header.entries, iblock);
+    i = i > 0 ? i - 1 : 0;
+    if (i + 1 < header.entries) {
+      next = entries[i + 1].iblock;
+    }
+    uint64_t depth = header.depth;
+    if (header.entries == 0 ||
+        read_extent_node(fs, entries[i].start, &header, entries)) {
+      free(entries);
+      return -1;
+    }
+    if (header.depth != depth - 1) {
+      log_msg("extent tree of inode %" PRIu64 " is corrupt", inode->inumber);
+      free(entries);
+      return -1;
+    }
+  }
+
+  uint64_t i = sfs_extent_search(entries, header.entries, iblock);
+  const struct sfs_fs_extent* e = i > 0 ? &entries[i - 1] : NULL;
+  if (e != NULL && iblock < (uint64_t)e->iblock + e->count) {
+    *block_number = e->start + (iblock - e->iblock);
+    *run = e->iblock + e->count - iblock;
+  } else {
+    if (i < header.entries) {
+      next = entries[i].iblock;
+    }
+    *block_number = 0;
+    *run = next - iblock;
+  }
+  free(entries);
   return 0;
 }
 
 /**
- * formats an open |disk| as an sfs filesystem. writes initial data to |disk|
- * and puts a copy of the superblock in |superblock|
+ * adds the extents in the subtree under the |header->entries| |entries| to
+ * |list| in order, and the blocks of its nodes to |nodes|, of which there are
+ * |*nnodes| out of room for |max_nodes|
  */
-static int format_fs(int disk, struct sfs_fs_superblock* superblock) {
-  assert(disk >= 0);
-  assert(superblock != NULL);
+static int load_extent_subtree(struct filesystem* fs,
+                               const struct sfs_fs_extent_header* header,
+                               const struct sfs_fs_extent* entries,
+                               struct sfs_extent_list* list, uint64_t* nodes,
+                               uint64_t* nnodes, uint64_t max_nodes) {
+  if (header->depth == 0) {
+    for (uint64_t i = 0; i < header->entries; ++i) {
+      if (sfs_extent_append(list, &entries[i])) {
+        return -1;
+      }
+    }
+    return 0;
+  }
 
-  log_msg("formatting filesystem");
+  struct sfs_fs_extent_header child_header;
+  struct sfs_fs_extent* child = new_extent_node(fs);
+  if (child == NULL) {
+    return -1;
+  }
+  int ret = 0;
+  for (uint64_t i = 0; i < header->entries && ret == 0; ++i) {
+    if (*nnodes == max_nodes) {
+      log_msg("extent tree has more nodes than extents need");
+      ret = -1;
+    } else {
+      nodes[(*nnodes)++] = entries[i].start;
+      ret = read_extent_node(fs, entries[i].start, &child_header, child);
+    }
+    if (ret == 0 && child_header.depth != header->depth - 1) {
+      log_msg("extent node %" PRIu64 " is at the wrong depth",
+              entries[i].start);
+      ret = -1;
+    }
+    if (ret == 0) {
+      ret = load_extent_subtree(fs, &child_header, child, list, nodes, nnodes,
+                                max_nodes);
+    }
+  }
+  free(child);
+  return ret;
+}
 
-  // get the size of the disk
-  struct stat st;
-  if (fstat(disk, &st) < 0) {
-    perror("fstat() error");
-    log_msg("format_fs() fstat failure");
+/**
+ * reads every extent of |inode| into |list|, and sets |*nodes| to a new array
+ * of the |*nnodes| blocks its tree takes outside the inode. the caller frees
+ * both.
+ *
+ * returns 0 if OK, otherwise -1
+ */
+static int load_extents(struct filesystem* fs,
+                        const struct sfs_fs_inode* inode,
+                        struct sfs_extent_list* list, uint64_t** nodes,
+                        uint64_t* nnodes) {
+  struct sfs_fs_extent_header header;
+  struct sfs_fs_extent entries[SFS_EXTENT_ROOT_ENTRIES];
+  read_extent_root(inode, &header, entries);
+
+  sfs_extent_list_init(list);
+  uint64_t max_nodes = sfs_extent_tree_blocks(
+      header.extents, extents_per_node(fs), fs->root_entries);
+  *nnodes = 0;
+  *nodes = malloc((max_nodes + 1) * sizeof(uint64_t));
+  if (*nodes == NULL) {
+    log_msg("malloc failure");
     return -1;
   }
-  off_t disk_size = st.st_size;
-  uint64_t blocks = disk_size / BLOCK_SIZE;
-  if (blocks < 3) {
-    fprintf(stderr, "disk file too small to use as filesystem\n");
-    log_msg("disk had only %" PRIu64 " blocks", blocks);
+  if (header.entries > fs->root_entries ||
+      load_extent_subtree(fs, &header, entries, list, *nodes, nnodes,
+                          max_nodes) ||
+      list->count != header.extents) {
+    log_msg("could not read the extents of inode %" PRIu64, inode->inumber);
+    sfs_extent_list_free(list);
+    free(*nodes);
+    *nodes = NULL;
     return -1;
   }
+  return 0;
+}
 
-  log_msg("partitioning %zd bytes into %" PRIu64 " blocks", disk_size, blocks);
+/**
+ * rebuilds the extent tree of |inode| from |list|, packing the extents into
+ * as few nodes as they fit in. the |nnodes| blocks of |nodes| that held the
+ * old tree are reused, and blocks are allocated or freed for the difference.
+ * only |inode| in memory is changed; the caller writes it.
+ *
+ * returns 0 if OK, otherwise -1
+ */
+static int store_extents(struct filesystem* fs, struct sfs_fs_inode* inode,
+                         const struct sfs_extent_list* list,
+                         const uint64_t* nodes, uint64_t nnodes) {
+  uint64_t per_node = extents_per_node(fs);
+  uint64_t needed =
+      sfs_extent_tree_blocks(list->count, per_node, fs->root_entries);
+  uint64_t* blocks = malloc((needed + 1) * sizeof(uint64_t));
+  struct sfs_fs_extent* level = malloc((list->count + 1) * sizeof(*level));
+  char* block = malloc(fs->geometry.block_size);
+  if (blocks == NULL || level == NULL || block == NULL) {
+    log_msg("malloc failure");
+    free(blocks);
+    free(level);
+    free(block);
+    return -1;
+  }
 
-  memcpy(&superblock->signature, SFS_FILE_TYPE_SIGNATURE,
-         sizeof(SFS_FILE_TYPE_SIGNATURE));
-  superblock->create_time = time(NULL);
-  superblock->block_size = BLOCK_SIZE;
-  // use 6.25% of space for inodes or 1 block, whatever
-  superblock->inode_table_blocks = (blocks - 1) / 16;
-  if (superblock->inode_table_blocks == 0) {
-    superblock->inode_table_blocks = 1;
+  uint64_t have = needed < nnodes ? needed : nnodes;
+  memcpy(blocks, nodes, have * sizeof(uint64_t));
+  uint64_t goal = nnodes > 0 ? nodes[0] : inode_goal(fs, inode);
+  while (have < needed) {
+    uint64_t first, allocated;
+    if (sfs_fs_allocate_blocks(fs, goal, needed - have, &first, &allocated)) {
+      log_msg("could not allocate extent nodes");
+      free(blocks);
+      free(level);
+      free(block);
+      return -1;
+    }
+    for (uint64_t i = 0; i < allocated; ++i) {
+      blocks[have++] = first + i;
+    }
+    goal = first + allocated;
   }
-  uint64_t inodes_per_block = BLOCK_SIZE / sizeof(struct sfs_fs_inode);
-  superblock->inodes = superblock->inode_table_blocks * inodes_per_block;
-  superblock->blocks = blocks;
-  superblock->free_blocks_head = 2 + superblock->inode_table_blocks;
-  superblock->free_inode_head = 2;
 
-  log_msg("%" PRIu64 " blocks for inodes (%" PRIu64 " inodes)",
-          superblock->inode_table_blocks, superblock->inodes);
+  // each level of nodes is filled in order, and indexed by the level above,
+  // until what is left fits in the inode
+  memcpy(level, list->extents, list->count * sizeof(*level));
+  struct sfs_fs_extent_header header = {.depth = 0};
+  uint64_t count = list->count;
+  uint64_t next_block = 0;
+  int ret = 0;
+  while (count > fs->root_entries && ret == 0) {
+    uint64_t nodes_here = (count + per_node - 1) / per_node;
+    for (uint64_t n = 0; n < nodes_here && ret == 0; ++n) {
+      uint64_t first = n * per_node;
+      header.entries = count - first < per_node ? count - first : per_node;
+      header.extents = 0;
+      memset(block, 0, fs->geometry.block_size);
+      memcpy(block, &header, sizeof(header));
+      memcpy(block + sizeof(header), &level[first],
+             header.entries * sizeof(*level));
+      uint64_t block_number = blocks[next_block + n];
+      ret = sfs_cache_write(fs->cache, block_number, block);
+      // the entry for the node overwrites an entry already copied into it
+      level[n].iblock = level[first].iblock;
+      level[n].count = 0;
+      level[n].start = block_number;
+    }
+    next_block += nodes_here;
+    count = nodes_here;
+    ++header.depth;
+  }
+  if (ret == 0) {
+    header.entries = count;
+    header.extents = list->count;
+    char* root = (char*)inode->block_pointers;
+    memset(root, 0, sizeof(inode->block_pointers));
+    memcpy(root, &header, sizeof(header));
+    memcpy(root + sizeof(header), level, count * sizeof(*level));
+  } else {
+    log_msg("error writing extent nodes");
+  }
+  // the old tree is no longer needed once the new one is written
+  for (uint64_t i = needed; i < nnodes && ret == 0; ++i) {
+    if (sfs_fs_free_block(fs, nodes[i])) {
+      log_msg("error freeing extent node %" PRIu64, nodes[i]);
+      ret = -1;
+    }
+  }
+
+  free(blocks);
+  free(level);
+  free(block);
+  return ret;
+}
 
-  log_msg("zeroing inode table blocks");
-  sfs_block_t tmp_block = {0};
-  uint64_t next_free = 3;  // follow the white rabbit on this rh
-  for (uint64_t i = 1; i < superblock->inode_table_blocks + 1; ++i) {
-    struct sfs_fs_inode* inode_arr = (struct sfs_fs_inode*)tmp_block;
-    for (uint64_t j = 0; j < inodes_per_block; ++j) {
-      if (i == 1 && j == 0) {
-        // initialize root inode
-        // is a directory, with rwx on ugo
-        inode_arr->inumber = 1;
-        inode_arr->mode =
-            S_IFDIR | S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
-        // set uid and gid to the current user (for convenience)
-        inode_arr->uid = getuid();
-        inode_arr->gid = getgid();
-        // always have 1 link on root (convention it seems)
-        inode_arr->links = 1;
-        inode_arr->access_time = inode_arr->change_time =
-            inode_arr->modified_time = time(NULL);
-        inode_arr->size = 0;
-      } else {
-        memset(inode_arr + j, 0, sizeof(struct sfs_fs_inode));
-        inode_arr[j].inumber = next_free - 1;
-        inode_arr[j].size = next_free++;
+/**
+ * like map_range(), for an extent-mapped |inode|. |*inode_dirty| is set if
+ * its tree changed.
+ */
+static int map_extents(struct filesystem* fs, struct sfs_fs_inode* inode,
+                       uint64_t iblock, uint64_t count, bool create,
+                       uint64_t* block_numbers, bool* inode_dirty) {
+  if (!create) {
+    for (uint64_t i = 0; i < count;) {
+      uint64_t block_number, run;
+      if (extent_map(fs, inode, iblock + i, &block_number, &run)) {
+        return -1;
+      }
+      run = run < count - i ? run : count - i;
+      for (uint64_t j = 0; j < run; ++j) {
+        block_numbers[i + j] = block_number != 0 ? block_number + j : 0;
       }
+      i += run;
     }
+    return 0;
+  }
 
-    if (block_write(disk, i, tmp_block) != BLOCK_SIZE) {
-      fprintf(stderr, "error initializing inodes\n");
-      log_msg("error initializing inode block %" PRIu64, i);
-      return -1;
+  // each run of holes gets as few extents as free space allows, right after
+  // the block before it if possible, and the tree is written once
+  struct sfs_extent_list list;
+  uint64_t* nodes;
+  uint64_t nnodes;
+  if (load_extents(fs, inode, &list, &nodes, &nnodes)) {
+    return -1;
+  }
+  int ret = 0;
+  bool changed = false;
+  for (uint64_t i = 0; i < count && ret == 0;) {
+    block_numbers[i] = sfs_extent_lookup(&list, iblock + i);
+    if (block_numbers[i] != 0) {
+      ++i;
+      continue;
+    }
+    uint64_t holes = 1;
+    while (i + holes < count &&
+           sfs_extent_lookup(&list, iblock + i + holes) == 0) {
+      ++holes;
     }
+    uint64_t prev =
+        iblock + i > 0 ? sfs_extent_lookup(&list, iblock + i - 1) : 0;
+    uint64_t goal = prev != 0 ? prev + 1 : inode_goal(fs, inode);
+    uint64_t first, allocated;
+    ret = allocate_for(fs, inode->inumber, goal, holes, &first, &allocated);
+    if (ret == 0) {
+      ret = sfs_extent_insert(&list, iblock + i, first, allocated);
+    }
+    for (uint64_t j = 0; j < allocated && ret == 0; ++j) {
+      block_numbers[i++] = first + j;
+    }
+    changed = true;
   }
+  if (ret == 0 && changed) {
+    ret = store_extents(fs, inode, &list, nodes, nnodes);
+    *inode_dirty = true;
+  }
+  sfs_extent_list_free(&list);
+  free(nodes);
+  return ret;
+}
 
-  // here's how this calculation goes:
-  // if there is space in a block for N block pointers, there is space for
-  // describing N-1 free blocks and myself (from some other index).
-  // the following code is spaghetti and i apologize.
-  uint64_t free_blocks = superblock->blocks - superblock->free_blocks_head;
-  uint64_t slots_per_block = BLOCK_SIZE / sizeof(uint64_t) - 1;
-  uint64_t first_free_block =
-      superblock->free_blocks_head + free_blocks -
-      (free_blocks * slots_per_block / (slots_per_block + 1));
-  log_msg("writing free space index");
-  uint64_t cur_index_block = superblock->free_blocks_head;
-  uint64_t cur_index_block_pos = 0;
-  for (uint64_t i = first_free_block; i < superblock->blocks; ++i) {
-    if (cur_index_block_pos == BLOCK_SIZE / sizeof(uint64_t)) {
-      cur_index_block++;
-      cur_index_block_pos = 0;
-    }
-
-    assert(cur_index_block < first_free_block);
-    uint64_t* free_index = (uint64_t*)tmp_block;
-
-    if (cur_index_block_pos == 0) {
-      // point to cur_index_block+1
-      if (cur_index_block < first_free_block - 1) {
-        free_index[0] = cur_index_block + 1;
-      } else {
-        // end of list right before first_free_block
-        free_index[0] = 0;
-      }
-      cur_index_block_pos++;
+/**
+ * like map_range(), for an |inode| mapped with block pointers
+ */
+static int map_pointers(struct filesystem* fs, struct sfs_fs_inode* inode,
+                        uint64_t iblock, uint64_t count, bool create,
+                        uint64_t* block_numbers, bool* inode_dirty) {
+  uint64_t i = 0;
+  uint64_t direct = fs->direct_blocks;
+  if (iblock < direct) {
+    i = count < direct - iblock ? count : direct - iblock;
+    uint64_t* pointers = &inode->block_pointers[iblock];
+    uint64_t goal = iblock > 0 && pointers[-1] != 0 ? pointers[-1] + 1
+                                                    : inode_goal(fs, inode);
+    if (create &&
+        fill_holes(fs, inode->inumber, pointers, i, goal, inode_dirty)) {
+      log_msg("could not allocate block");
+      return -1;
     }
-    free_index[cur_index_block_pos++] = i;
+    memcpy(block_numbers, pointers, i * sizeof(uint64_t));
+  }
 
-    // flush here and advance at the next loop
-    // (advance at the next loop for the sole purpose of the next assert)
-    if (cur_index_block_pos == BLOCK_SIZE / sizeof(uint64_t)) {
-      if (block_write(disk, cur_index_block, tmp_block) != BLOCK_SIZE) {
-        fprintf(stderr, "error initializing free blocks index\n");
-        log_msg("error initializing free block index %" PRIu64,
-                cur_index_block);
-        return -1;
-      }
+  // then each index in turn, mapping the blocks after those of the one before
+  uint64_t base = fs->direct_blocks;
+  for (int depth = 1; i < count && depth <= fs->index_depth; ++depth) {
+    uint64_t span = index_span(fs, depth);
+    if (iblock + i >= base + span) {
+      base += span;
+      continue;
+    }
+    uint64_t n = count - i < base + span - (iblock + i)
+                     ? count - i
+                     : base + span - (iblock + i);
+    uint64_t* index = &inode->block_pointers[SFS_IND_BLOCK + depth - 1];
+    uint64_t before = *index;
+    uint64_t prev = i > 0 ? block_numbers[i - 1] : 0;
+    if (i == 0 && depth == 1) {
+      prev = inode->block_pointers[fs->direct_blocks - 1];
+    }
+    uint64_t goal = prev != 0 ? prev + 1 : inode_goal(fs, inode);
+    if (read_from_index(fs, inode->inumber, index, depth, iblock + i - base,
+                        n, create, goal, block_numbers + i)) {
+      log_msg("error reading (or creating) indirect block");
+      return -1;
+    }
+    if (*index != before) {
+      inode->change_time = time(NULL);
+      *inode_dirty = true;
     }
+    i += n;
+    base += span;
+  }
+  return 0;
+}
+
+/**
+ * returns how many logical blocks |inode| can map
+ */
+static uint64_t mappable_blocks(const struct filesystem* fs,
+                                const struct sfs_fs_inode* inode) {
+  if (has_extents(inode)) {
+    return (uint64_t)UINT32_MAX + 1;
+  }
+  uint64_t blocks = fs->direct_blocks;
+  for (int depth = 1; depth <= fs->index_depth; ++depth) {
+    blocks += index_span(fs, depth);
+  }
+  return blocks;
+}
+
+/**
+ * writes to |block_numbers| the blocks backing the |count| logical blocks of
+ * |inode| starting at |iblock|, with 0 for holes. if |create| is set, holes
+ * are filled with newly allocated blocks and |inode| is written back when its
+ * mapping changes; otherwise |inode| is not modified.
+ *
+ * returns 0 if OK, otherwise -1
+ */
+static int map_range(struct filesystem* fs, struct sfs_fs_inode* inode,
+                     uint64_t iblock, uint64_t count, bool create,
+                     uint64_t* block_numbers) {
+  assert(fs != NULL);
+  assert(inode != NULL);
+  assert(block_numbers != NULL);
+
+  if (iblock + count > mappable_blocks(fs, inode)) {
+    log_msg("iblocks %" PRIu64 "+%" PRIu64 " are past the largest file",
+            iblock, count);
+    return -1;
+  }
+
+  if (is_inline(inode)) {
+    // the data is in the inode, which maps no blocks
+    memset(block_numbers, 0, count * sizeof(uint64_t));
+    return 0;
+  }
+
+  bool inode_dirty = false;
+  int ret = has_extents(inode)
+                ? map_extents(fs, inode, iblock, count, create, block_numbers,
+                              &inode_dirty)
+                : map_pointers(fs, inode, iblock, count, create,
+                               block_numbers, &inode_dirty);
+  if (ret) {
+    return -1;
   }
-  // this assertion makes sure we don't somehow leak blocks
-  assert(cur_index_block == first_free_block - 1);
 
-  if (write_superblock(disk, superblock)) {
-    fprintf(stderr, "error writing superblock\n");
+  if (inode_dirty && sfs_fs_write_inode(fs, inode)) {
+    log_msg("could not update inode");
     return -1;
   }
 
+  for (uint64_t i = 0; i < count; ++i) {
+    if (block_numbers[i] != 0 &&
+        (block_numbers[i] < fs->superblock.inode_table_blocks + 1 ||
+         block_numbers[i] >= fs->superblock.blocks)) {
+      log_msg(
+          "block INSIDE inode outside range? "
+          "(iblock=%" PRIu64 ", block_number=%" PRIu64 ") (range is %" PRIu64
+          " to %" PRIu64 ")",
+          iblock + i, block_numbers[i], fs->superblock.inode_table_blocks + 1,
+          fs->superblock.blocks);
+      return -1;
+    }
+  }
+
   return 0;
 }
 
-void* sfs_fs_open_disk(int disk, bool maybe_format) {
-  assert(disk >= 0);
+uint64_t sfs_fs_inode_get_block_number(void* fs, struct sfs_fs_inode* inode,
+                                       uint64_t iblock) {
+  assert(fs != NULL);
+  assert(inode != NULL);
 
-  // allocate in memory filesystem representation
-  struct filesystem* fs = malloc(sizeof(struct filesystem));
-  if (fs == NULL) {
-    perror("malloc() failure");
+  uint64_t block_number;
+  if (map_range(fs, inode, iblock, 1, false, &block_number)) {
+    return 0;
+  }
+  return block_number;
+}
+
+/**
+ * returns inode |inumber| to the free inodes
+ */
+static void free_inode(struct filesystem* fs, uint64_t inumber) {
+  sfs_bitmap_clear(fs->inode_bitmap, inumber - 1);
+  inode_bitmap_mark_dirty(fs, inumber);
+  uint64_t g = inode_group(fs, inumber);
+  ++fs->groups[g].free_inodes;
+  group_mark_dirty(fs, g);
+  ++fs->superblock.free_inodes;
+  fs->superblock_dirty = true;
+}
+
+/**
+ * appends the blocks under the index block |index_block_number|, which is
+ * |depth| levels above the data, and the index block itself to |runs|
+ */
+static int index_runs(struct filesystem* fs, uint64_t index_block_number,
+                      int depth, struct sfs_extent_list* runs) {
+  uint64_t* arr = malloc(fs->geometry.block_size);
+  if (arr == NULL) {
     log_msg("malloc failure");
-    return NULL;
+    return -1;
   }
-  // mark unsetup field values
-  fs->disk = disk;
-  fs->inode_cache.block_number = 0;
+  if (sfs_cache_read(fs->cache, index_block_number, arr)) {
+    log_msg("error reading index block %" PRIu64, index_block_number);
+    free(arr);
+    return -1;
+  }
+  struct sfs_fs_extent run = {.iblock = 0, .count = 1};
+  int ret = 0;
+  for (uint64_t i = 0; i < fs->geometry.pointers_per_block && ret == 0; ++i) {
+    run.start = arr[i];
+    if (run.start == 0) {
+      continue;
+    }
+    ret = depth > 1 ? index_runs(fs, arr[i], depth - 1, runs)
+                    : sfs_extent_append(runs, &run);
+  }
+  free(arr);
+  if (ret) {
+    return -1;
+  }
+  run.start = index_block_number;
+  return sfs_extent_append(runs, &run);
+}
 
-  // read the superblock data
-  sfs_block_t superblock_data;
-  if (block_read(fs->disk, 0, superblock_data) != BLOCK_SIZE) {
-    perror("block_read() error; couldn't read superblock");
-    log_msg("couldn't read superblock");
-    free(fs);
-    return NULL;
+/**
+ * appends the runs of disk blocks |inode| holds, its index blocks included,
+ * to |runs|. their logical blocks are left 0.
+ */
+static int inode_runs(struct filesystem* fs, const struct sfs_fs_inode* inode,
+                      struct sfs_extent_list* runs) {
+  struct sfs_fs_extent run = {.iblock = 0, .count = 1};
+  if (is_inline(inode)) {
+    return 0;
+  }
+  if (has_extents(inode)) {
+    struct sfs_extent_list list;
+    uint64_t* nodes;
+    uint64_t nnodes;
+    if (load_extents(fs, inode, &list, &nodes, &nnodes)) {
+      return -1;
+    }
+    int ret = 0;
+    for (uint64_t i = 0; i < list.count && ret == 0; ++i) {
+      run.start = list.extents[i].start;
+      run.count = list.extents[i].count;
+      ret = sfs_extent_append(runs, &run);
+    }
+    run.count = 1;
+    for (uint64_t i = 0; i < nnodes && ret == 0; ++i) {
+      run.start = nodes[i];
+      ret = sfs_extent_append(runs, &run);
+    }
+    sfs_extent_list_free(&list);
+    free(nodes);
+    return ret;
   }
 
-  // check the singature on the superblock
-  // if it matches, we can probably assume the filesystem is valid
-  // if it doesn't match and |maybe_format| is set, create a new filesystem
-  struct sfs_fs_superblock* superblock =
-      (struct sfs_fs_superblock*)superblock_data;
-  int signature_cmp = memcmp(superblock->signature, SFS_FILE_TYPE_SIGNATURE,
-                             sizeof(SFS_FILE_TYPE_SIGNATURE));
-  if (signature_cmp != 0) {
-    if (!maybe_format) {
-      log_msg(
-          "sfs_fs_open_disk() disk was unformatted and maybe_format is "
-          "false");
+  for (uint64_t i = 0; i < fs->direct_blocks; ++i) {
+    run.start = inode->block_pointers[i];
+    if (run.start != 0 && sfs_extent_append(runs, &run)) {
+      return -1;
     }
-    if (format_fs(fs->disk, &fs->superblock) != 0) {
-      free(fs);
-      return NULL;
+  }
+  for (int depth = 1; depth <= fs->index_depth; ++depth) {
+    uint64_t index = inode->block_pointers[SFS_IND_BLOCK + depth - 1];
+    if (index != 0 && index_runs(fs, index, depth, runs)) {
+      return -1;
     }
-  } else {
-    fs->superblock = *superblock;
   }
+  return 0;
+}
 
-  time_t create_time = (time_t)superblock->create_time;
-  // asctime() has '\n' at the end
-  char* t = asctime(localtime(&create_time));
-  t[strlen(t) - 1] = '\0';
-  log_msg("sfs_fs_open_disk() opened fs created at %s", t);
+static int compare_runs(const void* a, const void* b) {
+  uint64_t x = ((const struct sfs_fs_extent*)a)->start;
+  uint64_t y = ((const struct sfs_fs_extent*)b)->start;
+  return x < y ? -1 : x > y;
+}
 
-  return fs;
+/**
+ * frees the blocks of the next RECLAIM_BATCH inodes on the reclaim queue, all
+ * sorted together and freed a run of adjacent blocks at a time, and then the
+ * inodes
+ */
+static int reclaim_batch(struct filesystem* fs) {
+  uint64_t inumbers[RECLAIM_BATCH];
+  uint64_t n = sfs_reclaim_take(fs->reclaim, inumbers, RECLAIM_BATCH);
+
+  // an inode whose blocks can't be found stays in use, lost until the disk
+  // is mounted after a crash
+  struct sfs_extent_list runs;
+  sfs_extent_list_init(&runs);
+  uint64_t freed = 0;
+  int ret = 0;
+  for (uint64_t i = 0; i < n; ++i) {
+    struct sfs_fs_inode inode;
+    uint64_t before = runs.count;
+    if (sfs_fs_read_inode(fs, inumbers[i], &inode) ||
+        inode_runs(fs, &inode, &runs)) {
+      log_msg("could not reclaim inode %" PRIu64, inumbers[i]);
+      runs.count = before;
+      ret = -1;
+      continue;
+    }
+    inumbers[freed++] = inumbers[i];
+  }
+
+  qsort(runs.extents, runs.count, sizeof(struct sfs_fs_extent), compare_runs);
+  for (uint64_t i = 0; i < runs.count;) {
+    uint64_t start = runs.extents[i].start;
+    uint64_t end = start + runs.extents[i].count;
+    while (++i < runs.count && runs.extents[i].start == end) {
+      end += runs.extents[i].count;
+    }
+    if (end > fs->superblock.blocks ||
+        sfs_bitmap_count_ones(fs->bitmap, start, end) != end - start) {
+      log_msg("blocks %" PRIu64 " to %" PRIu64 " are not all in use", start,
+              end);
+      ret = -1;
+    } else {
+      sfs_bitmap_clear_range(fs->bitmap, start, end);
+      bitmap_mark_range_dirty(fs, start, end);
+      groups_give_blocks(fs, start, end);
+    }
+  }
+  sfs_extent_list_free(&runs);
+
+  for (uint64_t i = 0; i < freed; ++i) {
+    free_inode(fs, inumbers[i]);
+  }
+  return ret;
 }
 
-int sfs_fs_close(void* arg) {
-  struct filesystem* fs = (struct filesystem*)arg;
-  assert(fs != NULL);
-  assert(fs->disk >= 0);
+/**
+ * empties the reclaim queue
+ */
+static int reclaim(struct filesystem* fs) {
+  int ret = 0;
+  while (sfs_reclaim_count(fs->reclaim) > 0) {
+    if (reclaim_batch(fs)) {
+      ret = -1;
+    }
+  }
+  return ret;
+}
 
-  if (fs->inode_cache.dirty) {
-    if (block_write(fs->disk, fs->inode_cache.block_number,
-                    fs->inode_cache.data) != BLOCK_SIZE) {
-      log_msg("block_write() write-back failed");
-      return -1;
+int sfs_fs_inode_block_read(void* arg, const struct sfs_fs_inode* inode,
+                            uint64_t iblock, void* block) {
+  void* blocks[] = {block};
+  return sfs_fs_inode_range_read(arg, inode, iblock, 1, blocks);
+}
+
+int sfs_fs_inode_block_write(void* arg, struct sfs_fs_inode* inode,
+                             uint64_t iblock, const void* block) {
+  const void* blocks[] = {block};
+  return sfs_fs_inode_range_write(arg, inode, iblock, 1, blocks);
+}
+
+/**
+ * splits the |count| mapped |block_numbers| into runs of physically adjacent
+ * blocks, pointing each run at its part of |blocks|. holes (block number 0)
+ * are left out.
+ *
+ * returns the number of runs written to |runs|
+ */
+static uint64_t to_runs(const uint64_t* block_numbers, uint64_t count,
+                        void* const* blocks, struct block_run* runs) {
+  uint64_t nruns = 0;
+  for (uint64_t i = 0; i < count; ++i) {
+    if (block_numbers[i] == 0) {
+      continue;
+    }
+    if (nruns > 0 && i > 0 && block_numbers[i - 1] != 0 &&
+        block_numbers[i - 1] + 1 == block_numbers[i]) {
+      ++runs[nruns - 1].count;
+    } else {
+      runs[nruns].block_num = block_numbers[i];
+      runs[nruns].count = 1;
+      runs[nruns].blocks = blocks + i;
+      ++nruns;
     }
   }
-
-  if (write_superblock(fs->disk, &fs->superblock)) {
-    log_msg("failed to write superblock");
-  }
-
-  free(fs);
-  return 0;
+  return nruns;
 }
 
-int sfs_fs_inode_allocate(void* arg, struct sfs_fs_inode* inode) {
+int sfs_fs_inode_range_read(void* arg, const struct sfs_fs_inode* inode,
+                            uint64_t iblock, uint64_t count,
+                            void* const* blocks) {
   struct filesystem* fs = (struct filesystem*)arg;
   assert(fs != NULL);
   assert(fs->disk >= 0);
   assert(inode != NULL);
+  assert(blocks != NULL);
 
-  uint64_t inumber = fs->superblock.free_inode_head;
-  if (inumber == 0) {
-    log_msg("out of free inodes");
-    return -1;
+  if (is_inline(inode)) {
+    // no I/O: the data came with the inode
+    for (uint64_t i = 0; i < count; ++i) {
+      memset(blocks[i], 0, fs->geometry.block_size);
+    }
+    if (iblock == 0 && count > 0) {
+      memcpy(blocks[0], inode->block_pointers, fs->inline_size);
+    }
+    return 0;
   }
-  if (sfs_fs_read_inode(fs, inumber, inode)) {
-    log_msg("could not read allocated inode");
+
+  uint64_t* block_numbers = malloc(count * sizeof(uint64_t));
+  struct block_run* runs = malloc(count * sizeof(struct block_run));
+  if (block_numbers == NULL || runs == NULL) {
+    log_msg("malloc failure");
+    free(block_numbers);
+    free(runs);
     return -1;
   }
-  // hide next pointer in `size` member
-  fs->superblock.free_inode_head = inode->size;
-  if (write_superblock(fs->disk, &fs->superblock)) {
-    log_msg("could not write superblock");
-    return -1;
+  // |inode| is left alone when |create| is false
+  int ret = map_range(fs, (struct sfs_fs_inode*)inode, iblock, count, false,
+                      block_numbers);
+  if (ret == 0) {
+    for (uint64_t i = 0; i < count; ++i) {
+      if (block_numbers[i] == 0 &&
+          !sfs_delalloc_read(fs->delalloc, inode->inumber, iblock + i,
+                             blocks[i])) {
+        memset(blocks[i], 0, fs->geometry.block_size);
+      }
+    }
+
+    uint64_t nruns = to_runs(block_numbers, count, blocks, runs);
+    if (nruns > 0 && sfs_cache_read_runs(fs->cache, runs, nruns)) {
+      log_msg("unable to read iblocks %" PRIu64 "+%" PRIu64, iblock, count);
+      ret = -1;
+    }
   }
 
-  return 0;
+  free(block_numbers);
+  free(runs);
+  return ret;
 }
 
-int sfs_fs_inode_deallocate(void* arg, struct sfs_fs_inode* inode) {
+int sfs_fs_inode_readahead(void* arg, uint64_t inumber, uint64_t iblock,
+                           uint64_t count, pthread_mutex_t* mu) {
   struct filesystem* fs = (struct filesystem*)arg;
   assert(fs != NULL);
   assert(fs->disk >= 0);
-  assert(inode != NULL);
+  assert(mu != NULL);
 
-  // hide next pointer in `size` member
-  inode->size = fs->superblock.free_inode_head;
-  if (sfs_fs_write_inode(fs, inode)) {
-    log_msg("could not write allocated inode");
+  // the file may have shrunk or gone away since the readahead was asked for
+  struct sfs_fs_inode inode;
+  if (sfs_fs_read_inode(fs, inumber, &inode)) {
     return -1;
   }
-  fs->superblock.free_inode_head = inode->inumber;
-  if (write_superblock(fs->disk, &fs->superblock)) {
-    log_msg("could not write superblock");
+  uint64_t block_size = fs->geometry.block_size;
+  uint64_t file_blocks = (inode.size + block_size - 1) / block_size;
+  uint64_t mappable = mappable_blocks(fs, &inode);
+  if (file_blocks > mappable) {
+    file_blocks = mappable;
+  }
+  if (inode.links == 0 || iblock >= file_blocks) {
+    return 0;
+  }
+  if (count > file_blocks - iblock) {
+    count = file_blocks - iblock;
+  }
+
+  uint64_t* block_numbers = malloc(count * sizeof(uint64_t));
+  void** blocks = malloc(count * sizeof(void*));
+  struct block_run* runs = malloc(count * sizeof(struct block_run));
+  char* data = malloc(count * block_size);
+  if (block_numbers == NULL || blocks == NULL || runs == NULL ||
+      data == NULL) {
+    log_msg("malloc failure");
+    free(block_numbers);
+    free(blocks);
+    free(runs);
+    free(data);
     return -1;
   }
 
-  for (int i = 0; i < SFS_NDIR_BLOCKS; ++i) {
-    if (inode->block_pointers[i] != 0) {
-      if (sfs_fs_free_block(fs, inode->block_pointers[i])) {
-        log_msg("error freeing block %" PRIu64, inode->block_pointers[i]);
-        return -1;
+  int ret = map_range(fs, &inode, iblock, count, false, block_numbers);
+  if (ret == 0) {
+    for (uint64_t i = 0; i < count; ++i) {
+      if (block_numbers[i] != 0 &&
+          sfs_cache_contains(fs->cache, block_numbers[i])) {
+        block_numbers[i] = 0;
+      }
+      blocks[i] = data + i * block_size;
+    }
+
+    uint64_t nruns = to_runs(block_numbers, count, blocks, runs);
+    if (nruns > 0) {
+      // a block written while the lock is dropped could be read before or
+      // after the write, so any write at all makes the whole read suspect
+      uint64_t generation = sfs_cache_generation(fs->cache);
+      pthread_mutex_unlock(mu);
+      ret = block_read_runs(fs->dev, runs, nruns);
+      pthread_mutex_lock(mu);
+      if (ret == 0 && sfs_cache_generation(fs->cache) == generation) {
+        ret = sfs_cache_fill(fs->cache, runs, nruns);
       }
     }
   }
 
-  return 0;
+  free(block_numbers);
+  free(blocks);
+  free(runs);
+  free(data);
+  return ret;
 }
 
-int sfs_fs_read_inode(void* arg, uint64_t inumber, struct sfs_fs_inode* inode) {
-  struct filesystem* fs = (struct filesystem*)arg;
-  assert(fs != NULL);
-  assert(fs->disk >= 0);
-  assert(inumber > 0);  // 0 represents a NULL inode
-  assert(inode != NULL);
-
-  uint64_t inumber_index = inumber - 1;
-  uint64_t inodes_per_block = BLOCK_SIZE / sizeof(struct sfs_fs_inode);
-  // superblock is the first block, inodes start at block index 1
-  uint64_t block_number = inumber_index / inodes_per_block + 1;
-  uint64_t position_in_block = inumber_index % inodes_per_block;
-  if (fs->inode_cache.block_number != block_number) {
-    if (fs->inode_cache.dirty) {
-      if (block_write(fs->disk, fs->inode_cache.block_number,
-                      fs->inode_cache.data) != BLOCK_SIZE) {
-        log_msg("write-back failed: %s", strerror(errno));
-        return -1;
-      }
+/**
+ * makes the blocks of |blocks| that fall in holes (block number 0 in
+ * |block_numbers|) pending blocks of |inode|, reserving free blocks for them
+ * and for the index they will need
+ *
+ * returns 0 if OK, otherwise -1 (if there isn't room for them, say)
+ */
+static int delay_holes(struct filesystem* fs, const struct sfs_fs_inode* inode,
+                       uint64_t iblock, uint64_t count,
+                       const uint64_t* block_numbers,
+                       const void* const* blocks) {
+  uint64_t inumber = inode->inumber;
+  uint64_t holes = 0;
+  uint64_t start = sfs_delalloc_inode_start(fs->delalloc, inumber);
+  uint64_t end = sfs_delalloc_inode_end(fs->delalloc, inumber);
+  for (uint64_t i = 0; i < count; ++i) {
+    if (block_numbers[i] == 0 &&
+        !sfs_delalloc_contains(fs->delalloc, inumber, iblock + i)) {
+      start = end == 0 || iblock + i < start ? iblock + i : start;
+      ++holes;
+      end = iblock + i + 1 > end ? iblock + i + 1 : end;
     }
-
-    fs->inode_cache.block_number = block_number;
-    fs->inode_cache.dirty = false;
-    if (block_read(fs->disk, block_number, fs->inode_cache.data) !=
-        BLOCK_SIZE) {
-      log_msg("block_read failed: %s", strerror(errno));
+  }
+  uint64_t before = pending_reservation(fs, inode);
+  if (holes > 0) {
+    uint64_t pending = sfs_delalloc_inode_blocks(fs->delalloc, inumber);
+    uint64_t after = blocks_needed(fs, inode, pending + holes, start, end);
+    uint64_t needed = fs->reserved - before + after;
+    if (needed > fs->superblock.free_blocks &&
+        sfs_reclaim_count(fs->reclaim) > 0 && reclaim(fs)) {
+      return -1;
+    }
+    if (needed > fs->superblock.free_blocks && fs->preallocated > 0) {
+      // windows are only a guess; the space is better spent on data
+      sfs_prealloc_foreach(fs->prealloc, give_back_window, fs);
+    }
+    if (needed > fs->superblock.free_blocks) {
+      log_msg("out of free blocks");
       return -1;
     }
   }
 
-  *inode = ((struct sfs_fs_inode*)fs->inode_cache.data)[position_in_block];
-  return 0;
-}
-
-int sfs_fs_write_inode(void* arg, const struct sfs_fs_inode* inode) {
-  struct filesystem* fs = (struct filesystem*)arg;
-  assert(fs != NULL);
-  assert(fs->disk >= 0);
-  assert(inode != NULL);
-  assert(inode->inumber > 0);  // 0 represents a NULL inode
-
-  uint64_t inumber_index = inode->inumber - 1;
-  uint64_t inodes_per_block = BLOCK_SIZE / sizeof(struct sfs_fs_inode);
-  // superblock is the first block, inodes start at block index 1
-  uint64_t block_number = inumber_index / inodes_per_block + 1;
-  uint64_t position_in_block = inumber_index % inodes_per_block;
-  if (fs->inode_cache.block_number != block_number) {
-    if (fs->inode_cache.dirty) {
-      if (block_write(fs->disk, fs->inode_cache.block_number,
-                      fs->inode_cache.data) != BLOCK_SIZE) {
-        log_msg("write-back failed: %s", strerror(errno));
-        return -1;
-      }
+  int ret = 0;
+  for (uint64_t i = 0; i < count && ret == 0; ++i) {
+    if (block_numbers[i] == 0) {
+      ret = sfs_delalloc_put(fs->delalloc, inumber, iblock + i, blocks[i]);
     }
+  }
+  fs->reserved = fs->reserved - before + pending_reservation(fs, inode);
+  return ret;
+}
 
-    fs->inode_cache.block_number = block_number;
-    if (block_read(fs->disk, block_number, fs->inode_cache.data) !=
-        BLOCK_SIZE) {
-      log_msg("block_read failed: %s", strerror(errno));
-      return -1;
+/**
+ * returns true if |inode|, |inode->size| bytes long, can keep its data inline
+ * after the |count| blocks from |iblock| are written: it is inline already, or
+ * it is a regular file with no blocks yet and |fs| puts small files inline
+ */
+static bool stays_inline(struct filesystem* fs,
+                         const struct sfs_fs_inode* inode, uint64_t iblock,
+                         uint64_t count) {
+  if (iblock != 0 || count != 1 || inode->size > fs->inline_size) {
+    return false;
+  }
+  if (is_inline(inode)) {
+    return true;
+  }
+  if (!fs->inline_data || !S_ISREG(inode->mode) ||
+      sfs_delalloc_inode_blocks(fs->delalloc, inode->inumber) > 0) {
+    return false;
+  }
+  // no block pointers, or an empty extent tree
+  for (int i = 0; i < SFS_N_BLOCKS; ++i) {
+    if (inode->block_pointers[i] != 0) {
+      return false;
     }
   }
-  fs->inode_cache.dirty = true;
+  return true;
+}
 
-  ((struct sfs_fs_inode*)fs->inode_cache.data)[position_in_block] = *inode;
-  return 0;
+/**
+ * moves the data of inline |inode| to a pending block 0, turning it into an
+ * inode that maps blocks the way new ones do
+ *
+ * returns 0 if OK, otherwise -1 (and |inode| is left inline)
+ */
+static int move_inline_data(struct filesystem* fs,
+                            struct sfs_fs_inode* inode) {
+  char* block = calloc(1, fs->geometry.block_size);
+  if (block == NULL) {
+    log_msg("malloc failure");
+    return -1;
+  }
+  memcpy(block, inode->block_pointers, fs->inline_size);
+  const void* blocks[] = {block};
+
+  struct sfs_fs_inode before = *inode;
+  memset(inode->block_pointers, 0, sizeof(inode->block_pointers));
+  inode->flags = fs->extents ? SFS_INODE_EXTENTS : 0;
+  int ret = sfs_fs_inode_range_write(fs, inode, 0, 1, blocks);
+  free(block);
+  if (ret) {
+    *inode = before;
+    return -1;
+  }
+  return sfs_fs_write_inode(fs, inode);
 }
 
-void sfs_fs_inode_to_stat(void* arg, const struct sfs_fs_inode* inode,
-                          struct stat* st) {
+int sfs_fs_inode_range_write(void* arg, struct sfs_fs_inode* inode,
+                             uint64_t iblock, uint64_t count,
+                             const void* const* blocks) {
   struct filesystem* fs = (struct filesystem*)arg;
   assert(fs != NULL);
+  assert(fs->disk >= 0);
   assert(inode != NULL);
-  assert(st != NULL);
-
-  st->st_ino = inode->inumber;
-  st->st_mode = inode->mode;
-  st->st_nlink = inode->links;
-  st->st_uid = inode->uid;
-  st->st_gid = inode->gid;
-  st->st_atime = inode->access_time;
-  st->st_mtime = inode->modified_time;
-  st->st_ctime = inode->change_time;
-  st->st_size = inode->size;
-}
+  assert(blocks != NULL);
 
-uint64_t sfs_fs_inode_get_block_number(void* fs, struct sfs_fs_inode* inode,
-                                       uint64_t iblock) {
-  assert(fs != NULL);
-  assert(inode != NULL);
+  if (stays_inline(fs, inode, iblock, count)) {
+    inode->flags = SFS_INODE_INLINE;
+    memcpy(inode->block_pointers, blocks[0], fs->inline_size);
+    return sfs_fs_write_inode(fs, inode);
+  }
+  if (is_inline(inode) && move_inline_data(fs, inode)) {
+    log_msg("error moving the data of inode %" PRIu64 " to a block",
+            inode->inumber);
+    return -1;
+  }
 
-  if (iblock >= SFS_NDIR_BLOCKS) {
-    log_msg("sfs_fs_inode_get_block_number() indirection not yet implemented");
-    return 0;
+  uint64_t* block_numbers = malloc(count * sizeof(uint64_t));
+  struct block_run* runs = malloc(count * sizeof(struct block_run));
+  if (block_numbers == NULL || runs == NULL) {
+    log_msg("malloc failure");
+    free(block_numbers);
+    free(runs);
+    return -1;
+  }
+  // blocks that are already on disk are written to the cache. holes get
+  // their disk blocks at writeback, all of the file's at once
+  int ret = map_range(fs, inode, iblock, count, false, block_numbers);
+  if (ret == 0) {
+    // the runs only read from |blocks|
+    uint64_t nruns = to_runs(block_numbers, count, (void* const*)blocks, runs);
+    ret = sfs_cache_write_runs(fs->cache, runs, nruns);
+    if (ret == 0) {
+      ret = delay_holes(fs, inode, iblock, count, block_numbers, blocks);
+    }
+    if (ret) {
+      log_msg("error writing iblocks %" PRIu64 "+%" PRIu64, iblock, count);
+    }
   }
 
-  return inode->block_pointers[iblock];
+  free(block_numbers);
+  free(runs);
+  return ret;
 }
 
 /**
- * reads the block number at |index| from |indirect_block_number| and writes to
- * |block_number|
+ * gives the pending blocks of |inode| disk blocks and writes them to the
+ * cache, as dirty since |age_ms| milliseconds ago
  *
- * if |create_if_empty| is specified, if |indirect_block_number| has a hole at
- * |index|, a new block will be allocated and |indirect_block_number| will be
- * updated
+ * returns 0 if OK, otherwise -1
  */
-static int read_from_indirect(struct filesystem* fs,
-                              uint64_t indirect_block_number, uint64_t index,
-                              bool create_if_empty, uint64_t* block_number) {
-  assert(fs != NULL);
-  assert(block_number != NULL);
-
-  if (indirect_block_number == 0) {
-    *block_number = 0;
+static int allocate_inode_pending(struct filesystem* fs,
+                                  struct sfs_fs_inode* inode,
+                                  uint64_t age_ms) {
+  uint64_t max = sfs_delalloc_inode_blocks(fs->delalloc, inode->inumber);
+  if (max == 0) {
     return 0;
   }
-
-  sfs_block_t index_block;
-  uint64_t* arr = (uint64_t*)index_block;
-  if (block_read(fs->disk, indirect_block_number, index_block) != BLOCK_SIZE) {
+  const void** blocks = malloc(max * sizeof(void*));
+  uint64_t* block_numbers = malloc(max * sizeof(uint64_t));
+  struct block_run* runs = malloc(max * sizeof(struct block_run));
+  if (blocks == NULL || block_numbers == NULL || runs == NULL) {
+    log_msg("malloc failure");
+    free(blocks);
+    free(block_numbers);
+    free(runs);
     return -1;
   }
 
-  if (create_if_empty && arr[index] == 0) {
-    if (sfs_fs_allocate_block(fs, &arr[index])) {
-      return -1;
+  // the reservation turns into real blocks as they are allocated
+  fs->reserved -= pending_reservation(fs, inode);
+  int ret = 0;
+  uint64_t iblock, count;
+  while (ret == 0 &&
+         (count = sfs_delalloc_first_run(fs->delalloc, inode->inumber,
+                                         &iblock, blocks, max)) > 0) {
+    ret = map_range(fs, inode, iblock, count, true, block_numbers);
+    if (ret == 0) {
+      uint64_t nruns =
+          to_runs(block_numbers, count, (void* const*)blocks, runs);
+      ret = sfs_cache_write_runs_aged(fs->cache, runs, nruns, age_ms);
     }
-    if (block_write(fs->disk, indirect_block_number, index_block) !=
-        BLOCK_SIZE) {
-      return -1;
+    if (ret == 0) {
+      sfs_delalloc_remove(fs->delalloc, inode->inumber, iblock, count);
     }
   }
+  fs->reserved += pending_reservation(fs, inode);
 
-  *block_number = arr[index];
+  free(blocks);
+  free(block_numbers);
+  free(runs);
+  return ret;
+}
+
+/**
+ * gives disk blocks to the pending blocks of every inode whose first pending
+ * block was written at least |min_age_ms| milliseconds ago
+ *
+ * returns 0 if OK, otherwise -1
+ */
+static int allocate_pending(struct filesystem* fs, uint64_t min_age_ms) {
+  uint64_t inumber, age_ms;
+  while (sfs_delalloc_expired(fs->delalloc, min_age_ms, &inumber, &age_ms)) {
+    struct sfs_fs_inode inode;
+    if (sfs_fs_read_inode(fs, inumber, &inode) ||
+        allocate_inode_pending(fs, &inode, age_ms)) {
+      log_msg("could not allocate blocks for inode %" PRIu64, inumber);
+      return -1;
+    }
+  }
   return 0;
 }
 
-int sfs_fs_inode_block_read(void* arg, const struct sfs_fs_inode* inode,
-                            uint64_t iblock, void* block) {
+int sfs_fs_writeback(void* arg, uint64_t min_age_ms, pthread_mutex_t* mu) {
   struct filesystem* fs = (struct filesystem*)arg;
   assert(fs != NULL);
   assert(fs->disk >= 0);
-  assert(inode != NULL);
-  assert(block != NULL);
+  assert(mu != NULL);
 
-  uint64_t block_number;
-  if (iblock < SFS_NDIR_BLOCKS) {
-    block_number = inode->block_pointers[iblock];
-  } else if (iblock < SFS_NDIR_BLOCKS + SFS_NIND_BLOCKS) {
-    if (read_from_indirect(fs, inode->block_pointers[SFS_IND_BLOCK],
-                           iblock - SFS_NDIR_BLOCKS, false, &block_number)) {
-      log_msg("error reading indirect block");
-      return -1;
-    }
-  } else {
-    log_msg("double indirection not implemented");
+  // deleted files give their blocks back first, so pending blocks can have
+  // them. pending blocks are written back along with what was written when
+  // they were, and the metadata kept outside the cache ages with it
+  if (reclaim(fs) || allocate_pending(fs, min_age_ms) || checkpoint(fs)) {
     return -1;
   }
 
-  if (block_number == 0) {
-    memset(block, 0, BLOCK_SIZE);
-    return 0;
+  for (;;) {
+    void* batch;
+    if (sfs_cache_writeback_start(fs->cache, min_age_ms, &batch)) {
+      return -1;
+    }
+    if (batch == NULL) {
+      return 0;
+    }
+    pthread_mutex_unlock(mu);
+    int ret = sfs_cache_writeback_io(batch);
+    pthread_mutex_lock(mu);
+    sfs_cache_writeback_finish(fs->cache, batch, ret);
+    pthread_cond_broadcast(&fs->writeback_done);
+    if (ret) {
+      return -1;
+    }
   }
+}
+
+int sfs_fs_sync(void* arg, pthread_mutex_t* mu) {
+  struct filesystem* fs = (struct filesystem*)arg;
+  assert(fs != NULL);
+  assert(fs->disk >= 0);
+  assert(mu != NULL);
 
-  if (block_number < fs->superblock.inode_table_blocks + 1 ||
-      block_number >= fs->superblock.blocks) {
-    log_msg(
-        "block INSIDE inode outside range? "
-        "(iblock=%" PRIu64 ", block_number=%" PRIu64 ") (range is %" PRIu64
-        " to %" PRIu64 ")",
-        iblock, block_number, fs->superblock.inode_table_blocks + 1,
-        fs->superblock.blocks);
+  if (sfs_fs_writeback(fs, 0, mu)) {
     return -1;
   }
-
-  if (block_read(fs->disk, block_number, block) != BLOCK_SIZE) {
-    log_msg("unable to read block %" PRIu64 ": %s", block_number,
-            strerror(errno));
+  // blocks in another thread's batch aren't dirty, but aren't on disk yet
+  // either. once it is done, whatever was dirtied while the lock was dropped
+  // is written with the lock held.
+  while (sfs_cache_writebacks_in_flight(fs->cache) > 0) {
+    pthread_cond_wait(&fs->writeback_done, mu);
+  }
+  if (allocate_pending(fs, 0) || checkpoint(fs) ||
+      sfs_cache_flush(fs->cache)) {
     return -1;
   }
-
   return 0;
 }
 
-int sfs_fs_inode_block_write(void* arg, struct sfs_fs_inode* inode,
-                             uint64_t iblock, const void* block) {
+uint64_t sfs_fs_dirty_percent(void* arg) {
   struct filesystem* fs = (struct filesystem*)arg;
   assert(fs != NULL);
-  assert(fs->disk >= 0);
-  assert(inode != NULL);
-  assert(block != NULL);
+  // pending blocks are dirty data the cache doesn't know about yet
+  uint64_t pending = sfs_delalloc_blocks(fs->delalloc);
+  return sfs_cache_dirty_percent(fs->cache) +
+         pending * 100 / sfs_cache_capacity(fs->cache);
+}
 
+/**
+ * unmaps logical block |iblock| of extent-mapped |inode| and frees its block
+ */
+static int remove_extent_block(struct filesystem* fs,
+                               struct sfs_fs_inode* inode, uint64_t iblock) {
+  struct sfs_extent_list list;
+  uint64_t* nodes;
+  uint64_t nnodes;
+  if (load_extents(fs, inode, &list, &nodes, &nnodes)) {
+    return -1;
+  }
   uint64_t block_number;
-  if (iblock < SFS_NDIR_BLOCKS) {
-    block_number = inode->block_pointers[iblock];
-    if (block_number == 0) {
-      if (sfs_fs_allocate_block(fs, &block_number)) {
-        log_msg("could not allocate block");
-        return -1;
-      }
-      inode->block_pointers[iblock] = block_number;
-      if (sfs_fs_write_inode(fs, inode)) {
-        log_msg("could not update inode");
-        return -1;
-      }
-    }
-  } else if (iblock < SFS_NDIR_BLOCKS + SFS_NIND_BLOCKS) {
-    if (inode->block_pointers[SFS_IND_BLOCK] == 0) {
-      if (sfs_fs_allocate_block(fs, &inode->block_pointers[SFS_IND_BLOCK])) {
-        log_msg("error allocating indirect block index");
-        return -1;
-      }
-      inode->change_time = time(NULL);
-      if (sfs_fs_write_inode(fs, inode)) {
-        log_msg("error writing inode");
-        return -1;
-      }
+  int ret = sfs_extent_remove(&list, iblock, &block_number);
+  if (ret == 0 && block_number != 0) {
+    ret = store_extents(fs, inode, &list, nodes, nnodes);
+    if (ret == 0) {
+      ret = sfs_fs_write_inode(fs, inode);
     }
-    // BUG: creating an indirect block should update change_time
-    if (read_from_indirect(fs, inode->block_pointers[SFS_IND_BLOCK],
-                           iblock - SFS_NDIR_BLOCKS, true, &block_number)) {
-      log_msg("error reading (or creating) indirect block");
-      return -1;
+    if (ret == 0) {
+      ret = sfs_fs_free_block(fs, block_number);
     }
-  } else {
-    log_msg("double indirection not implemented");
-    return -1;
   }
-
-  if (block_number < fs->superblock.inode_table_blocks + 1 ||
-      block_number >= fs->superblock.blocks) {
-    log_msg(
-        "block INSIDE inode outside range? "
-        "(iblock=%" PRIu64 ", block_number=%" PRIu64 ") (range is %" PRIu64
-        " to %" PRIu64 ")",
-        iblock, block_number, fs->superblock.inode_table_blocks + 1,
-        fs->superblock.blocks);
-    return -1;
+  sfs_extent_list_free(&list);
+  free(nodes);
+  if (ret) {
+    log_msg("error removing logical block %" PRIu64, iblock);
   }
+  return ret;
+}
 
-  if (block_write(fs->disk, block_number, block) != BLOCK_SIZE) {
-    log_msg("error writing block %" PRIu64 ": %s", block_number,
-            strerror(errno));
+/**
+ * unmaps logical block |iblock| of pointer-mapped |inode|, which is past its
+ * direct blocks, and frees its block. emptied index blocks are kept.
+ */
+static int remove_indexed_block(struct filesystem* fs,
+                                struct sfs_fs_inode* inode, uint64_t iblock) {
+  if (iblock >= mappable_blocks(fs, inode)) {
+    return 0;
+  }
+  // find the index the block is under, and its place there
+  int depth = 1;
+  uint64_t index = iblock - fs->direct_blocks;
+  while (index >= index_span(fs, depth)) {
+    index -= index_span(fs, depth);
+    ++depth;
+  }
+  uint64_t index_block_number =
+      inode->block_pointers[SFS_IND_BLOCK + depth - 1];
+  uint64_t* arr = malloc(fs->geometry.block_size);
+  if (arr == NULL) {
+    log_msg("malloc failure");
     return -1;
   }
-
-  return 0;
+  int ret = 0;
+  for (; depth > 0 && index_block_number != 0 && ret == 0; --depth) {
+    if (sfs_cache_read(fs->cache, index_block_number, arr)) {
+      log_msg("error reading index block %" PRIu64, index_block_number);
+      ret = -1;
+      break;
+    }
+    uint64_t span = index_span(fs, depth - 1);
+    uint64_t slot = index / span;
+    index %= span;
+    if (depth > 1) {
+      index_block_number = arr[slot];
+      continue;
+    }
+    uint64_t block_number = arr[slot];
+    if (block_number == 0) {
+      break;
+    }
+    arr[slot] = 0;
+    if (sfs_cache_write(fs->cache, index_block_number, arr) ||
+        sfs_fs_free_block(fs, block_number)) {
+      log_msg("error removing logical block %" PRIu64, iblock);
+      ret = -1;
+    }
+  }
+  free(arr);
+  return ret;
 }
 
 int sfs_fs_inode_block_remove(void* arg, struct sfs_fs_inode* inode,
@@ -560,16 +3056,36 @@ int sfs_fs_inode_block_remove(void* arg, struct sfs_fs_inode* inode,
   assert(fs->disk >= 0);
   assert(inode != NULL);
 
-  if (iblock >= SFS_NDIR_BLOCKS) {
-    log_msg("indirection not yet implemented");
-    return -1;
+  if (sfs_delalloc_contains(fs->delalloc, inode->inumber, iblock)) {
+    fs->reserved -= pending_reservation(fs, inode);
+    sfs_delalloc_remove(fs->delalloc, inode->inumber, iblock, 1);
+    fs->reserved += pending_reservation(fs, inode);
+    return 0;
+  }
+
+  if (is_inline(inode)) {
+    if (iblock > 0) {
+      return 0;
+    }
+    memset(inode->block_pointers, 0, sizeof(inode->block_pointers));
+    return sfs_fs_write_inode(fs, inode);
+  }
+
+  if (has_extents(inode)) {
+    return remove_extent_block(fs, inode, iblock);
   }
 
-  if (inode->block_pointers[iblock] == 0) {
+  if (iblock >= fs->direct_blocks) {
+    return remove_indexed_block(fs, inode, iblock);
+  }
+
+  uint64_t block_number = inode->block_pointers[iblock];
+  if (block_number == 0) {
     return 0;
   }
 
-  if (sfs_fs_free_block(fs, inode->block_pointers[iblock])) {
+  inode->block_pointers[iblock] = 0;
+  if (sfs_fs_write_inode(fs, inode) || sfs_fs_free_block(fs, block_number)) {
     log_msg("sfs_fs_inode_block_remove() error freeing logical block %" PRIu64,
             iblock);
     return -1;
@@ -579,115 +3095,104 @@ int sfs_fs_inode_block_remove(void* arg, struct sfs_fs_inode* inode,
 }
 
 int sfs_fs_allocate_block(void* arg, uint64_t* block_number) {
-  struct filesystem* fs = (struct filesystem*)arg;
-  assert(fs != NULL);
-  assert(fs->disk >= 0);
-
-  if (fs->superblock.free_blocks_head == 0) {
-    log_msg("failed; no free blocks available");
-    return -1;
-  }
-
-  uint64_t node = fs->superblock.free_blocks_head;
-  uint64_t found_free_block = 0;
-  sfs_block_t tmp_block;
-
-  if (block_read(fs->disk, node, tmp_block) != BLOCK_SIZE) {
-    log_msg("error reading block %" PRIu64, node);
-    return -1;
-  }
-
-  // search through the index node for a free block number
-  uint64_t* index = (uint64_t*)tmp_block;
-  for (uint64_t i = 1; i < BLOCK_SIZE / sizeof(uint64_t); ++i) {
-    if (index[i] != 0) {
-      found_free_block = index[i];
-      index[i] = 0;
-      break;
-    }
-  }
+  uint64_t allocated;
+  return sfs_fs_allocate_blocks(arg, 0, 1, block_number, &allocated);
+}
 
-  if (found_free_block) {
-    // write the zeroed slot to the index
-    if (block_write(fs->disk, node, tmp_block) != BLOCK_SIZE) {
-      log_msg("error writing block %" PRIu64, node);
-      return -1;
+/**
+ * finds |count| free blocks in a row within one group: from |goal| to the end
+ * of its group, then in the groups after it that have that many free blocks
+ * (wrapping around), then before |goal| in its group
+ *
+ * returns the first block of the run, or |fs->superblock.blocks| if there is
+ * none
+ */
+static uint64_t find_run(const struct filesystem* fs, uint64_t goal,
+                         uint64_t count) {
+  uint64_t groups = fs->superblock.groups;
+  uint64_t goal_group = block_group(fs, goal);
+  for (uint64_t i = 0; i <= groups; ++i) {
+    uint64_t g = (goal_group + i) % groups;
+    if (fs->groups[g].free_blocks < count) {
+      continue;
     }
-  } else {
-    // if there are no free blocks in this index node, use the index node as
-    // the free block
-    // we can assume this node's previous node was the superblock
-    found_free_block = node;
-    fs->superblock.free_blocks_head = index[0];
-    if (write_superblock(fs->disk, &fs->superblock)) {
-      log_msg("error writing superblock");
-      return -1;
+    uint64_t start = i == 0 ? goal : group_start(fs, g);
+    uint64_t end = i == groups ? goal : group_end(fs, g);
+    uint64_t found = sfs_bitmap_find_zero_run(fs->bitmap, start, end, count);
+    if (found != end) {
+      return found;
     }
   }
+  return fs->superblock.blocks;
+}
 
-  *block_number = found_free_block;
-  return 0;
+/**
+ * finds free blocks for sfs_fs_allocate_blocks(): the free run at |goal| if
+ * there is one, otherwise the first run of |count| free blocks from |goal| on,
+ * otherwise the first free block from |goal| on
+ *
+ * returns the first block of the run, or |fs->superblock.blocks| if the disk
+ * is full
+ */
+static uint64_t find_extent(const struct filesystem* fs, uint64_t goal,
+                            uint64_t count) {
+  if (!sfs_bitmap_test(fs->bitmap, goal)) {
+    return goal;
+  }
+  uint64_t found = find_run(fs, goal, count);
+  if (found == fs->superblock.blocks && count > 1) {
+    found = find_run(fs, goal, 1);
+  }
+  return found;
 }
 
-int sfs_fs_free_block(void* arg, uint64_t block_number) {
+int sfs_fs_allocate_blocks(void* arg, uint64_t goal, uint64_t count,
+                           uint64_t* first, uint64_t* allocated) {
   struct filesystem* fs = (struct filesystem*)arg;
   assert(fs != NULL);
   assert(fs->disk >= 0);
+  assert(count > 0);
+  assert(first != NULL);
+  assert(allocated != NULL);
 
-  sfs_block_t tmp_block = {0};
-  uint64_t* index = (uint64_t*)tmp_block;
-
-  // case where there are no other nodes
-  if (fs->superblock.free_blocks_head == 0) {
-    if (block_write(fs->disk, block_number, tmp_block) != BLOCK_SIZE) {
-      log_msg("error zeroing block %" PRIu64, block_number);
-      return -1;
-    }
-    fs->superblock.free_blocks_head = block_number;
-    if (write_superblock(fs->disk, &fs->superblock)) {
-      log_msg("error writing superblock");
-      return -1;
-    }
-    return 0;
-  }
-
-  uint64_t node = fs->superblock.free_blocks_head;
-  uint64_t prev_node = 0;
-  while (node != 0) {
-    if (block_read(fs->disk, node, tmp_block) != BLOCK_SIZE) {
-      log_msg("error reading block %" PRIu64, node);
-      return -1;
-    }
-
-    // search through the index node for a free slot
-    for (uint64_t i = 1; i < BLOCK_SIZE / sizeof(uint64_t); ++i) {
-      if (index[i] == 0) {
-        index[i] = block_number;
-        if (block_write(fs->disk, node, tmp_block) != BLOCK_SIZE) {
-          log_msg("error writing block %" PRIu64, node);
-          return -1;
-        }
-        return 0;
-      }
-    }
-
-    prev_node = node;
-    node = index[0];
+  uint64_t blocks = fs->superblock.blocks;
+  if (goal == 0 || goal >= blocks) {
+    goal = fs->alloc_next < blocks ? fs->alloc_next : 0;
   }
-
-  // add |block_number| as a node at the end of the list
-  index[0] = block_number;
-  if (block_write(fs->disk, prev_node, tmp_block) != BLOCK_SIZE) {
-    log_msg("error writing block %" PRIu64, prev_node);
+  uint64_t start = find_extent(fs, goal, count);
+  if (start == blocks) {
+    log_msg("failed; no free blocks available");
     return -1;
   }
+  uint64_t end = start + count < blocks ? start + count : blocks;
+  end = sfs_bitmap_find_one(fs->bitmap, start, end);
+
+  sfs_bitmap_set_range(fs->bitmap, start, end);
+  bitmap_mark_range_dirty(fs, start, end);
+  groups_take_blocks(fs, start, end);
+  fs->alloc_next = end;
+  *first = start;
+  *allocated = end - start;
+  return 0;
+}
+
+int sfs_fs_free_block(void* arg, uint64_t block_number) {
+  struct filesystem* fs = (struct filesystem*)arg;
+  assert(fs != NULL);
+  assert(fs->disk >= 0);
 
-  // zero the block of |block_number|
-  memset(tmp_block, 0, BLOCK_SIZE);
-  if (block_write(fs->disk, block_number, tmp_block) != BLOCK_SIZE) {
-    log_msg("error zeroing block %" PRIu64, block_number);
+  if (block_number >= fs->superblock.blocks ||
+      !sfs_bitmap_test(fs->bitmap, block_number)) {
+    log_msg("block %" PRIu64 " is not in use", block_number);
     return -1;
   }
 
+  sfs_bitmap_clear(fs->bitmap, block_number);
+  bitmap_mark_dirty(fs, block_number);
+  uint64_t group = block_group(fs, block_number);
+  ++fs->groups[group].free_blocks;
+  group_mark_dirty(fs, group);
+  ++fs->superblock.free_blocks;
+  fs->superblock_dirty = true;
   return 0;
 }
@@ -7,15 +7,25 @@
 #ifndef _FS_H_
 #define _FS_H_
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 
 #include "block.h"
+#include "geometry.h"
 
 // magic number to identify proper superblock
 #define SFS_FILE_TYPE_SIGNATURE "SFS_IS_THE_BEST"
 
+// superblock state of a filesystem that was unmounted cleanly
+#define SFS_STATE_CLEAN 1
+
+// inode table formats: struct sfs_fs_inode as is, or struct sfs_fs_inode_v2
+#define SFS_INODE_FORMAT_V1 1
+#define SFS_INODE_FORMAT_V2 2
+
 /**
  * represents a superblock on disk
  *
@@ -25,28 +35,94 @@ struct sfs_fs_superblock {
   char signature[16];
   uint64_t create_time;  // `time()` when format was run
 
-  uint64_t block_size;          // 512B blocks for sfs project
+  uint64_t block_size;          // power of 2, chosen at format time
   uint64_t inode_table_blocks;  // how many consecutive blocks after the
                                 // superblock are for inodes
   uint64_t inodes;              // number of inodes
   uint64_t blocks;
 
-  uint64_t free_blocks_head;  // start block of the free blocks index
+  uint64_t free_blocks_head;  // start block of the free blocks index (only
+                              // on disks formatted before the bitmap)
   uint64_t free_inode_head;   // inode number beginning the free inode list
+                              // (only on disks formatted before allocation
+                              // groups)
+
+  // the block bitmap takes |bitmap_blocks| consecutive blocks from
+  // |bitmap_start|. bit i is set if block i is in use. disks formatted with a
+  // free blocks index have |bitmap_blocks| 0 and are converted at mount.
+  uint64_t bitmap_start;
+  uint64_t bitmap_blocks;
+
+  // group g covers the |group_blocks| blocks from |groups_first_block| +
+  // g * |group_blocks| and the |group_inodes| inodes from g * |group_inodes|
+  // + 1 (the last group may have fewer of either). the descriptors of the
+  // |groups| groups start at block |group_table_start|. disks formatted
+  // before allocation groups have |groups| 0 and are converted at mount.
+  uint64_t groups;
+  uint64_t group_blocks;
+  uint64_t group_inodes;
+  uint64_t groups_first_block;
+  uint64_t group_table_start;
+
+  // SFS_STATE_CLEAN on disk only while the filesystem isn't mounted, and only
+  // if it was unmounted cleanly. otherwise the free counts in the group
+  // descriptors may be stale and are rebuilt at mount.
+  uint64_t state;
+
+  // free blocks and inodes over all groups, kept current while mounted. mount
+  // sums them from the group descriptors, which recovery recounts.
+  uint64_t free_blocks;
+  uint64_t free_inodes;
+
+  // the inode bitmap takes |inode_bitmap_blocks| consecutive blocks from
+  // |inode_bitmap_start|. bit i is set if inode i + 1 is in use. disks
+  // formatted with free inode lists have |inode_bitmap_blocks| 0 and are
+  // converted at mount.
+  uint64_t inode_bitmap_start;
+  uint64_t inode_bitmap_blocks;
+
+  // SFS_INODE_FORMAT_*, chosen at format time. 0 on disks formatted before
+  // there was a choice, which are SFS_INODE_FORMAT_V1.
+  uint64_t inode_format;
+};
+
+/**
+ * represents the descriptor of an allocation group on disk
+ */
+struct sfs_fs_group {
+  uint64_t free_blocks;      // clear bits in the group's part of the bitmap
+  uint64_t free_inodes;      // clear bits in the group's part of the inode
+                             // bitmap
+  uint64_t free_inode_head;  // inode number beginning the free inode list
+                             // (only on disks formatted before the inode
+                             // bitmap)
+  uint64_t itable_unused;    // inode table blocks at the end of the group's
+                             // part of the table that were never written;
+                             // they read as free inodes
 };
 
 #define SFS_NDIR_BLOCKS 12
 
-#define SFS_IND_BLOCK SFS_NDIR_BLOCKS  // TODO: implement for directories
-// number of blocks in indirect block's index (only 1 indirect block)
-#define SFS_NIND_BLOCKS (1 * (BLOCK_SIZE / sizeof(uint64_t)))
+// maps the blocks after the direct ones
+#define SFS_IND_BLOCK SFS_NDIR_BLOCKS
 
-#define SFS_DIND_BLOCK (SFS_IND_BLOCK + 1)  // TODO: implement
+// maps the blocks after those of the indirect block, through a block of
+// indirect blocks
+#define SFS_DIND_BLOCK (SFS_IND_BLOCK + 1)
 
-#define SFS_N_BLOCKS (SFS_DIND_BLOCK + 1)
+// maps the blocks after those of the double indirect block, through a block
+// of double indirect blocks. only formats with room for it have one.
+#define SFS_TIND_BLOCK (SFS_DIND_BLOCK + 1)
+
+#define SFS_N_BLOCKS (SFS_TIND_BLOCK + 1)
+
+// block pointers an inode keeps on disk in SFS_INODE_FORMAT_V1, which has no
+// room for the triple indirect block
+#define SFS_V1_N_BLOCKS SFS_TIND_BLOCK
 
 /**
- * represents an inode on disk
+ * represents an inode in memory. on disk in SFS_INODE_FORMAT_V1, it is the
+ * first SFS_V1_INODE_SIZE bytes of this.
  *
  * inode numbers are indices in inode table
  *
@@ -56,7 +132,8 @@ struct sfs_fs_superblock {
  */
 struct sfs_fs_inode {
   uint64_t inumber;
-  uint32_t mode;  // uses the same mode bits as chmod(2)
+  uint16_t mode;   // uses the same mode bits as chmod(2)
+  uint16_t flags;  // SFS_INODE_*
 
   uint32_t uid;
   uint32_t gid;
@@ -70,18 +147,113 @@ struct sfs_fs_inode {
   // if inode is free, this is a pointer to the next free inode
   uint64_t size;
 
-  // first pointers are direct, then indirect, then doubly indirect (see
-  // SFS_NDIR_BLOCKS)
+  // first pointers are direct, then indirect, then doubly and triply indirect
+  // (see SFS_NDIR_BLOCKS). with SFS_INODE_EXTENTS, the root of the inode's
+  // extent tree instead, and with SFS_INODE_INLINE, the file's data.
   uint64_t block_pointers[SFS_N_BLOCKS];
 };
 
+#define SFS_V1_INODE_SIZE        \
+  (sizeof(struct sfs_fs_inode) - \
+   (SFS_N_BLOCKS - SFS_V1_N_BLOCKS) * sizeof(uint64_t))
+
+// the inode maps its blocks with extents rather than block pointers
+#define SFS_INODE_EXTENTS 0x1
+
+// the inode has no blocks; its data is kept in |block_pointers|
+#define SFS_INODE_INLINE 0x2
+
+// bytes of data an inode can keep inline in SFS_INODE_FORMAT_V1
+#define SFS_INLINE_DATA_SIZE (SFS_V1_N_BLOCKS * sizeof(uint64_t))
+
+#define SFS_V2_NDIR_BLOCKS 9
+
+#define SFS_V2_N_BLOCKS (SFS_V2_NDIR_BLOCKS + 3)
+
+/**
+ * represents an inode on disk in SFS_INODE_FORMAT_V2, which is read into and
+ * written from a struct sfs_fs_inode. the inode number is its place in the
+ * table, times are 32-bit and the size is 48-bit.
+ *
+ * the block pointers are the first SFS_V2_NDIR_BLOCKS direct ones, then the
+ * indirect, doubly and triply indirect ones. an extent tree root or inline data takes
+ * the first bytes of the struct sfs_fs_inode's |block_pointers| that fit.
+ */
+struct sfs_fs_inode_v2 {
+  uint16_t mode;
+  uint16_t flags;
+  uint16_t links;
+  uint16_t size_high;
+  uint32_t size_low;
+  uint32_t uid;
+  uint32_t gid;
+  uint32_t access_time;
+  uint32_t modified_time;
+  uint32_t change_time;
+  uint64_t block_pointers[SFS_V2_N_BLOCKS];
+};
+
+/**
+ * represents one entry of a node of an extent tree. in a leaf, it maps
+ * |count| logical blocks of a file from |iblock| to as many disk blocks from
+ * |start|. in an index node, |start| is the node below, which maps the logical
+ * blocks from |iblock| up to the next entry's, and |count| is 0.
+ */
+struct sfs_fs_extent {
+  uint32_t iblock;
+  uint32_t count;
+  uint64_t start;
+};
+
+/**
+ * starts each node of an extent tree, followed by its entries sorted by
+ * logical block. the root is in the inode's |block_pointers|, the other nodes
+ * fill a block each.
+ */
+struct sfs_fs_extent_header {
+  uint16_t entries;
+  uint16_t depth;    // 0 for a leaf
+  uint32_t extents;  // in the leaves of the whole tree (in the root only)
+};
+
+// extents (or index entries) that fit in an inode in SFS_INODE_FORMAT_V1
+#define SFS_EXTENT_ROOT_ENTRIES                                   \
+  ((SFS_INLINE_DATA_SIZE - sizeof(struct sfs_fs_extent_header)) / \
+   sizeof(struct sfs_fs_extent))
+
+/**
+ * tunables for an open filesystem, filled in from the mount options. zero
+ * means "use the default".
+ */
+struct sfs_fs_options {
+  unsigned cache_mb;      // budget for the buffer cache
+  int block_backend;      // an `enum block_backend`
+  unsigned block_size;    // for a disk that gets formatted
+  int lazy_init;          // if set, formatting leaves the inode table unwritten
+  int extents;            // if set, new inodes map their blocks with extents
+  int inline_data;        // if set, small new files keep their data inline
+  unsigned inode_format;  // for a disk that gets formatted: SFS_INODE_FORMAT_*
+  int atime;              // when reads update access times: SFS_ATIME_*
+};
+
+// reads update the access time every time
+#define SFS_ATIME_STRICT 0
+
+// reads update the access time only if it is older than the last change, or
+// than a day
+#define SFS_ATIME_RELATIME 1
+
+// reads never update the access time
+#define SFS_ATIME_NOATIME 2
+
 /**
  * opens |diskfile| for rw and if it is unformatted and |maybe_format| is true,
  * formats |diskfile| as an sfs filesystem
  *
  * returns opaque pointer representing the filesystem
  */
-void* sfs_fs_open_disk(int disk, bool maybe_format);
+void* sfs_fs_open_disk(int disk, bool maybe_format,
+                       const struct sfs_fs_options* options);
 
 /**
  * flushes buffers and closes the underlying filesystem
@@ -89,20 +261,45 @@ void* sfs_fs_open_disk(int disk, bool maybe_format);
 int sfs_fs_close(void* fs);
 
 /**
- * allocates a fresh inode from |fs|, writes its number to |inumber|, and
- * writes its data to |inode|
+ * returns the block size of |fs| and the code specialized for it
+ */
+const struct sfs_geometry* sfs_fs_geometry(void* fs);
+
+/**
+ * allocates a fresh inode from |fs| for a file in the directory |parent|,
+ * and writes it, zeroed but for its number, to |inode|. it is the first free
+ * inode after the parent's, so a directory and the files made in it share
+ * inode blocks, and it comes from the parent's allocation group if that has
+ * any left, so the file's blocks go near the directory's too.
  *
  * returns 0 if OK, otherwise -1
  */
-int sfs_fs_inode_allocate(void* fs, struct sfs_fs_inode* inode);
+int sfs_fs_inode_allocate(void* fs, uint64_t parent,
+                          struct sfs_fs_inode* inode);
 
 /**
- * deallocates |inode| and its blocks
+ * deallocates |inode|, which has no links left. its blocks are freed by the
+ * next sfs_fs_writeback(), and the inode along with them.
  *
  * returns 0 if OK, otherwise -1
  */
 int sfs_fs_inode_deallocate(void* fs, struct sfs_fs_inode* inode);
 
+/**
+ * records that inode |inumber| was opened. while it is open, it stays in the
+ * inode cache and its blocks are allocated from a window of blocks set aside
+ * after its last one.
+ *
+ * returns 0 if OK, otherwise -1
+ */
+int sfs_fs_inode_open(void* fs, uint64_t inumber);
+
+/**
+ * records that inode |inumber| was closed, giving back the rest of its window
+ * if that was its last open
+ */
+void sfs_fs_inode_release(void* fs, uint64_t inumber);
+
 /**
  * reads inode |inumber| from |fs| and writes to |inode|
  *
@@ -123,6 +320,20 @@ int sfs_fs_write_inode(void* fs, const struct sfs_fs_inode* inode);
 void sfs_fs_inode_to_stat(void* fs, const struct sfs_fs_inode* inode,
                           struct stat* stat);
 
+/**
+ * sets |inode|'s access time to now, if the access time mode of |fs| calls
+ * for it after a read. the caller writes the inode if it changed.
+ *
+ * returns true if the access time changed
+ */
+bool sfs_fs_inode_touch(void* fs, struct sfs_fs_inode* inode);
+
+/**
+ * fills |statbuf| with the size and free space of |fs|. blocks set aside for
+ * data that hasn't been allocated yet count as used.
+ */
+void sfs_fs_statvfs(void* fs, struct statvfs* statbuf);
+
 /**
  * gets the block number of the |iblock|th logical block in a file and returns
  * it
@@ -148,6 +359,69 @@ int sfs_fs_inode_block_read(void* fs, const struct sfs_fs_inode* inode,
 int sfs_fs_inode_block_write(void* fs, struct sfs_fs_inode* inode,
                              uint64_t iblock, const void* block);
 
+/**
+ * for an |inode| in |fs|, read the |count| logical blocks starting at |iblock|
+ * into |blocks| (one buffer per block). physically contiguous blocks are read
+ * with a single I/O.
+ *
+ * returns 0 if OK, otherwise -1
+ */
+int sfs_fs_inode_range_read(void* fs, const struct sfs_fs_inode* inode,
+                            uint64_t iblock, uint64_t count,
+                            void* const* blocks);
+
+/**
+ * for inode |inumber| in |fs|, bring the |count| logical blocks starting at
+ * |iblock| into the cache. holes, blocks past the end of the file and blocks
+ * that are already cached are skipped.
+ *
+ * |mu| is the lock callers of |fs| hold. it is held on entry and on return,
+ * but dropped while the disk is read, so other calls can go ahead. if the
+ * cache is written to in the meantime, what was read is thrown away.
+ *
+ * returns 0 if OK, otherwise -1
+ */
+int sfs_fs_inode_readahead(void* fs, uint64_t inumber, uint64_t iblock,
+                           uint64_t count, pthread_mutex_t* mu);
+
+/**
+ * for an |inode| in |fs|, write the |count| logical blocks starting at
+ * |iblock| from |blocks| (one buffer per block), allocating blocks that don't
+ * exist. physically contiguous blocks are written with a single I/O.
+ *
+ * returns 0 if OK, otherwise -1
+ */
+int sfs_fs_inode_range_write(void* fs, struct sfs_fs_inode* inode,
+                             uint64_t iblock, uint64_t count,
+                             const void* const* blocks);
+
+/**
+ * frees the blocks of deallocated inodes and checkpoints the metadata |fs|
+ * keeps in memory (the superblock, bitmaps, group descriptors and inode blocks)
+ * into the buffer cache, then writes back the blocks of |fs| that have been
+ * dirty for at least |min_age_ms| milliseconds (all of them if 0), in batches
+ * sorted and merged into runs of adjacent blocks. |mu| is the lock callers of
+ * |fs| hold; it is held on entry and on return, but dropped while each batch
+ * is written.
+ *
+ * returns 0 if OK, otherwise -1
+ */
+int sfs_fs_writeback(void* fs, uint64_t min_age_ms, pthread_mutex_t* mu);
+
+/**
+ * writes back everything dirty in |fs|, including the metadata it keeps in
+ * memory, and waits for the disk to have it. |mu| is as for
+ * sfs_fs_writeback().
+ *
+ * returns 0 if OK, otherwise -1
+ */
+int sfs_fs_sync(void* fs, pthread_mutex_t* mu);
+
+/**
+ * returns how much of the buffer cache of |fs| is dirty, in percent
+ */
+uint64_t sfs_fs_dirty_percent(void* fs);
+
 /**
  * for an |inode| in |fs|, punch a hole in the logical file block |iblock|. if
  * that logical block didn't exist, consider action successful
@@ -157,6 +431,18 @@ int sfs_fs_inode_block_write(void* fs, struct sfs_fs_inode* inode,
 int sfs_fs_inode_block_remove(void* fs, struct sfs_fs_inode* inode,
                               uint64_t iblock);
 
+/**
+ * allocates up to |count| physically contiguous blocks in |fs|, starting at
+ * block |goal| if it is free and otherwise as close after it as free space
+ * allows: in the goal's allocation group if it has room, then in the groups
+ * after it. a |goal| of 0 means no preference. the first block is written to
+ * |first| and the number of blocks, at least 1, to |allocated|.
+ *
+ * returns 0 if OK, otherwise -1
+ */
+int sfs_fs_allocate_blocks(void* fs, uint64_t goal, uint64_t count,
+                           uint64_t* first, uint64_t* allocated);
+
 /**
  * finds a free block in |fs| and writes its block number to |block_number|
  *
@@ -0,0 +1,97 @@
+#include "geometry.h"
+
+#include <assert.h>
+#include <stddef.h>
+
+#include "dir.h"
+
+// block sizes that get their own copy of the code below
+#define SPECIALIZED_SIZES(F) F(512) F(4096) F(65536)
+
+// the bodies are written against a |block_size| argument. a specialized copy
+// passes a constant and the compiler folds the arithmetic.
+
+static inline void slice_body(uint64_t block_size, uint64_t offset,
+                              uint64_t size, struct sfs_slice* slice) {
+  assert(size > 0);
+  uint64_t last_block = (offset + size - 1) / block_size;
+  slice->first_block = offset / block_size;
+  slice->count = last_block - slice->first_block + 1;
+  slice->head_offset = offset % block_size;
+  slice->tail_len = (offset + size - 1) % block_size + 1;
+}
+
+static inline uint64_t find_entry_body(uint64_t block_size,
+                                       const struct sfs_dir_entry* entries,
+                                       uint64_t first, bool used) {
+  uint64_t count = block_size / sizeof(struct sfs_dir_entry);
+  for (uint64_t i = first; i < count; ++i) {
+    if ((entries[i].inumber != 0) == used) {
+      return i;
+    }
+  }
+  return count;
+}
+
+static void slice_generic(const struct sfs_geometry* geometry, uint64_t offset,
+                          uint64_t size, struct sfs_slice* slice) {
+  slice_body(geometry->block_size, offset, size, slice);
+}
+
+static uint64_t find_entry_generic(const struct sfs_geometry* geometry,
+                                   const struct sfs_dir_entry* entries,
+                                   uint64_t first, bool used) {
+  return find_entry_body(geometry->block_size, entries, first, used);
+}
+
+#define SPECIALIZE(bs)                                                      \
+  static void slice_##bs(const struct sfs_geometry* geometry,               \
+                         uint64_t offset, uint64_t size,                    \
+                         struct sfs_slice* slice) {                         \
+    (void)geometry;                                                         \
+    slice_body(bs, offset, size, slice);                                    \
+  }                                                                         \
+  static uint64_t find_entry_##bs(const struct sfs_geometry* geometry,      \
+                                  const struct sfs_dir_entry* entries,      \
+                                  uint64_t first, bool used) {              \
+    (void)geometry;                                                         \
+    return find_entry_body(bs, entries, first, used);                       \
+  }
+
+SPECIALIZED_SIZES(SPECIALIZE)
+
+void sfs_geometry_init_generic(struct sfs_geometry* geometry,
+                               uint32_t block_size) {
+  assert(geometry != NULL);
+
+  geometry->block_size = block_size;
+  geometry->pointers_per_block = block_size / sizeof(uint64_t);
+  geometry->entries_per_block = block_size / sizeof(struct sfs_dir_entry);
+  geometry->slice = slice_generic;
+  geometry->find_entry = find_entry_generic;
+}
+
+void sfs_geometry_init(struct sfs_geometry* geometry, uint32_t block_size) {
+  sfs_geometry_init_generic(geometry, block_size);
+
+  switch (block_size) {
+#define USE_SPECIALIZED(bs)                 \
+  case bs:                                  \
+    geometry->slice = slice_##bs;           \
+    geometry->find_entry = find_entry_##bs; \
+    break;
+    SPECIALIZED_SIZES(USE_SPECIALIZED)
+#undef USE_SPECIALIZED
+  }
+}
+
+bool sfs_geometry_is_specialized(uint32_t block_size) {
+  switch (block_size) {
+#define IS_SPECIALIZED(bs) \
+  case bs:                 \
+    return true;
+    SPECIALIZED_SIZES(IS_SPECIALIZED)
+#undef IS_SPECIALIZED
+  }
+  return false;
+}
@@ -0,0 +1,68 @@
+/**
+ * block size dependent arithmetic for the hot paths
+ *
+ * the common block sizes get their own copy of every function here, compiled
+ * with the block size as a constant so divisions become shifts and loop bounds
+ * are known. other sizes share a generic copy. the set to use is picked once,
+ * when the filesystem is mounted.
+ */
+
+#ifndef _GEOMETRY_H_
+#define _GEOMETRY_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct sfs_dir_entry;
+
+/**
+ * where a byte range of a file falls in its blocks
+ */
+struct sfs_slice {
+  uint64_t first_block;
+  uint64_t count;        // number of blocks the range touches
+  uint64_t head_offset;  // offset of the range in its first block
+  uint64_t tail_len;     // bytes of the range in its last block
+};
+
+struct sfs_geometry {
+  uint32_t block_size;
+  uint64_t pointers_per_block;  // block numbers in an index block
+  uint64_t entries_per_block;   // directory entries in a directory block
+
+  /**
+   * fills in |slice| for the |size| > 0 bytes at |offset|
+   */
+  void (*slice)(const struct sfs_geometry* geometry, uint64_t offset,
+                uint64_t size, struct sfs_slice* slice);
+
+  /**
+   * finds the first entry from |first| on in the directory block |entries|
+   * that is in use if |used|, or free otherwise
+   *
+   * returns the entry, or |entries_per_block| if there is none
+   */
+  uint64_t (*find_entry)(const struct sfs_geometry* geometry,
+                         const struct sfs_dir_entry* entries, uint64_t first,
+                         bool used);
+};
+
+/**
+ * sets up |geometry| for |block_size| byte blocks, with the specialized code
+ * if there is one for that size
+ */
+void sfs_geometry_init(struct sfs_geometry* geometry, uint32_t block_size);
+
+/**
+ * sets up |geometry| for |block_size| byte blocks, always with the generic
+ * code
+ */
+void sfs_geometry_init_generic(struct sfs_geometry* geometry,
+                               uint32_t block_size);
+
+/**
+ * returns true if |block_size| has specialized code
+ */
+bool sfs_geometry_is_specialized(uint32_t block_size);
+
+#endif  // _GEOMETRY_H_
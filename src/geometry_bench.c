@@ -0,0 +1,120 @@
+/**
+ * compares the code geometry.c specializes for the common block sizes with the
+ * generic code those sizes would get otherwise
+ *
+ * usage: geometry_bench [iterations]
+ */
+
+#include "geometry.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dir.h"
+
+#define DEFAULT_ITERATIONS 10000000
+// each measurement is the best of this many runs
+#define RUNS 5
+
+static const uint32_t block_sizes[] = {512, 4096, 65536};
+
+struct timings {
+  double slice_ns;    // per slice() call
+  double entry_ns;    // per directory entry scanned by find_entry()
+  uint64_t checksum;  // keeps the compiler from dropping the work
+};
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * keeps the fastest of |best| and |run| in |best|, or just |run| if |first|
+ */
+static void best_of(struct timings* best, const struct timings* run,
+                    bool first) {
+  if (first || run->slice_ns < best->slice_ns) best->slice_ns = run->slice_ns;
+  if (first || run->entry_ns < best->entry_ns) best->entry_ns = run->entry_ns;
+  best->checksum = run->checksum;
+}
+
+static void run(const struct sfs_geometry* geometry, uint64_t iterations,
+                struct timings* timings) {
+  uint64_t checksum = 0;
+
+  // offsets and sizes of a mix of small and large reads
+  uint64_t x = 88172645463325252llu;
+  double start = now_ns();
+  for (uint64_t i = 0; i < iterations; ++i) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    struct sfs_slice slice;
+    geometry->slice(geometry, x >> 24, (x & 0xfffff) + 1, &slice);
+    checksum += slice.first_block + slice.count + slice.head_offset +
+                slice.tail_len;
+  }
+  timings->slice_ns = (now_ns() - start) / iterations;
+
+  // worst case directory scan: only the last entry of the block is used
+  struct sfs_dir_entry* entries =
+      calloc(geometry->entries_per_block, sizeof(struct sfs_dir_entry));
+  entries[geometry->entries_per_block - 1].inumber = 1;
+  uint64_t scans = iterations / geometry->entries_per_block + 1;
+  start = now_ns();
+  for (uint64_t i = 0; i < scans; ++i) {
+    checksum += geometry->find_entry(geometry, entries, 0, true);
+  }
+  timings->entry_ns =
+      (now_ns() - start) / (scans * geometry->entries_per_block);
+  free(entries);
+
+  timings->checksum = checksum;
+}
+
+int main(int argc, char* argv[]) {
+  uint64_t iterations = DEFAULT_ITERATIONS;
+  if (argc > 1) {
+    iterations = strtoull(argv[1], NULL, 10);
+  }
+  if (iterations == 0) {
+    fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  printf("%10s %12s %10s %10s %8s\n", "block size", "code", "slice ns",
+         "entry ns", "speedup");
+  for (size_t i = 0; i < sizeof(block_sizes) / sizeof(block_sizes[0]); ++i) {
+    struct sfs_geometry generic, specialized;
+    sfs_geometry_init_generic(&generic, block_sizes[i]);
+    sfs_geometry_init(&specialized, block_sizes[i]);
+
+    struct timings g, s;
+    for (int r = 0; r < RUNS; ++r) {
+      struct timings gr, sr;
+      run(&generic, iterations, &gr);
+      run(&specialized, iterations, &sr);
+      if (gr.checksum != sr.checksum) {
+        fprintf(stderr, "generic and specialized code disagree at %" PRIu32
+                "\n", block_sizes[i]);
+        return EXIT_FAILURE;
+      }
+      best_of(&g, &gr, r == 0);
+      best_of(&s, &sr, r == 0);
+    }
+
+    double total_g = g.slice_ns + g.entry_ns;
+    double total_s = s.slice_ns + s.entry_ns;
+    printf("%10" PRIu32 " %12s %10.3f %10.3f\n", block_sizes[i], "generic",
+           g.slice_ns, g.entry_ns);
+    printf("%10" PRIu32 " %12s %10.3f %10.3f %7.2fx\n", block_sizes[i],
+           "specialized", s.slice_ns, s.entry_ns, total_g / total_s);
+  }
+
+  return EXIT_SUCCESS;
+}
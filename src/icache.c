@@ -0,0 +1,224 @@
+#include "icache.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "log.h"
+
+// cached blocks are hashed into this many buckets
+#define NBUCKETS 256
+
+/**
+ * one cached block, chained into a hash bucket by |next| and into the
+ * recency list by |newer| and |older|
+ */
+struct inode_block {
+  uint64_t block_number;
+  uint64_t refs;  // open inodes in the block
+  bool dirty;
+  char* data;
+
+  struct inode_block* next;
+  struct inode_block* newer;
+  struct inode_block* older;
+};
+
+struct icache {
+  uint32_t block_size;
+  uint64_t capacity;
+  uint64_t count;
+  struct inode_block* buckets[NBUCKETS];
+  struct inode_block* newest;
+  struct inode_block* oldest;
+};
+
+static struct inode_block** bucket_of(struct icache* ic,
+                                      uint64_t block_number) {
+  return &ic->buckets[(block_number * 11400714819323198485llu >> 32) %
+                      NBUCKETS];
+}
+
+static struct inode_block* find_block(struct icache* ic,
+                                      uint64_t block_number) {
+  struct inode_block* b = *bucket_of(ic, block_number);
+  while (b != NULL && b->block_number != block_number) {
+    b = b->next;
+  }
+  return b;
+}
+
+static void unlink_recency(struct icache* ic, struct inode_block* b) {
+  if (b->newer != NULL) {
+    b->newer->older = b->older;
+  } else {
+    ic->newest = b->older;
+  }
+  if (b->older != NULL) {
+    b->older->newer = b->newer;
+  } else {
+    ic->oldest = b->newer;
+  }
+  b->newer = NULL;
+  b->older = NULL;
+}
+
+static void push_newest(struct icache* ic, struct inode_block* b) {
+  b->older = ic->newest;
+  if (ic->newest != NULL) {
+    ic->newest->newer = b;
+  } else {
+    ic->oldest = b;
+  }
+  ic->newest = b;
+}
+
+/**
+ * takes |b| out of |ic| and frees it
+ */
+static void remove_block(struct icache* ic, struct inode_block* b) {
+  struct inode_block** p = bucket_of(ic, b->block_number);
+  while (*p != b) {
+    p = &(*p)->next;
+  }
+  *p = b->next;
+  unlink_recency(ic, b);
+  --ic->count;
+  free(b->data);
+  free(b);
+}
+
+void* sfs_icache_init(uint32_t block_size, uint64_t capacity) {
+  struct icache* ic = calloc(1, sizeof(struct icache));
+  if (ic == NULL) {
+    log_msg("malloc failure");
+    return NULL;
+  }
+  ic->block_size = block_size;
+  ic->capacity = capacity > 0 ? capacity : 1;
+  return ic;
+}
+
+void sfs_icache_deinit(void* arg) {
+  struct icache* ic = (struct icache*)arg;
+  assert(ic != NULL);
+
+  while (ic->newest != NULL) {
+    remove_block(ic, ic->newest);
+  }
+  free(ic);
+}
+
+void* sfs_icache_get(void* arg, uint64_t block_number) {
+  struct icache* ic = (struct icache*)arg;
+  assert(ic != NULL);
+
+  struct inode_block* b = find_block(ic, block_number);
+  if (b == NULL) {
+    return NULL;
+  }
+  if (b != ic->newest) {
+    unlink_recency(ic, b);
+    push_newest(ic, b);
+  }
+  return b->data;
+}
+
+void* sfs_icache_add(void* arg, uint64_t block_number,
+                     int (*write)(uint64_t, const void*, void*),
+                     void* write_arg) {
+  struct icache* ic = (struct icache*)arg;
+  assert(ic != NULL);
+  assert(write != NULL);
+  assert(find_block(ic, block_number) == NULL);
+
+  if (ic->count >= ic->capacity) {
+    // with every block pinned the cache grows past its capacity instead
+    struct inode_block* victim = ic->oldest;
+    while (victim != NULL && victim->refs > 0) {
+      victim = victim->newer;
+    }
+    if (victim != NULL) {
+      if (victim->dirty &&
+          write(victim->block_number, victim->data, write_arg)) {
+        log_msg("error writing back inode block %" PRIu64,
+                victim->block_number);
+        return NULL;
+      }
+      remove_block(ic, victim);
+    }
+  }
+
+  struct inode_block* b = calloc(1, sizeof(struct inode_block));
+  char* data = malloc(ic->block_size);
+  if (b == NULL || data == NULL) {
+    log_msg("malloc failure");
+    free(b);
+    free(data);
+    return NULL;
+  }
+  b->block_number = block_number;
+  b->data = data;
+  struct inode_block** bucket = bucket_of(ic, block_number);
+  b->next = *bucket;
+  *bucket = b;
+  push_newest(ic, b);
+  ++ic->count;
+  return b->data;
+}
+
+void sfs_icache_drop(void* arg, uint64_t block_number) {
+  struct icache* ic = (struct icache*)arg;
+  assert(ic != NULL);
+
+  struct inode_block* b = find_block(ic, block_number);
+  if (b != NULL) {
+    remove_block(ic, b);
+  }
+}
+
+void sfs_icache_mark_dirty(void* arg, uint64_t block_number) {
+  struct icache* ic = (struct icache*)arg;
+  assert(ic != NULL);
+
+  struct inode_block* b = find_block(ic, block_number);
+  assert(b != NULL);
+  b->dirty = true;
+}
+
+void sfs_icache_hold(void* arg, uint64_t block_number) {
+  struct icache* ic = (struct icache*)arg;
+  assert(ic != NULL);
+
+  struct inode_block* b = find_block(ic, block_number);
+  assert(b != NULL);
+  ++b->refs;
+}
+
+void sfs_icache_put(void* arg, uint64_t block_number) {
+  struct icache* ic = (struct icache*)arg;
+  assert(ic != NULL);
+
+  struct inode_block* b = find_block(ic, block_number);
+  assert(b != NULL && b->refs > 0);
+  --b->refs;
+}
+
+int sfs_icache_flush(void* arg, int (*write)(uint64_t, const void*, void*),
+                     void* write_arg) {
+  struct icache* ic = (struct icache*)arg;
+  assert(ic != NULL);
+  assert(write != NULL);
+
+  for (struct inode_block* b = ic->oldest; b != NULL; b = b->newer) {
+    if (b->dirty) {
+      if (write(b->block_number, b->data, write_arg)) {
+        log_msg("error writing back inode block %" PRIu64, b->block_number);
+        return -1;
+      }
+      b->dirty = false;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,77 @@
+/**
+ * a write-back cache of inode table blocks
+ *
+ * inodes are read and written in the copies of their blocks kept here, which
+ * only reach the buffer cache when they are evicted or flushed. blocks are
+ * hashed by number and, once there are more of them than the cache was sized
+ * for, evicted least recently used first. a block holding an open inode is
+ * pinned by its references and never evicted.
+ *
+ * nothing here does I/O; dirty blocks are handed to a callback of the
+ * filesystem's. nothing here is threadsafe either; callers hold the
+ * filesystem lock
+ */
+
+#ifndef _ICACHE_H_
+#define _ICACHE_H_
+
+#include <stdint.h>
+
+/**
+ * initializes an empty cache of blocks of |block_size| bytes, which evicts
+ * blocks once it holds |capacity| of them
+ *
+ * returns opaque pointer to the cache on success, NULL on failure
+ */
+void* sfs_icache_init(uint32_t block_size, uint64_t capacity);
+
+/**
+ * frees |ic|. dirty blocks are thrown away.
+ */
+void sfs_icache_deinit(void* ic);
+
+/**
+ * returns the copy of block |block_number| in |ic|, which becomes the most
+ * recently used, or NULL if it isn't cached
+ */
+void* sfs_icache_get(void* ic, uint64_t block_number);
+
+/**
+ * adds block |block_number|, which isn't cached, to |ic|. if |ic| is full,
+ * the least recently used block that isn't pinned is evicted first, and
+ * passed to |write| with |write_arg| if it is dirty.
+ *
+ * returns the buffer of the new block, for the caller to fill in, or NULL on
+ * failure
+ */
+void* sfs_icache_add(void* ic, uint64_t block_number,
+                     int (*write)(uint64_t, const void*, void*),
+                     void* write_arg);
+
+/**
+ * removes block |block_number| from |ic| without writing it back
+ */
+void sfs_icache_drop(void* ic, uint64_t block_number);
+
+/**
+ * marks cached block |block_number| as changed
+ */
+void sfs_icache_mark_dirty(void* ic, uint64_t block_number);
+
+/**
+ * pins cached block |block_number| in |ic| until a matching sfs_icache_put()
+ */
+void sfs_icache_hold(void* ic, uint64_t block_number);
+
+void sfs_icache_put(void* ic, uint64_t block_number);
+
+/**
+ * passes every dirty block of |ic| to |write| with |write_arg|, after which
+ * they are clean. they stay cached.
+ *
+ * returns 0 if OK, otherwise -1
+ */
+int sfs_icache_flush(void* ic, int (*write)(uint64_t, const void*, void*),
+                     void* write_arg);
+
+#endif  // _ICACHE_H_
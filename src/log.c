@@ -23,9 +23,10 @@
 
 #include "log.h"
 
-FILE *log_open() {
-  FILE *logfile;
+// kept here as well as in the fuse private data, for log_file()
+static FILE *logfile;
 
+FILE *log_open() {
   // very first thing, open up the logfile and mark that we got in
   // here.  If we can't open the logfile, we're dead.
   logfile = fopen("sfs.log", "w");
@@ -40,6 +41,8 @@ FILE *log_open() {
   return logfile;
 }
 
+FILE *log_file() { return logfile; }
+
 // fuse context
 void log_fuse_context_impl(LOG_CONTEXT_PARAMS, struct fuse_context *context) {
   log_msg_impl("struct fuse_context:", LOG_CONTEXT_ARGS);
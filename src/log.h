@@ -16,11 +16,10 @@
 #include "params.h"
 
 //  macro to log fields in structs.
-#define log_struct_impl(st, field, format, cast)                \
-  do {                                                          \
-    fprintf(SFS_DATA->logfile, "    " #field " = " format "\n", \
-            cast(st)->field);                                   \
-    fflush(SFS_DATA->logfile);                                  \
+#define log_struct_impl(st, field, format, cast)                           \
+  do {                                                                     \
+    fprintf(log_file(), "    " #field " = " format "\n", cast(st)->field); \
+    fflush(log_file());                                                    \
   } while (0);
 #define log_struct_with_cast(st, field, format, cast) \
   log_struct_impl(st, field, format, (cast))
@@ -28,10 +27,14 @@
 
 FILE *log_open(void);
 
-#define log_msg_impl(fmt, ...)                                       \
-  do {                                                               \
-    fprintf(SFS_DATA->logfile, "%s:%u [%s] " fmt "\n", __VA_ARGS__); \
-    fflush(SFS_DATA->logfile);                                       \
+// the file log_open() opened. unlike SFS_DATA, this also works on threads
+// that fuse didn't start.
+FILE *log_file(void);
+
+#define log_msg_impl(fmt, ...)                                \
+  do {                                                        \
+    fprintf(log_file(), "%s:%u [%s] " fmt "\n", __VA_ARGS__); \
+    fflush(log_file());                                       \
   } while (0);
 #define log_msg_helper(fmt, ...) \
   log_msg_impl(fmt "%s", __FILE__, __LINE__, __func__, __VA_ARGS__)
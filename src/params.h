@@ -28,13 +28,25 @@
 // maintain bbfs state in here
 #include <limits.h>
 #include <stdio.h>
+
+#include "fs.h"
+
 struct sfs_state {
   pthread_mutex_t mu;
   FILE* logfile;
   int disk;
   const char* diskfile;
+  struct sfs_fs_options fs_options;
+  // zero means the default for these
+  unsigned readahead_kb;     // largest readahead window
+  unsigned dirty_expire_ms;  // age at which dirty blocks are written back
+  unsigned dirty_ratio;      // percent of the cache that can be dirty
   void* fd_pool;
   void* fs;
+  // two blocks, for the partial blocks at either end of a read or write
+  char* bounce;
+  void* readahead;
+  void* flusher;
 };
 
 #define SFS_DATA ((struct sfs_state*)fuse_get_context()->private_data)
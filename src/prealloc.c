@@ -0,0 +1,115 @@
+#include "prealloc.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include "log.h"
+
+// open inodes are hashed into this many buckets
+#define NBUCKETS 64
+
+/**
+ * the window of one open inode, chained into a hash bucket by |next|
+ */
+struct open_inode {
+  uint64_t inumber;
+  uint64_t opens;
+  struct sfs_prealloc_window window;
+  struct open_inode* next;
+};
+
+struct prealloc {
+  struct open_inode* buckets[NBUCKETS];
+};
+
+static struct open_inode** bucket_of(struct prealloc* pa, uint64_t inumber) {
+  return &pa->buckets[(inumber * 11400714819323198485llu >> 32) % NBUCKETS];
+}
+
+static struct open_inode* find_inode(struct prealloc* pa, uint64_t inumber) {
+  struct open_inode* in = *bucket_of(pa, inumber);
+  while (in != NULL && in->inumber != inumber) {
+    in = in->next;
+  }
+  return in;
+}
+
+void* sfs_prealloc_init(void) {
+  return calloc(1, sizeof(struct prealloc));
+}
+
+void sfs_prealloc_deinit(void* arg) {
+  struct prealloc* pa = (struct prealloc*)arg;
+  assert(pa != NULL);
+
+  for (int i = 0; i < NBUCKETS; ++i) {
+    while (pa->buckets[i] != NULL) {
+      struct open_inode* in = pa->buckets[i];
+      pa->buckets[i] = in->next;
+      free(in);
+    }
+  }
+  free(pa);
+}
+
+int sfs_prealloc_open(void* arg, uint64_t inumber) {
+  struct prealloc* pa = (struct prealloc*)arg;
+  assert(pa != NULL);
+
+  struct open_inode* in = find_inode(pa, inumber);
+  if (in == NULL) {
+    in = calloc(1, sizeof(struct open_inode));
+    if (in == NULL) {
+      log_msg("malloc failure");
+      return -1;
+    }
+    in->inumber = inumber;
+    struct open_inode** bucket = bucket_of(pa, inumber);
+    in->next = *bucket;
+    *bucket = in;
+  }
+  ++in->opens;
+  return 0;
+}
+
+bool sfs_prealloc_release(void* arg, uint64_t inumber,
+                          struct sfs_prealloc_window* window) {
+  struct prealloc* pa = (struct prealloc*)arg;
+  assert(pa != NULL);
+  assert(window != NULL);
+
+  struct open_inode** it = bucket_of(pa, inumber);
+  while (*it != NULL && (*it)->inumber != inumber) {
+    it = &(*it)->next;
+  }
+  struct open_inode* in = *it;
+  if (in == NULL || --in->opens > 0) {
+    return false;
+  }
+  *it = in->next;
+  *window = in->window;
+  free(in);
+  return true;
+}
+
+struct sfs_prealloc_window* sfs_prealloc_get(void* arg, uint64_t inumber) {
+  struct prealloc* pa = (struct prealloc*)arg;
+  assert(pa != NULL);
+
+  struct open_inode* in = find_inode(pa, inumber);
+  return in != NULL ? &in->window : NULL;
+}
+
+void sfs_prealloc_foreach(void* arg,
+                          void (*fn)(struct sfs_prealloc_window*, void*),
+                          void* fn_arg) {
+  struct prealloc* pa = (struct prealloc*)arg;
+  assert(pa != NULL);
+  assert(fn != NULL);
+
+  for (int i = 0; i < NBUCKETS; ++i) {
+    for (struct open_inode* in = pa->buckets[i]; in != NULL; in = in->next) {
+      fn(&in->window, fn_arg);
+    }
+  }
+}
@@ -0,0 +1,72 @@
+/**
+ * speculative preallocation for open files
+ *
+ * every open file has a window of free blocks set aside right after its last
+ * allocated block. its next allocations are taken from the front of the
+ * window, so a file that is appended to a little at a time stays contiguous
+ * even while other files are allocating. each time a window runs out, the
+ * next one is twice as big. what is left of it is given back when the file is
+ * closed for the last time.
+ *
+ * this only keeps the windows; the filesystem takes their blocks out of the
+ * bitmap and gives them back. nothing here is threadsafe; callers hold the
+ * filesystem lock
+ */
+
+#ifndef _PREALLOC_H_
+#define _PREALLOC_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * the window of one open file. all zeros is a file that has no window yet.
+ */
+struct sfs_prealloc_window {
+  uint64_t start;  // first block of the window
+  uint64_t count;  // blocks left in it
+  uint64_t size;   // blocks to set aside for the next window
+};
+
+/**
+ * initializes an empty set of windows
+ *
+ * returns opaque pointer to the set on success, NULL on failure
+ */
+void* sfs_prealloc_init(void);
+
+/**
+ * frees |pa|. the blocks of its windows are not given back.
+ */
+void sfs_prealloc_deinit(void* pa);
+
+/**
+ * records that inode |inumber| was opened, giving it an empty window if it
+ * isn't open already
+ *
+ * returns 0 if OK, otherwise -1
+ */
+int sfs_prealloc_open(void* pa, uint64_t inumber);
+
+/**
+ * records that inode |inumber| was closed. if that was its last open, its
+ * window is copied to |window| and forgotten.
+ *
+ * returns true if the window was forgotten, otherwise false
+ */
+bool sfs_prealloc_release(void* pa, uint64_t inumber,
+                          struct sfs_prealloc_window* window);
+
+/**
+ * returns the window of inode |inumber|, or NULL if it isn't open
+ */
+struct sfs_prealloc_window* sfs_prealloc_get(void* pa, uint64_t inumber);
+
+/**
+ * calls |fn| with |arg| on every window of |pa|
+ */
+void sfs_prealloc_foreach(void* pa,
+                          void (*fn)(struct sfs_prealloc_window*, void*),
+                          void* arg);
+
+#endif  // _PREALLOC_H_
@@ -0,0 +1,182 @@
+#include "readahead.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "fs.h"
+#include "log.h"
+
+// requests waiting for the thread; more are dropped until it catches up
+#define QUEUE_SIZE 64
+// window of a file that has just started reading sequentially
+#define INITIAL_WINDOW_BYTES (32 * 1024)
+
+/**
+ * blocks [iblock, iblock + count) of inode |inumber|, to be read ahead
+ */
+struct request {
+  uint64_t inumber;
+  uint64_t iblock;
+  uint64_t count;
+};
+
+struct readahead {
+  void* fs;
+  pthread_mutex_t* fs_mu;
+
+  // window sizes, in blocks
+  uint64_t initial_window;
+  uint64_t max_window;
+
+  pthread_t thread;
+
+  // |mu| guards the rest; |cond| is signaled when a request is queued or the
+  // thread should stop
+  pthread_mutex_t mu;
+  pthread_cond_t cond;
+  bool stopping;
+  uint64_t head;  // requests [head, tail) are queued
+  uint64_t tail;
+  struct request queue[QUEUE_SIZE];
+};
+
+static void* run(void* arg) {
+  struct readahead* ra = (struct readahead*)arg;
+
+  pthread_mutex_lock(&ra->mu);
+  while (!ra->stopping) {
+    if (ra->head == ra->tail) {
+      pthread_cond_wait(&ra->cond, &ra->mu);
+      continue;
+    }
+    struct request req = ra->queue[ra->head++ % QUEUE_SIZE];
+    pthread_mutex_unlock(&ra->mu);
+
+    pthread_mutex_lock(ra->fs_mu);
+    if (sfs_fs_inode_readahead(ra->fs, req.inumber, req.iblock, req.count,
+                               ra->fs_mu)) {
+      log_msg("readahead of iblocks %" PRIu64 "+%" PRIu64
+              " of inode %" PRIu64 " failed",
+              req.iblock, req.count, req.inumber);
+    }
+    pthread_mutex_unlock(ra->fs_mu);
+
+    pthread_mutex_lock(&ra->mu);
+  }
+  pthread_mutex_unlock(&ra->mu);
+
+  return NULL;
+}
+
+void* sfs_readahead_init(void* fs, pthread_mutex_t* mu, uint64_t max_bytes) {
+  assert(fs != NULL);
+  assert(mu != NULL);
+
+  struct readahead* ra = malloc(sizeof(struct readahead));
+  if (ra == NULL) {
+    return NULL;
+  }
+
+  ra->fs = fs;
+  ra->fs_mu = mu;
+  uint64_t block_size = sfs_fs_geometry(fs)->block_size;
+  ra->initial_window = INITIAL_WINDOW_BYTES / block_size;
+  if (ra->initial_window == 0) {
+    ra->initial_window = 1;
+  }
+  ra->max_window = max_bytes / block_size;
+  if (ra->max_window < ra->initial_window) {
+    ra->max_window = ra->initial_window;
+  }
+  ra->stopping = false;
+  ra->head = ra->tail = 0;
+
+  if (pthread_mutex_init(&ra->mu, NULL)) {
+    free(ra);
+    return NULL;
+  }
+  if (pthread_cond_init(&ra->cond, NULL)) {
+    pthread_mutex_destroy(&ra->mu);
+    free(ra);
+    return NULL;
+  }
+  if (pthread_create(&ra->thread, NULL, run, ra)) {
+    pthread_cond_destroy(&ra->cond);
+    pthread_mutex_destroy(&ra->mu);
+    free(ra);
+    return NULL;
+  }
+
+  log_msg("reading ahead up to %" PRIu64 " blocks", ra->max_window);
+  return ra;
+}
+
+void sfs_readahead_deinit(void* arg) {
+  struct readahead* ra = (struct readahead*)arg;
+  assert(ra != NULL);
+
+  pthread_mutex_lock(&ra->mu);
+  ra->stopping = true;
+  pthread_cond_signal(&ra->cond);
+  pthread_mutex_unlock(&ra->mu);
+  pthread_join(ra->thread, NULL);
+
+  pthread_cond_destroy(&ra->cond);
+  pthread_mutex_destroy(&ra->mu);
+  free(ra);
+}
+
+void sfs_readahead_update(void* arg, struct sfs_readahead_state* state,
+                          uint64_t inumber, uint64_t first_block,
+                          uint64_t count) {
+  struct readahead* ra = (struct readahead*)arg;
+  assert(state != NULL);
+  if (ra == NULL) {
+    return;
+  }
+
+  // small reads end in the block the next one starts in
+  bool sequential = first_block == state->next_block ||
+                    first_block + 1 == state->next_block;
+  if (sequential) {
+    if (state->window == 0) {
+      state->window = ra->initial_window;
+    } else if (state->window < ra->max_window) {
+      state->window *= 2;
+      if (state->window > ra->max_window) {
+        state->window = ra->max_window;
+      }
+    }
+  } else {
+    state->window /= 2;
+    if (state->window < ra->initial_window) {
+      state->window = 0;
+    }
+    state->ahead = 0;
+  }
+  state->next_block = first_block + count;
+  if (state->window == 0) {
+    return;
+  }
+
+  // top the window up in big pieces rather than a few blocks per read
+  uint64_t start =
+      state->ahead > state->next_block ? state->ahead : state->next_block;
+  uint64_t end = state->next_block + state->window;
+  if (start >= end || end - start < state->window / 2) {
+    return;
+  }
+
+  pthread_mutex_lock(&ra->mu);
+  if (ra->tail - ra->head < QUEUE_SIZE) {
+    struct request* req = &ra->queue[ra->tail++ % QUEUE_SIZE];
+    req->inumber = inumber;
+    req->iblock = start;
+    req->count = end - start;
+    state->ahead = end;
+    pthread_cond_signal(&ra->cond);
+  }
+  pthread_mutex_unlock(&ra->mu);
+}
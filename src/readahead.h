@@ -0,0 +1,51 @@
+/**
+ * adaptive readahead for open files
+ *
+ * every open file remembers where its last read ended. a read that picks up
+ * there is sequential and grows the file's readahead window; any other read
+ * shrinks it, down to nothing. blocks in the window are read into the buffer
+ * cache by a background thread, so the reads that follow hit the cache.
+ */
+
+#ifndef _READAHEAD_H_
+#define _READAHEAD_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+/**
+ * readahead state of one open file. all zeros is a freshly opened file.
+ */
+struct sfs_readahead_state {
+  uint64_t next_block;  // logical block a sequential read starts at
+  uint64_t window;      // blocks to keep ahead of the reader; 0 if random
+  uint64_t ahead;       // blocks before this one have been asked for already
+};
+
+/**
+ * starts a readahead thread for the filesystem |fs|, whose callers serialize
+ * on |mu|. windows grow up to |max_bytes|.
+ *
+ * returns opaque pointer to the readahead state on success, NULL on failure
+ */
+void* sfs_readahead_init(void* fs, pthread_mutex_t* mu, uint64_t max_bytes);
+
+/**
+ * stops the readahead thread and frees memory used by |ra|. must be called
+ * without holding the filesystem lock, before the filesystem is closed.
+ */
+void sfs_readahead_deinit(void* ra);
+
+/**
+ * records a read of the |count| logical blocks starting at |first_block| of
+ * inode |inumber| through the open file with readahead state |state|, and
+ * queues blocks past it if the file is being read sequentially. nothing is
+ * read here. |ra| may be NULL, in which case this does nothing.
+ *
+ * called with the filesystem lock held
+ */
+void sfs_readahead_update(void* ra, struct sfs_readahead_state* state,
+                          uint64_t inumber, uint64_t first_block,
+                          uint64_t count);
+
+#endif  // _READAHEAD_H_
@@ -0,0 +1,72 @@
+#include "reclaim.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include "log.h"
+
+/**
+ * a ring of inode numbers, |count| of them starting at |head|
+ */
+struct reclaim {
+  uint64_t* inumbers;
+  uint64_t capacity;
+  uint64_t head;
+  uint64_t count;
+};
+
+void* sfs_reclaim_init(void) {
+  return calloc(1, sizeof(struct reclaim));
+}
+
+void sfs_reclaim_deinit(void* arg) {
+  struct reclaim* rq = (struct reclaim*)arg;
+  assert(rq != NULL);
+
+  free(rq->inumbers);
+  free(rq);
+}
+
+int sfs_reclaim_put(void* arg, uint64_t inumber) {
+  struct reclaim* rq = (struct reclaim*)arg;
+  assert(rq != NULL);
+
+  if (rq->count == rq->capacity) {
+    uint64_t capacity = rq->capacity ? rq->capacity * 2 : 64;
+    uint64_t* inumbers = malloc(capacity * sizeof(uint64_t));
+    if (inumbers == NULL) {
+      log_msg("malloc failure");
+      return -1;
+    }
+    for (uint64_t i = 0; i < rq->count; ++i) {
+      inumbers[i] = rq->inumbers[(rq->head + i) % rq->capacity];
+    }
+    free(rq->inumbers);
+    rq->inumbers = inumbers;
+    rq->capacity = capacity;
+    rq->head = 0;
+  }
+  rq->inumbers[(rq->head + rq->count) % rq->capacity] = inumber;
+  ++rq->count;
+  return 0;
+}
+
+uint64_t sfs_reclaim_take(void* arg, uint64_t* inumbers, uint64_t max) {
+  struct reclaim* rq = (struct reclaim*)arg;
+  assert(rq != NULL);
+  assert(inumbers != NULL);
+
+  uint64_t n = rq->count < max ? rq->count : max;
+  for (uint64_t i = 0; i < n; ++i) {
+    inumbers[i] = rq->inumbers[rq->head];
+    rq->head = (rq->head + 1) % rq->capacity;
+  }
+  rq->count -= n;
+  return n;
+}
+
+uint64_t sfs_reclaim_count(void* arg) {
+  struct reclaim* rq = (struct reclaim*)arg;
+  assert(rq != NULL);
+  return rq->count;
+}
@@ -0,0 +1,49 @@
+/**
+ * inodes waiting for their blocks to be freed
+ *
+ * deleting a file only puts its inode here, so unlink and the last close
+ * return without touching the file's blocks. the filesystem frees the blocks
+ * of everything queued in the background, a batch of inodes at a time, and
+ * only then the inodes themselves.
+ *
+ * nothing here is threadsafe; callers hold the filesystem lock
+ */
+
+#ifndef _RECLAIM_H_
+#define _RECLAIM_H_
+
+#include <stdint.h>
+
+/**
+ * initializes an empty queue
+ *
+ * returns opaque pointer to the queue on success, NULL on failure
+ */
+void* sfs_reclaim_init(void);
+
+/**
+ * frees |rq|. the inodes still in it are forgotten.
+ */
+void sfs_reclaim_deinit(void* rq);
+
+/**
+ * puts inode |inumber| on the end of |rq|
+ *
+ * returns 0 if OK, otherwise -1
+ */
+int sfs_reclaim_put(void* rq, uint64_t inumber);
+
+/**
+ * takes up to |max| inodes off the front of |rq| and writes their numbers to
+ * |inumbers|
+ *
+ * returns how many were taken
+ */
+uint64_t sfs_reclaim_take(void* rq, uint64_t* inumbers, uint64_t max);
+
+/**
+ * returns the number of inodes in |rq|
+ */
+uint64_t sfs_reclaim_count(void* rq);
+
+#endif  // _RECLAIM_H_
@@ -16,10 +16,12 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <fuse.h>
+#include <fuse_opt.h>
 #include <inttypes.h>
 #include <libgen.h>
 #include <limits.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -32,8 +34,16 @@
 
 #include "dir.h"
 #include "filedescriptor.h"
+#include "flusher.h"
 #include "fs.h"
 #include "log.h"
+#include "readahead.h"
+
+// largest readahead window when the mount options don't give one
+#define DEFAULT_READAHEAD_KB 1024
+// how long blocks stay dirty and how much of the cache can be, likewise
+#define DEFAULT_DIRTY_EXPIRE_MS 5000
+#define DEFAULT_DIRTY_RATIO 20
 
 ///////////////////////////////////////////////////////////
 //
@@ -68,7 +78,8 @@ void *sfs_init(struct fuse_conn_info *conn) {
   }
 
   // opens `diskfile` and creates a new filesystem if none is detected
-  sfs_data->fs = sfs_fs_open_disk(sfs_data->disk, true);
+  sfs_data->fs =
+      sfs_fs_open_disk(sfs_data->disk, true, &sfs_data->fs_options);
   if (sfs_data->fs == NULL) {
     perror("sfs_fs_open_diskfile()");
     kill(getpid(), SIGTERM);
@@ -76,6 +87,38 @@ void *sfs_init(struct fuse_conn_info *conn) {
     return sfs_data;
   }
 
+  // block sized, so it would be too big for the stack of FUSE threads
+  sfs_data->bounce = malloc(2 * sfs_fs_geometry(sfs_data->fs)->block_size);
+  if (sfs_data->bounce == NULL) {
+    perror("malloc()");
+    kill(getpid(), SIGTERM);
+    SFS_UNLOCK_OR_FAIL(sfs_data, NULL);
+    return sfs_data;
+  }
+
+  // reads still work without readahead, just slower
+  uint64_t readahead_kb =
+      sfs_data->readahead_kb ? sfs_data->readahead_kb : DEFAULT_READAHEAD_KB;
+  sfs_data->readahead =
+      sfs_readahead_init(sfs_data->fs, &sfs_data->mu, readahead_kb << 10);
+  if (sfs_data->readahead == NULL) {
+    log_msg("unable to start readahead");
+  }
+
+  // without the thread, dirty blocks still go out on eviction and unmount
+  uint64_t expire_ms = sfs_data->dirty_expire_ms ? sfs_data->dirty_expire_ms
+                                                 : DEFAULT_DIRTY_EXPIRE_MS;
+  unsigned dirty_ratio =
+      sfs_data->dirty_ratio ? sfs_data->dirty_ratio : DEFAULT_DIRTY_RATIO;
+  if (dirty_ratio > 100) {
+    dirty_ratio = 100;
+  }
+  sfs_data->flusher =
+      sfs_flusher_init(sfs_data->fs, &sfs_data->mu, expire_ms, dirty_ratio);
+  if (sfs_data->flusher == NULL) {
+    log_msg("unable to start writeback");
+  }
+
   SFS_UNLOCK_OR_FAIL(sfs_data, NULL);
   return sfs_data;
 }
@@ -92,6 +135,15 @@ void sfs_destroy(void *userdata) {
 
   if (sfs_data == NULL) return;
 
+  // the readahead and writeback threads take the lock themselves, so stop
+  // them first
+  if (sfs_data->readahead != NULL) {
+    sfs_readahead_deinit(sfs_data->readahead);
+  }
+  if (sfs_data->flusher != NULL) {
+    sfs_flusher_deinit(sfs_data->flusher);
+  }
+
   SFS_LOCK_OR_FAIL(sfs_data, );
 
   log_msg("userdata=%p", userdata);
@@ -108,6 +160,8 @@ void sfs_destroy(void *userdata) {
     sfs_filedescriptor_pool_deinit(sfs_data->fd_pool);
   }
 
+  free(sfs_data->bounce);
+
   log_msg("successfully cleaned up");
   fclose(sfs_data->logfile);
   SFS_UNLOCK_OR_FAIL(sfs_data, );
@@ -369,7 +423,7 @@ int sfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
 
   // `inode` still represents the directory here
   if (found_inumber == 0) {
-    if (sfs_fs_inode_allocate(sfs_data->fs, &file)) {
+    if (sfs_fs_inode_allocate(sfs_data->fs, directory.inumber, &file)) {
       SFS_UNLOCK_OR_FAIL(sfs_data, -1);
       return -EDQUOT;  // no more inodes
     }
@@ -399,9 +453,14 @@ int sfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
     }
   }
 
+  if (sfs_fs_inode_open(sfs_data->fs, found_inumber)) {
+    SFS_UNLOCK_OR_FAIL(sfs_data, -1);
+    return -ENOMEM;
+  }
   struct sfs_fd *fd = sfs_filedescriptor_allocate(sfs_data->fd_pool);
   if (fd == NULL) {
     // should fail more gracefully
+    sfs_fs_inode_release(sfs_data->fs, found_inumber);
     SFS_UNLOCK_OR_FAIL(sfs_data, -1);
     return -ENOMEM;
   }
@@ -576,9 +635,14 @@ int sfs_open(const char *path, struct fuse_file_info *fi) {
         return -1;
       }
 
+      if (sfs_fs_inode_open(sfs_data->fs, file.inumber)) {
+        SFS_UNLOCK_OR_FAIL(sfs_data, -1);
+        return -ENOMEM;
+      }
       struct sfs_fd *fd = sfs_filedescriptor_allocate(sfs_data->fd_pool);
       if (fd == NULL) {
         // should fail more gracefully
+        sfs_fs_inode_release(sfs_data->fs, file.inumber);
         SFS_UNLOCK_OR_FAIL(sfs_data, -1);
         return -ENOMEM;
       }
@@ -631,6 +695,9 @@ int sfs_release(const char *path, struct fuse_file_info *fi) {
   log_struct(fd, inumber, "%" PRIu64);
   log_struct(fd, flags, "%" PRIu64);
 
+  // the blocks set aside for appends to the file go back to the free pool
+  sfs_fs_inode_release(sfs_data->fs, fd->inumber);
+
   // decrease the link count (deallocate inode if 0 links)
   struct sfs_fs_inode inode;
   log_msg("inumber %" PRIu64, fd->inumber);
@@ -700,55 +767,77 @@ int sfs_read(const char *path, char *buf, size_t size, off_t offset,
     SFS_UNLOCK_OR_FAIL(sfs_data, -1);
     return -1;
   }
-  inode.access_time = time(NULL);
-  if (sfs_fs_write_inode(sfs_data->fs, &inode)) {
+  if (sfs_fs_inode_touch(sfs_data->fs, &inode) &&
+      sfs_fs_write_inode(sfs_data->fs, &inode)) {
     log_msg("sfs_read() error writing inode %" PRIu64, fd->inumber);
     SFS_UNLOCK_OR_FAIL(sfs_data, -1);
     return -1;
   }
 
-  uint64_t first_block = offset / BLOCK_SIZE;
-  uint64_t first_block_offset = offset % BLOCK_SIZE;
-  uint64_t last_block_len = (offset + size) % BLOCK_SIZE;
-  last_block_len = last_block_len == 0 ? BLOCK_SIZE : last_block_len;
-  uint64_t last_block = (offset + size) / BLOCK_SIZE;
-  last_block -= last_block_len == BLOCK_SIZE ? 1 : 0;
-
-  log_msg(
-      "first_block=%llu first_block_offset=%llu last_block_len=%llu "
-      "last_block=%llu",
-      first_block, first_block_offset, last_block_len, last_block);
-
-  // adjust |buf| to be BLOCK_SIZE aligned
-  buf -= first_block_offset;
+  // don't read past the end of the file
+  if ((uint64_t)offset >= inode.size) {
+    SFS_UNLOCK_OR_FAIL(sfs_data, -1);
+    return 0;
+  }
+  if (offset + size > inode.size) {
+    size = inode.size - offset;
+  }
 
-  sfs_block_t tmp_block;
-  for (uint64_t iblock = first_block; iblock <= last_block; ++iblock) {
-    uint64_t slice_a = 0;
-    uint64_t slice_b = BLOCK_SIZE;
-    if (iblock == first_block && first_block_offset != 0) {
-      slice_a = first_block_offset;
-    }
-    if (iblock == last_block && last_block_len != BLOCK_SIZE) {
-      slice_b = last_block_len;
-    }
+  const struct sfs_geometry *geometry = sfs_fs_geometry(sfs_data->fs);
+  uint64_t block_size = geometry->block_size;
+  struct sfs_slice slice;
+  geometry->slice(geometry, offset, size, &slice);
+  uint64_t first_block = slice.first_block;
+  uint64_t last_block = first_block + slice.count - 1;
+  uint64_t count = slice.count;
+  uint64_t head_offset = slice.head_offset;
+  uint64_t tail_len = slice.tail_len;
+
+  log_msg("first_block=%" PRIu64 " last_block=%" PRIu64 " head_offset=%" PRIu64
+          " tail_len=%" PRIu64,
+          first_block, last_block, head_offset, tail_len);
+
+  void **blocks = malloc(count * sizeof(void *));
+  if (blocks == NULL) {
+    SFS_UNLOCK_OR_FAIL(sfs_data, -1);
+    return -ENOMEM;
+  }
 
-    void *target = slice_a == 0 && slice_b == BLOCK_SIZE
-                       ? (buf + iblock * BLOCK_SIZE)
-                       : tmp_block;
+  // whole blocks are read straight into |buf|; partial ones at either end go
+  // through the bounce buffer, which the lock keeps to this call
+  char *head_block = sfs_data->bounce, *tail_block = head_block + block_size;
+  for (uint64_t i = 0; i < count; ++i) {
+    blocks[i] = buf + i * block_size - head_offset;
+  }
+  if (head_offset != 0 || (count == 1 && tail_len != block_size)) {
+    blocks[0] = head_block;
+  }
+  if (count > 1 && tail_len != block_size) {
+    blocks[count - 1] = tail_block;
+  }
 
-    if (sfs_fs_inode_block_read(sfs_data->fs, &inode, iblock, target)) {
-      log_msg("sfs_read() error reading iblock %" PRIu64 " from inode %" PRIu64,
-              iblock, inode.inumber);
-      SFS_UNLOCK_OR_FAIL(sfs_data, -1);
-      return -1;
-    }
+  if (sfs_fs_inode_range_read(sfs_data->fs, &inode, first_block, count,
+                              blocks)) {
+    log_msg("sfs_read() error reading iblocks %" PRIu64 "+%" PRIu64
+            " from inode %" PRIu64,
+            first_block, count, inode.inumber);
+    free(blocks);
+    SFS_UNLOCK_OR_FAIL(sfs_data, -1);
+    return -1;
+  }
+  sfs_readahead_update(sfs_data->readahead, &fd->readahead, inode.inumber,
+                       first_block, count);
 
-    if (slice_a == 0 && slice_b != BLOCK_SIZE) {
-      memcpy(buf + slice_a, tmp_block + slice_a, slice_b - slice_a);
-    }
+  if (blocks[0] == head_block) {
+    uint64_t len =
+        count == 1 ? tail_len - head_offset : block_size - head_offset;
+    memcpy(buf, head_block + head_offset, len);
+  }
+  if (count > 1 && blocks[count - 1] == tail_block) {
+    memcpy(buf + size - tail_len, tail_block, tail_len);
   }
 
+  free(blocks);
   SFS_UNLOCK_OR_FAIL(sfs_data, -1);
   return size;
 }
@@ -787,7 +876,7 @@ int sfs_write(const char *path, const char *buf, size_t size, off_t offset,
     SFS_UNLOCK_OR_FAIL(sfs_data, -1);
     return -1;
   }
-  inode.access_time = time(NULL);
+  sfs_fs_inode_touch(sfs_data->fs, &inode);
   if (offset + size > inode.size) {
     inode.change_time = time(NULL);
     inode.size = offset + size;
@@ -798,58 +887,120 @@ int sfs_write(const char *path, const char *buf, size_t size, off_t offset,
     return -1;
   }
 
-  uint64_t first_block = offset / BLOCK_SIZE;
-  uint64_t first_block_offset = offset % BLOCK_SIZE;
-  uint64_t last_block_len = (offset + size) % BLOCK_SIZE;
-  last_block_len = last_block_len == 0 ? BLOCK_SIZE : last_block_len;
-  uint64_t last_block = (offset + size) / BLOCK_SIZE;
-  last_block -= last_block_len == BLOCK_SIZE ? 1 : 0;
-
-  log_msg(
-      "first_block=%llu first_block_offset=%llu last_block_len=%llu "
-      "last_block=%llu",
-      first_block, first_block_offset, last_block_len, last_block);
-
-  // adjust |buf| to be BLOCK_SIZE aligned
-  buf -= first_block_offset;
-
-  sfs_block_t tmp_block;
-  for (uint64_t iblock = first_block; iblock <= last_block; ++iblock) {
-    uint64_t slice_a = 0;
-    uint64_t slice_b = BLOCK_SIZE;
-    if (iblock == first_block && first_block_offset != 0) {
-      slice_a = first_block_offset;
-    }
-    if (iblock == last_block && last_block_len != BLOCK_SIZE) {
-      slice_b = last_block_len;
-    }
-
-    const void *source = slice_a == 0 && slice_b == BLOCK_SIZE
-                             ? (buf + iblock * BLOCK_SIZE)
-                             : tmp_block;
+  const struct sfs_geometry *geometry = sfs_fs_geometry(sfs_data->fs);
+  uint64_t block_size = geometry->block_size;
+  struct sfs_slice slice;
+  geometry->slice(geometry, offset, size, &slice);
+  uint64_t first_block = slice.first_block;
+  uint64_t last_block = first_block + slice.count - 1;
+  uint64_t count = slice.count;
+  uint64_t head_offset = slice.head_offset;
+  uint64_t tail_len = slice.tail_len;
+
+  log_msg("first_block=%" PRIu64 " last_block=%" PRIu64 " head_offset=%" PRIu64
+          " tail_len=%" PRIu64,
+          first_block, last_block, head_offset, tail_len);
+
+  const void **blocks = malloc(count * sizeof(void *));
+  if (blocks == NULL) {
+    SFS_UNLOCK_OR_FAIL(sfs_data, -1);
+    return -ENOMEM;
+  }
 
-    if (slice_a == 0 && slice_b != BLOCK_SIZE) {
-      if (sfs_fs_inode_block_read(sfs_data->fs, &inode, iblock, tmp_block)) {
-        log_msg("error reading iblock %" PRIu64 " from inode %" PRIu64, iblock,
-                inode.inumber);
-        SFS_UNLOCK_OR_FAIL(sfs_data, -1);
-        return -1;
-      }
-      memcpy(tmp_block + slice_a, buf + slice_a, slice_b - slice_a);
+  // whole blocks are written straight from |buf|; partial ones at either end
+  // are read, patched in the bounce buffer, and written back
+  char *head_block = sfs_data->bounce, *tail_block = head_block + block_size;
+  for (uint64_t i = 0; i < count; ++i) {
+    blocks[i] = buf + i * block_size - head_offset;
+  }
+  if (head_offset != 0 || (count == 1 && tail_len != block_size)) {
+    if (sfs_fs_inode_block_read(sfs_data->fs, &inode, first_block,
+                                head_block)) {
+      log_msg("error reading iblock %" PRIu64 " from inode %" PRIu64,
+              first_block, inode.inumber);
+      free(blocks);
+      SFS_UNLOCK_OR_FAIL(sfs_data, -1);
+      return -1;
     }
-
-    if (sfs_fs_inode_block_write(sfs_data->fs, &inode, iblock, source)) {
-      log_msg("error writing iblock %" PRIu64 " to inode %" PRIu64, iblock,
-              inode.inumber);
+    uint64_t len =
+        count == 1 ? tail_len - head_offset : block_size - head_offset;
+    memcpy(head_block + head_offset, buf, len);
+    blocks[0] = head_block;
+  }
+  if (count > 1 && tail_len != block_size) {
+    if (sfs_fs_inode_block_read(sfs_data->fs, &inode, last_block,
+                                tail_block)) {
+      log_msg("error reading iblock %" PRIu64 " from inode %" PRIu64,
+              last_block, inode.inumber);
+      free(blocks);
       SFS_UNLOCK_OR_FAIL(sfs_data, -1);
       return -1;
     }
+    memcpy(tail_block, buf + size - tail_len, tail_len);
+    blocks[count - 1] = tail_block;
   }
 
+  if (sfs_fs_inode_range_write(sfs_data->fs, &inode, first_block, count,
+                               blocks)) {
+    log_msg("error writing iblocks %" PRIu64 "+%" PRIu64 " to inode %" PRIu64,
+            first_block, count, inode.inumber);
+    free(blocks);
+    SFS_UNLOCK_OR_FAIL(sfs_data, -1);
+    return -1;
+  }
+  free(blocks);
+
+  sfs_flusher_update(sfs_data->flusher);
+
   SFS_UNLOCK_OR_FAIL(sfs_data, -1);
   return size;
 }
 
+/** Get file system statistics
+ *
+ * The 'f_frsize', 'f_favail', 'f_fsid' and 'f_flag' fields are ignored
+ *
+ * Replaced 'struct statfs' parameter with 'struct statvfs' in
+ * version 2.5
+ */
+int sfs_statfs(const char *path, struct statvfs *statv) {
+  DECL_SFS_DATA(sfs_data);
+  SFS_LOCK_OR_FAIL(sfs_data, -1);
+
+  log_msg("path=\"%s\", statv=%p", path, statv);
+
+  // the counts are kept as blocks and inodes come and go, so this is cheap
+  sfs_fs_statvfs(sfs_data->fs, statv);
+
+  SFS_UNLOCK_OR_FAIL(sfs_data, -1);
+  return 0;
+}
+
+/** Synchronize file contents
+ *
+ * If the datasync parameter is non-zero, then only the user data
+ * should be flushed, not the meta data.
+ *
+ * Changed in version 2.2
+ */
+int sfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+  DECL_SFS_DATA(sfs_data);
+  SFS_LOCK_OR_FAIL(sfs_data, -1);
+
+  log_msg("path=\"%s\", datasync=%d, fi=%p", path, datasync, fi);
+
+  // the whole filesystem goes, metadata included: the file's blocks are no
+  // use without the bitmap and inode that say they are its
+  if (sfs_fs_sync(sfs_data->fs, &sfs_data->mu)) {
+    log_msg("sync failed");
+    SFS_UNLOCK_OR_FAIL(sfs_data, -1);
+    return -EIO;
+  }
+
+  SFS_UNLOCK_OR_FAIL(sfs_data, -1);
+  return 0;
+}
+
 /** Create a directory */
 int sfs_mkdir(const char *path, mode_t mode) {
   log_msg("path=\"%s\", mode=0%3o", path, mode);
@@ -1098,6 +1249,8 @@ struct fuse_operations sfs_oper = {.init = sfs_init,
                                    .release = sfs_release,
                                    .read = sfs_read,
                                    .write = sfs_write,
+                                   .statfs = sfs_statfs,
+                                   .fsync = sfs_fsync,
 
                                    .rmdir = sfs_rmdir,
                                    .mkdir = sfs_mkdir,
@@ -1108,9 +1261,46 @@ struct fuse_operations sfs_oper = {.init = sfs_init,
 
 void sfs_usage() {
   fprintf(stderr, "usage:  sfs [FUSE and mount options] diskFile mountPoint\n");
+  fprintf(stderr, "\nsfs options:\n");
+  fprintf(stderr, "    -o cache_mb=N          buffer cache size in MiB\n");
+  fprintf(stderr, "    -o io_uring            submit disk I/O via io_uring\n");
+  fprintf(stderr, "    -o mmap                map the disk file into memory\n");
+  fprintf(stderr, "    -o odirect             bypass the host page cache\n");
+  fprintf(stderr, "    -o block_size=N        block size when formatting\n");
+  fprintf(stderr, "    -o lazy_init           format without writing inodes\n");
+  fprintf(stderr, "    -o inode_format=N      compact inodes if N is 2\n");
+  fprintf(stderr, "    -o extents             map new files with extents\n");
+  fprintf(stderr, "    -o inline_data         keep tiny files in the inode\n");
+  fprintf(stderr, "    -o noatime             never update access times\n");
+  fprintf(stderr, "    -o relatime            update stale access times\n");
+  fprintf(stderr, "    -o readahead_kb=N      largest readahead window\n");
+  fprintf(stderr, "    -o dirty_expire_ms=N   write back blocks this old\n");
+  fprintf(stderr, "    -o dirty_ratio=N       max percent of cache dirty\n");
   exit(EXIT_SUCCESS);
 }
 
+#define SFS_OPT(t, p, v) \
+  { t, offsetof(struct sfs_state, p), v }
+
+// options consumed by sfs; everything else is passed on to FUSE
+static struct fuse_opt sfs_opts[] = {
+    SFS_OPT("cache_mb=%u", fs_options.cache_mb, 0),
+    SFS_OPT("io_uring", fs_options.block_backend, BLOCK_BACKEND_URING),
+    SFS_OPT("mmap", fs_options.block_backend, BLOCK_BACKEND_MMAP),
+    SFS_OPT("odirect", fs_options.block_backend, BLOCK_BACKEND_DIRECT),
+    SFS_OPT("block_size=%u", fs_options.block_size, 0),
+    SFS_OPT("lazy_init", fs_options.lazy_init, 1),
+    SFS_OPT("inode_format=%u", fs_options.inode_format, 0),
+    SFS_OPT("extents", fs_options.extents, 1),
+    SFS_OPT("inline_data", fs_options.inline_data, 1),
+    SFS_OPT("noatime", fs_options.atime, SFS_ATIME_NOATIME),
+    SFS_OPT("relatime", fs_options.atime, SFS_ATIME_RELATIME),
+    SFS_OPT("readahead_kb=%u", readahead_kb, 0),
+    SFS_OPT("dirty_expire_ms=%u", dirty_expire_ms, 0),
+    SFS_OPT("dirty_ratio=%u", dirty_ratio, 0),
+    FUSE_OPT_END,
+};
+
 int main(int argc, char *argv[]) {
   int fuse_stat;
   struct sfs_state *sfs_data;
@@ -1131,6 +1321,18 @@ int main(int argc, char *argv[]) {
   argv[argc - 1] = NULL;
   argc--;
 
+  memset(&sfs_data->fs_options, 0, sizeof(struct sfs_fs_options));
+  sfs_data->readahead_kb = 0;
+  sfs_data->bounce = NULL;
+  sfs_data->readahead = NULL;
+  sfs_data->dirty_expire_ms = 0;
+  sfs_data->dirty_ratio = 0;
+  sfs_data->flusher = NULL;
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  if (fuse_opt_parse(&args, sfs_data, sfs_opts, NULL) == -1) {
+    sfs_usage();
+  }
+
   // do this before calling other initialization functions
   sfs_data->logfile = log_open();
   if (sfs_data->logfile < 0) {
@@ -1152,8 +1354,9 @@ int main(int argc, char *argv[]) {
 
   // turn over control to fuse
   fprintf(stderr, "about to call fuse_main, %s \n", sfs_data->diskfile);
-  fuse_stat = fuse_main(argc, argv, &sfs_oper, sfs_data);
+  fuse_stat = fuse_main(args.argc, args.argv, &sfs_oper, sfs_data);
   fprintf(stderr, "fuse_main returned %d\n", fuse_stat);
+  fuse_opt_free_args(&args);
 
   return fuse_stat;
 }